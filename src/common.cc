@@ -32,6 +32,9 @@
 #include <mntent.h>
 #include <execinfo.h>
 #include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/limits.h>
 
 /*
  * Setup SIGABRT and SIGSEGV signal handler for backtracing
@@ -173,53 +176,100 @@ std::vector<std::string> matchPath( const std::string & filesearch )
 }
 
 /*
- * Determine full path.
- * If base path is empty use current_path() at the time of entry to main().
- * Resolve "." and ".." and merge with working directory
+ * Append the components of path to the normalized path in buf[0..pos).
+ * "." and empty components are dropped, ".." removes the last component.
+ * buf holds no trailing slash. The root directory is an empty buffer.
  */
-fs::path realpath(fs::path ph, fs::path base)
+static bool appendComponents(char* buf, size_t size, size_t& pos, const char* path)
 {
-    fs::path mypath;
-    if(!base.has_root_directory())
-        base.clear();
-    /*
-     * boost::filesystem2::compare() throw an assert on path names like: "//.esd.conf"
-     * I don't know why but path::is_complete() returns false while path::has_root_name()
-     * is true. 
-     * Fix this by removing leading double slash.
-     */
-    while(ph.string().size() > 1 && !ph.string().compare(0,2, "//"))
-      ph = ph.string().substr(1);
-
-    while(base.string().size() > 1 && !base.string().compare(0,2, "//"))
-      base = base.string().substr(1);
-
-    /*
-     * combine base and path to full path
-     */
-    if(base.empty())
-        mypath = complete(ph); //base is current working directory
-    else
-        mypath = complete(ph, base);
-    
-    fs::path result;
-
-    /*
-     * Clean up full path by resolving ".." and "." directories.
-     */
-    for(fs::path::iterator it = mypath.begin();
-        it != mypath.end();
-        it++)
+    const char* p = path;
+    while(*p)
     {
-        if(*it == "..")
-            result = result.parent_path();
-        else if(*it == ".")
+        while(*p == '/')
+            p++;
+        const char* begin = p;
+        while(*p && *p != '/')
+            p++;
+        size_t len = p - begin;
+
+        if(len == 0 || (len == 1 && begin[0] == '.'))
+            continue;
+        if(len == 2 && begin[0] == '.' && begin[1] == '.')
+        {
+            while(pos > 0 && buf[--pos] != '/')
+                ;
             continue;
+        }
+        // keep space for the terminating null byte
+        if(pos + 1 + len >= size)
+            return false;
+        buf[pos++] = '/';
+        memcpy(buf + pos, begin, len);
+        pos += len;
+    }
+    return true;
+}
+
+/*
+ * Write the absolute and normalized form of path to buf without
+ * accessing the filesystem. Relative paths are taken relative to base,
+ * or to the current working directory if base is not absolute.
+ * Symbolic links are not resolved.
+ *
+ * Return length of the result or 0 if it does not fit into buf.
+ */
+size_t normalizePath(char* buf, size_t size, const char* path, const char* base)
+{
+    size_t pos = 0;
+
+    if(*path != '/')
+    {
+        if(base && *base == '/')
+        {
+            if(!appendComponents(buf, size, pos, base))
+                return 0;
+        }
         else
-            result /= (*it);
+        {
+            if(NULL == getcwd(buf, size))
+                return 0;
+            // getcwd(3) returns an already normalized path
+            pos = strlen(buf);
+            if(pos == 1)
+                pos = 0;
+        }
+    }
+    if(!appendComponents(buf, size, pos, path))
+        return 0;
+
+    if(pos == 0)
+    {
+        if(size < 2)
+            return 0;
+        buf[pos++] = '/';
     }
+    buf[pos] = '\0';
+    return pos;
+}
+
+/*
+ * Determine full path.
+ * If base path is not absolute use the current working directory.
+ * Resolve "." and ".." like normalizePath(). Return ph unchanged if
+ * the result would exceed the buffer.
+ */
+fs::path realpath(fs::path ph, fs::path base)
+{
+    const std::string& path = ph.string();
+    const std::string& base_str = base.string();
+
+    // room for the working directory if base is not absolute
+    size_t size = path.size() + base_str.size() + PATH_MAX + 2;
+    std::vector<char> buf(size);
 
-    return result;
+    if(0 == normalizePath(&buf[0], size, path.c_str(), base_str.c_str()))
+        return ph;
+    return fs::path(&buf[0]);
 }
 
 /*
@@ -263,6 +313,72 @@ pid_t readPidFile(const char* path)
     return tmp;
 }
 
+/*
+ * Read the whole content of a file.
+ * Return false if the file cannot be read.
+ */
+bool readFile(const char* path, std::string& content)
+{
+    char buf[64*1024];
+    ssize_t len;
+
+    content.clear();
+    int fd = open(path, O_RDONLY);
+    if(-1 == fd)
+        return false;
+
+    while(0 < (len = read(fd, buf, sizeof(buf))))
+        content.append(buf, len);
+    close(fd);
+
+    return len == 0;
+}
+
+/*
+ * Replace file content atomically.
+ * The content is written to a temporary file in the same directory, which
+ * is renamed over path. Readers see either the old or the new content.
+ */
+bool writeFileAtomic(const char* path, const std::string& content)
+{
+    std::string tmp = std::string(path) + ".tmp";
+    const char* p = content.data();
+    size_t left = content.size();
+
+    int fd = open(tmp.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    if(-1 == fd)
+    {
+        error(_("Cannot open %s: %s"), tmp.c_str(), strerror(errno));
+        return false;
+    }
+
+    while(left)
+    {
+        ssize_t len = write(fd, p, left);
+        if(len < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            error(_("Cannot write %s: %s"), tmp.c_str(), strerror(errno));
+            close(fd);
+            unlink(tmp.c_str());
+            return false;
+        }
+        p += len;
+        left -= len;
+    }
+
+    bool ok = 0 == fsync(fd);
+    ok = (0 == close(fd)) && ok;
+    if(!ok || 0 != rename(tmp.c_str(), path))
+    {
+        error(_("Cannot replace %s: %s"), path, strerror(errno));
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
 /*
  * Create pid file
  * Return true on success
@@ -301,7 +417,7 @@ bool createPidFile(const char* path)
 }
 
 
-bool Interruptible::interrupted = false;
+volatile bool Interruptible::interrupted = false;
 
 void Interruptible::interrupt()
 {
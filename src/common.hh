@@ -36,7 +36,10 @@ void setStdIn2NonBlocking();
 const boost::regex path2regex(std::string path);
 std::vector<std::string> matchPath( const std::string & filesearch );
 fs::path realpath(fs::path _path, fs::path _cwd = "");
+size_t normalizePath(char* buf, size_t size, const char* path, const char* base = NULL);
 std::string getPathFromFd(int fd);
+bool readFile(const char* path, std::string& content);
+bool writeFileAtomic(const char* path, const std::string& content);
 
 /*
  * pid file operations
@@ -73,7 +76,7 @@ class Interruptible
     protected:
         void interruptionPoint();
     private:
-        static bool interrupted;
+        static volatile bool interrupted;
 };
 
 void signalHandler(int signum);
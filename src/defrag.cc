@@ -21,8 +21,11 @@
 #include "defrag.hh"
 #include "balloc.h"
 #include "fiemap.hh"
+#include "placement.hh"
 #include "logging.hh"
-#include "buddycache.hh"
+#include "freespace.hh"
+#include "planner.hh"
+#include "parsefilelist.hh"
 extern "C" {
     #include "config.h"
 }
@@ -38,16 +41,29 @@ extern "C" {
 /* opendir*/
 #include <sys/types.h>
 #include <dirent.h>
+#include <pthread.h>
 #include <stdexcept>
+#include <set>
 
 #include <boost/foreach.hpp>
 
 // set thread priority
 #include <linux/unistd.h>
 #include <sys/resource.h>
+#include <sys/utsname.h>
+#include <sys/time.h>
 
 #define gettid() syscall(__NR_gettid)
 
+// placeholder files allocated at most by mainline mode
+#define PLACEHOLDER_TRIES 4
+
+// the check is bound by I/O latency rather than by cpus
+#define DEFAULT_CHECK_THREADS 8
+
+// bytes moved at once by a throttled realloc
+#define THROTTLE_CHUNK (1U << 20)
+
 std::string defrag_mode;
 
 #ifdef __STRICT_ANSI__
@@ -62,6 +78,14 @@ char *strdup(const char *str) {
 typedef struct
 {
     const char* defrag_mode;
+    bool incremental;
+    const char* state_file;
+    int pipeline_window;
+    int threads;
+    int throttle_rate;          // MiB/s
+    bool throttle_idle;
+    double throttle_pressure;   // percent
+    int throttle_inflight;
 } configuration;
 
 static int config_handler(void* user, const char* section, const char* name,
@@ -72,6 +96,22 @@ static int config_handler(void* user, const char* section, const char* name,
     #define MATCH(s, n) strcmp(section, s) == 0 && strcmp(name, n) == 0
       if (MATCH("Realloc", "defrag_mode")) {
         pconfig->defrag_mode = strdup(value);
+    } else if (MATCH("Realloc", "incremental")) {
+        pconfig->incremental = strcmp(value, "true") == 0;
+    } else if (MATCH("Realloc", "state_file")) {
+        pconfig->state_file = strdup(value);
+    } else if (MATCH("Realloc", "pipeline_window")) {
+        pconfig->pipeline_window = atoi(value);
+    } else if (MATCH("Realloc", "threads")) {
+        pconfig->threads = atoi(value);
+    } else if (MATCH("Realloc", "throttle_rate")) {
+        pconfig->throttle_rate = atoi(value);
+    } else if (MATCH("Realloc", "throttle_idle")) {
+        pconfig->throttle_idle = strcmp(value, "true") == 0;
+    } else if (MATCH("Realloc", "throttle_pressure")) {
+        pconfig->throttle_pressure = atof(value);
+    } else if (MATCH("Realloc", "throttle_inflight")) {
+        pconfig->throttle_inflight = atoi(value);
     } else {
         return 0;  /* unknown section/name, error */
     }
@@ -150,9 +190,231 @@ Defrag::Defrag()
     not_extent_based  = 0;
     empty_files       = 0;
     sparse_files      = 0;
+    pipeline_window   = 0;
+    check_threads     = 0;
 }
 Optimizer::Optimizer()
+    : full(false), in_place(0)
+{
+}
+
+/*
+ * Realloc job of one device
+ */
+struct DeviceJob
+{
+        DeviceJob(Optimizer* o, Device d, std::vector<OrigDonorPair>* f)
+            : optimizer(o), device(d), files(f), name(d.getDeviceName()) {}
+        Optimizer* optimizer;
+        Device device;
+        std::vector<OrigDonorPair>* files;
+        std::string name;       // tags log messages of the worker
+};
+
+void* Optimizer::defragThread(void* arg)
+{
+    DeviceJob* job = (DeviceJob*)arg;
+
+    logger.setThreadTag(job->name.c_str());
+    try {
+        job->optimizer->defragRelatedFiles(job->device, *job->files);
+    }
+    catch(std::exception& e)
+    {
+        error("%s", e.what());
+    }
+    logger.setThreadTag(NULL);
+    return NULL;
+}
+
+/*
+ * Devices do not share any resources. So each device is processed by a
+ * worker thread of its own. Log messages of a worker are tagged with the
+ * device name. On interruption every worker removes its donor files.
+ */
+void Optimizer::defragDevices(filemap_t& filemap)
+{
+    if(filemap.size() == 1)
+    {
+        defragRelatedFiles(filemap.begin()->first, filemap.begin()->second);
+        return;
+    }
+
+    std::vector<DeviceJob> jobs;
+    for(filemap_t::iterator it= filemap.begin();
+        it != filemap.end();
+        it++)
+        jobs.push_back(DeviceJob(this, it->first, &it->second));
+
+    std::vector<pthread_t> tids(jobs.size());
+    std::vector<bool> started(jobs.size(), false);
+
+    for(size_t i = 0; i < jobs.size(); i++)
+        started[i] = 0 == pthread_create(&tids[i], NULL, defragThread, &jobs[i]);
+
+    for(size_t i = 0; i < jobs.size(); i++)
+    {
+        if(started[i])
+            pthread_join(tids[i], NULL);
+        else
+            defragThread(&jobs[i]);
+    }
+}
+
+/*
+ * A full run ignores the layout of the last run and moves all files.
+ */
+void Optimizer::setFullRun(bool f)
+{
+    full = f;
+}
+
+/*
+ * Line of the state file. Format of a file list with the details
+ * "b=<size in bytes> p=<physical start in bytes>".
+ * Constructors are necessary to use common file list parser
+ */
+class StateLine
+{
+    public:
+        StateLine(dev_t d, ino_t i, fs::path)
+            : dev(d), ino(i) {}
+        StateLine(fs::path)
+            : dev(0), ino(0) {}
+        dev_t dev;
+        ino_t ino;
+};
+
+void Optimizer::loadLayout(const char* path)
+{
+    std::vector<StateLine> lines;
+    std::vector<std::string> details;
+
+    FILE* file = fopen(path, "r");
+    if(NULL == file)
+    {
+        info(_("No layout of a previous run: %s: %s"), path, strerror(errno));
+        return;
+    }
+    try {
+        parseInputStream(file, lines, &details);
+    } catch(std::exception& e) {
+        warn("%s", e.what());
+    }
+    fclose(file);
+
+    for(size_t i = 0; i < lines.size(); i++)
+    {
+        Placement p;
+        unsigned long long size, physical;
+        if(2 != sscanf(details[i].c_str(), "b=%llu p=%llu", &size, &physical))
+            continue;
+        p.size = size;
+        p.physical = physical;
+        layout[std::make_pair(lines[i].dev, lines[i].ino)] = p;
+    }
+}
+
+/*
+ * Write the placement of all files placed by this run or kept in place.
+ */
+void Optimizer::saveLayout(const char* path, filemap_t& filemap)
+{
+    ExtentCache* extents = ExtentCache::instance();
+    std::string content;
+    char buf[128];
+    struct stat st;
+
+    for(filemap_t::iterator it = filemap.begin(); it != filemap.end(); ++it)
+        BOOST_FOREACH(OrigDonorPair& odp, it->second)
+        {
+            if(!odp.placed)
+                continue;
+            const char* file = odp.origPath.string().c_str();
+            const struct fiemap* fmap = extents->get(file);
+            if(NULL == fmap || 0 == fmap->fm_mapped_extents || 0 > stat(file, &st))
+                continue;
+
+            sprintf(buf, "%u %u ", (__u32)st.st_dev, (__u32)st.st_ino);
+            content += buf;
+            content += file;
+            sprintf(buf, "\tb=%llu p=%llu\n", get_file_size(fmap),
+                    fmap->fm_extents[0].fe_physical);
+            content += buf;
+        }
+
+    if(!writeFileAtomic(path, content))
+        warn(_("Cannot write state file %s: %s"), path, strerror(errno));
+}
+
+static bool isContiguous(const struct fiemap* fmap)
+{
+    for(__u32 i = 1; i < fmap->fm_mapped_extents; i++)
+        if(fmap->fm_extents[i].fe_physical != fmap->fm_extents[i-1].fe_physical
+                                            + fmap->fm_extents[i-1].fe_length)
+            return false;
+    return true;
+}
+
+/*
+ * Files placed by the last run stay where they are unless they have been
+ * changed, fragmented or are out of sequence. Changed means new, grown or
+ * rewritten. A file following a kept file is placed near the end of it.
+ */
+void Optimizer::keepPlacedFiles(Device device, std::vector<OrigDonorPair>& files)
+{
+    ExtentCache* extents = ExtentCache::instance();
+    __u64 end = 0;          // end of the last file kept in bytes
+    bool prev_kept = false;
+    struct stat st;
+
+    BOOST_FOREACH(OrigDonorPair& odp, files)
+    {
+        if(odp.blocks == 0)
+            continue;
+
+        const char* file = odp.origPath.string().c_str();
+        const struct fiemap* fmap = extents->get(file);
+        layout_t::iterator it = layout.end();
+        if(fmap && fmap->fm_mapped_extents && 0 == stat(file, &st))
+            it = layout.find(std::make_pair(st.st_dev, st.st_ino));
+
+        if(it != layout.end()
+           && !odp.isSparseFile
+           && isContiguous(fmap)
+           && it->second.size == get_file_size(fmap)
+           && it->second.physical == fmap->fm_extents[0].fe_physical
+           && it->second.physical >= end)
+        {
+            odp.blocks = 0;
+            odp.placed = true;
+            end = it->second.physical + get_allocated_file_size(fmap);
+            prev_kept = true;
+            in_place++;
+        }
+        else
+        {
+            if(prev_kept)
+                odp.goal = end / device.getBlockSize();
+            prev_kept = false;
+        }
+    }
+}
+
+/*
+ * Return true if the running kernel is version major.minor or newer.
+ */
+static bool isKernelVersionAtLeast(int major, int minor)
 {
+    struct utsname uts;
+    int kernel_major = 0, kernel_minor = 0;
+
+    if(-1 == uname(&uts)
+       || 2 != sscanf(uts.release, "%d.%d", &kernel_major, &kernel_minor))
+        return false;
+
+    return kernel_major > major
+        || (kernel_major == major && kernel_minor >= minor);
 }
 
 /*
@@ -236,12 +498,33 @@ bool checkFileSystem(Device device)
 void Optimizer::relatedFiles(std::vector<fs::path>& files)
 {
     try {
-        typedef std::map<Device, std::vector<OrigDonorPair> > filemap_t;
-        std::map<Device, std::vector<OrigDonorPair> > filemap;
+        filemap_t filemap;
         
         int files_unavailable     = 0;
         int wrong_filesystem_type = 0;
 
+        configuration config;
+        config.defrag_mode = "auto";
+        config.incremental = true;
+        config.state_file = "/var/lib/e4rat-lite/realloc.state";
+        config.pipeline_window = 0;
+        config.threads = 0;
+        config.throttle_rate = 0;
+        config.throttle_idle = false;
+        config.throttle_pressure = 0;
+        config.throttle_inflight = 0;
+        if (ini_parse("/etc/e4rat-lite.conf", config_handler, &config) < 0) {
+            throw std::logic_error(std::string(_("Cannot open file: "))+"/etc/e4rat-lite.conf: " + strerror(errno));
+        } else {
+            defrag_mode = config.defrag_mode;
+            pipeline_window = config.pipeline_window > 0 ? config.pipeline_window : 0;
+            check_threads = config.threads > 0 ? config.threads : 0;
+            throttle.rate = config.throttle_rate > 0 ? (__u64)config.throttle_rate << 20 : 0;
+            throttle.idle = config.throttle_idle;
+            throttle.pressure = config.throttle_pressure;
+            throttle.inflight = config.throttle_inflight > 0 ? config.throttle_inflight : 0;
+        }
+
         /*
          * Sort files per devices
          */
@@ -308,12 +591,6 @@ void Optimizer::relatedFiles(std::vector<fs::path>& files)
         /*
          * Apply defrag mode
          */
-        configuration config;
-        if (ini_parse("/etc/e4rat-lite.conf", config_handler, &config) < 0) {
-            throw std::logic_error(std::string(_("Cannot open file: "))+"/etc/e4rat-lite.conf: " + strerror(errno));
-        } else {
-            defrag_mode = config.defrag_mode;
-        }
         if("auto" == defrag_mode || "pa" == defrag_mode)
         {
             bool ret;
@@ -325,21 +602,25 @@ void Optimizer::relatedFiles(std::vector<fs::path>& files)
                     break;
                 }
             ret = doesKernelSupportPA(file);
-            if("auto" == defrag_mode && ret)
-                defrag_mode = "pa";
-            else if("pa" == defrag_mode && !ret)
+            if("pa" == defrag_mode && !ret)
                 throw std::logic_error(_("Kernel does not support pre-allocation"));
+            else if(ret)
+                defrag_mode = "pa";
+            else if(isKernelVersionAtLeast(3, 18))
+                defrag_mode = "mainline";
             else
                 defrag_mode = "locality_group";
         }
 
-        if(defrag_mode != "pa" && sparse_files)
+        if(defrag_mode != "pa" && defrag_mode != "mainline" && sparse_files)
             notice(_("%*d/%d file(s) are sparse-files which will retain gaps of unallocated blocks."),
                    (int)(log10(files.size())+1), sparse_files , files.size());
 
         const char* defrag_mode_msg;
         if(defrag_mode == "pa")
             defrag_mode_msg = "pre-allocation";
+        else if(defrag_mode == "mainline")
+            defrag_mode_msg = "placeholder file";
         else if(defrag_mode == "locality_group")
             defrag_mode_msg = "locality group";
         else if(defrag_mode == "tld")
@@ -348,123 +629,230 @@ void Optimizer::relatedFiles(std::vector<fs::path>& files)
             throw std::runtime_error(std::string(_("Unknown defrag mode: ")) + defrag_mode);
         
         notice(_("Defrag mode: %s"), defrag_mode_msg);
-        
+
         /*
-         * Let's rock!
+         * Keep files placed by the last run
          */
-        for(filemap_t::iterator it= filemap.begin();
-            it != filemap.end();
-            it++)
+        if(config.incremental && !full)
         {
-            defragRelatedFiles(it->first, it->second);
+            loadLayout(config.state_file);
+            for(filemap_t::iterator it= filemap.begin();
+                it != filemap.end();
+                it++)
+                keepPlacedFiles(it->first, it->second);
+            if(in_place)
+                notice(_("%*d/%d file(s) are unchanged and stay in place."),
+                       (int)(log10(files.size())+1), in_place, files.size());
         }
+        
+        /*
+         * Let's rock!
+         */
+        defragDevices(filemap);
+
+        saveLayout(config.state_file, filemap);
     }
     catch(UserInterrupt& e)
     {
     }
+
+    info(_("%lu FIEMAP ioctl(s), extent cache peak size %lu bytes"),
+         get_fiemap_ioctl_count(),
+         (unsigned long)ExtentCache::instance()->getPeakMemory());
 }
 
 
+/*
+ * Counters of files sorted out by checkFile()
+ */
+struct AttributeCounts
+{
+        AttributeCounts()
+            : invalid_file_type(0), not_writable(0), not_extent_based(0),
+              empty_files(0), sparse_files(0) {}
+        int invalid_file_type;
+        int not_writable;
+        int not_extent_based;
+        int empty_files;
+        int sparse_files;
+};
+
 /*
  * Check file's attributes.
  * Sort out files move extent call will fail.
  * If file is valid OrigDonorPair::blocks is set
  */
-void Defrag::checkFilesAttributes(Device device, std::vector<OrigDonorPair>& files)
+static void checkFile(Device& device, OrigDonorPair& odp, AttributeCounts& counts)
 {
     struct stat st;
     int flags;
-    struct fiemap* fmap;
+    const struct fiemap* fmap;
+    std::string path_str = odp.origPath.string();
+    const char* path = path_str.c_str();
     
-    BOOST_FOREACH(OrigDonorPair& odp, files)
-    {
-        const char* path = odp.origPath.string().c_str();
-        
-        // we cannot open fd of symbolic link. therefore open with O_NOFOLLOW
-        // in case of a symbolic link will fail regardless
+    // we cannot open fd of symbolic link. therefore open with O_NOFOLLOW
+    // in case of a symbolic link will fail regardless
 #ifdef MOVE_EXT_RDONLY_FLAG
-        int fd = open(path, O_RDONLY | O_NOFOLLOW);
+    int fd = open(path, O_RDONLY | O_NOFOLLOW);
 #else
-        int fd = open(path, O_RDWR | O_NOFOLLOW);
+    int fd = open(path, O_RDWR | O_NOFOLLOW);
 #endif
-        if (fd < 0)
+    if (fd < 0)
+    {
+        switch(errno)
         {
-            switch(errno)
-            {
-                case ELOOP:
-                    invalid_file_type++;
-                    info(_("Cannot open file: %s: is a symbolic link"), path);
-                    continue;
-                case EISDIR:
-                    invalid_file_type++; break;
-                default:
-                    not_writable++;
-            }
-
-            info(_("Cannot open file: %s: %s"), path, strerror(errno));
-            continue;
+            case ELOOP:
+                counts.invalid_file_type++;
+                info(_("Cannot open file: %s: is a symbolic link"), path);
+                return;
+            case EISDIR:
+                counts.invalid_file_type++; break;
+            default:
+                counts.not_writable++;
         }
 
-        if(fstat(fd, &st) < 0)
-        {
-            close(fd);
-            info(_("Cannot get file statistics: %s: %s"),path,strerror(errno));
-            invalid_file_type++;
-            goto cont;
-        }
+        info(_("Cannot open file: %s: %s"), path, strerror(errno));
+        return;
+    }
 
-        if(!S_ISREG(st.st_mode))
-        {
-            info(_("%s is not a regular file."), path);
-            invalid_file_type++;
-            goto cont;
-        }
+    if(fstat(fd, &st) < 0)
+    {
+        info(_("Cannot get file statistics: %s: %s"),path,strerror(errno));
+        counts.invalid_file_type++;
+        goto cont;
+    }
 
-        if(0 > ioctl(fd, FS_IOC_GETFLAGS, &flags))
-        {
-            info(_("Cannot receive inode flags: %s: %s"), path, strerror(errno));
-            invalid_file_type++;
-            goto cont;
-        }
+    if(!S_ISREG(st.st_mode))
+    {
+        info(_("%s is not a regular file."), path);
+        counts.invalid_file_type++;
+        goto cont;
+    }
 
-        if(!(flags & EXT4_EXTENTS_FL))
-        {
-            flags |= EXT4_EXTENTS_FL;
-            if(0> ioctl(fd, FS_IOC_SETFLAGS, &flags))
-            {
-                info(_("Cannot convert file %s to be extent based: %s"),
-                     path, strerror(errno));
-                not_extent_based++;
-                goto cont;
-            }
-        }
+    if(0 > ioctl(fd, FS_IOC_GETFLAGS, &flags))
+    {
+        info(_("Cannot receive inode flags: %s: %s"), path, strerror(errno));
+        counts.invalid_file_type++;
+        goto cont;
+    }
 
-        if(flags & FS_IMMUTABLE_FL)
+    if(!(flags & EXT4_EXTENTS_FL))
+    {
+        flags |= EXT4_EXTENTS_FL;
+        if(0> ioctl(fd, FS_IOC_SETFLAGS, &flags))
         {
-            info(_("%s is immutable."), path);
-            not_writable++;
+            info(_("Cannot convert file %s to be extent based: %s"),
+                 path, strerror(errno));
+            counts.not_extent_based++;
             goto cont;
         }
+    }
 
-        fmap = ioctl_fiemap(fd);
-        odp.blocks= get_file_size(fmap) / device.getBlockSize();
-        
-        if(0 == odp.blocks)
-        {
-            info(_("File %s has no blocks."), path);
-            empty_files++;
-            goto cont;
-        }
+    if(flags & FS_IMMUTABLE_FL)
+    {
+        info(_("%s is immutable."), path);
+        counts.not_writable++;
+        goto cont;
+    }
 
-        odp.isSparseFile = is_sparse_file(fmap);
-        if(odp.isSparseFile)
-        {
-            info(_("%s is a sparse-file"), path);
-            sparse_files++;
-        }
+    fmap = ExtentCache::instance()->get(fd);
+    odp.blocks= get_file_size(fmap) / device.getBlockSize();
+    
+    if(0 == odp.blocks)
+    {
+        info(_("File %s has no blocks."), path);
+        counts.empty_files++;
+        goto cont;
+    }
+
+    odp.isSparseFile = is_sparse_file(fmap);
+    if(odp.isSparseFile)
+    {
+        info(_("%s is a sparse-file"), path);
+        counts.sparse_files++;
+    }
 cont:        
-        close(fd);
+    close(fd);
+}
+
+/*
+ * Worker of checkFilesAttributes(). Files are taken one by one from the
+ * shared position next, because the time per file varies a lot.
+ */
+struct CheckJob
+{
+        Device* device;
+        std::vector<OrigDonorPair>* files;
+        size_t* next;
+        AttributeCounts counts;
+};
+
+static void* checkThread(void* arg)
+{
+    CheckJob* job = (CheckJob*)arg;
+    std::vector<OrigDonorPair>& files = *job->files;
+    size_t i;
+
+    while((i = __sync_fetch_and_add(job->next, 1)) < files.size())
+        checkFile(*job->device, files[i], job->counts);
+    return NULL;
+}
+
+/*
+ * Sort out files the move extent ioctl would fail on.
+ *
+ * On a cold cache each file costs random metadata reads. Several files
+ * are checked at the same time to keep the disk queue filled. The number
+ * of threads is check_threads or, if 0, DEFAULT_CHECK_THREADS.
+ */
+void Defrag::checkFilesAttributes(Device device, std::vector<OrigDonorPair>& files)
+{
+    unsigned int threads = check_threads;
+    struct timeval start, end;
+    size_t next = 0;
+
+    if(threads == 0)
+        threads = DEFAULT_CHECK_THREADS;
+    if(threads > files.size())
+        threads = files.size() ? files.size() : 1;
+
+    std::vector<CheckJob> jobs(threads);
+    std::vector<pthread_t> tids(threads);
+    std::vector<bool> started(threads, false);
+
+    // create the singletons checkFile() uses before the threads share them
+    ExtentCache::instance();
+
+    gettimeofday(&start, NULL);
+    for(unsigned int i = 0; i < threads; i++)
+    {
+        jobs[i].device = &device;
+        jobs[i].files = &files;
+        jobs[i].next = &next;
+        // the calling thread takes the first job
+        if(i > 0)
+            started[i] = 0 == pthread_create(&tids[i], NULL, checkThread, &jobs[i]);
+    }
+    checkThread(&jobs[0]);
+
+    for(unsigned int i = 1; i < threads; i++)
+        if(started[i])
+            pthread_join(tids[i], NULL);
+    gettimeofday(&end, NULL);
+
+    BOOST_FOREACH(CheckJob& job, jobs)
+    {
+        invalid_file_type += job.counts.invalid_file_type;
+        not_writable      += job.counts.not_writable;
+        not_extent_based  += job.counts.not_extent_based;
+        empty_files       += job.counts.empty_files;
+        sparse_files      += job.counts.sparse_files;
     }
+
+    info(_("Checked %u file(s) in %.0f ms with %u thread(s)"),
+         (unsigned int)files.size(),
+         (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_usec - start.tv_usec) / 1e3,
+         threads);
 }
 
 /*
@@ -556,37 +944,21 @@ Extent findExtent(Device device, __u64 phint, __u32 len)
 /*
  * Find free block range on device. phint says where to start searching.
  * user space pre-allocation is limited to blocks_per_group -10.
- * Use buddy information to search for bigger block range.
+ * Look up larger block ranges in the free space index. If there is no
+ * range of len blocks the longest one is taken.
  */
-Extent findFreeSpace(Device device, __u64 phint, __u64 len)
+Extent findFreeSpace(Device device, FreeSpaceIndex& index, __u64 phint, __u64 len)
 {
-    // check for pre-allocation block request limit
-    // use BuddyCache to satisfy the request
     if( len > device.getBlocksPerGroup() - 10)
     {
-        BuddyCache buddyCache(device);
-
-        // find empty flex group
-        if(len > device.getBlocksPerGroup())
-        {
-            int flex = buddyCache.findEmptyFlex();
-            if(flex > 0)
-            {
-                return Extent(
-                        flex<<device.getLogGroupsPerFlex()
-                        * device.getBlocksPerGroup(),
-                        device.freeBlocksPerFlex());
-            }
-        }
-
-        // no empty flex group found
-        // search for empty block groups
-        int bg = buddyCache.findEmptyGroup();
-        if(bg > 0)
+        __u64 min_len = std::min(len, (__u64)index.largest().len);
+        Extent extent = index.findFirst(min_len, phint);
+        if(extent.len == 0)
+            extent = index.findFirst(min_len, 0);
+        if(extent.len)
         {
-            return Extent(
-                bg*device.getBlocksPerGroup() + buddyCache.at(bg).first,
-                        buddyCache.at(bg).free);
+            index.reserve(extent);
+            return extent;
         }
     }
 
@@ -595,27 +967,15 @@ Extent findFreeSpace(Device device, __u64 phint, __u64 len)
 
 /*
  * Creating donor files using pre-allocation patch from Kazuya Mio.
+ * Blocks are pre-allocated as planned by LayoutPlanner.
  */
 void Defrag::createDonorFiles_PA(Device& device, 
-                                 std::vector<OrigDonorPair>& files)
+                                 std::vector<OrigDonorPair>& files,
+                                 FreeSpaceIndex& index)
 {
     int fd;
-    /*
-     * calculate total amount of blocks
-     */
-    size_t blk_count = 0;
-    BOOST_FOREACH(OrigDonorPair& odp, files)
-    {
-        if(odp.blocks == 0)
-            continue;
-        if(odp.isSparseFile)
-            blk_count += get_allocated_file_size(odp.origPath.string().c_str()) / device.getBlockSize();
-        else
-            blk_count += odp.blocks;
-    }
-
+    __u32 block_size = device.getBlockSize();
 
-    Extent free_space = findFreeSpace(device, 0, blk_count);
     BOOST_FOREACH(OrigDonorPair& odp, files)
     {
         if(odp.blocks == 0)
@@ -627,74 +987,27 @@ void Defrag::createDonorFiles_PA(Device& device,
             throw std::runtime_error(std::string(_("Cannot open donor file: "))
                                  + odp.donorPath.string() + strerror(errno));
 
-        if(odp.isSparseFile)
+        BOOST_FOREACH(PlannedExtent& piece, odp.plan)
         {
-            int orig_fd = open(odp.origPath.string().c_str(), O_RDONLY);
-            if(orig_fd < 0)
-                throw std::runtime_error(std::string(_("Cannot open orig file: "))
-                                         + odp.origPath.string() + strerror(errno));
-            struct fiemap* fmap = ioctl_fiemap(orig_fd);
-            close(orig_fd);
-            for(__u32 i = 0; i< fmap->fm_mapped_extents; i++)
-            {
-                __u64 offset = 0;
-                while(offset < fmap->fm_extents[i].fe_length / device.getBlockSize())
-                {
-                    if(free_space.len == 0)
-                    {
-                        debug(_("Out of continued space: %s: will might fragmented"), odp.origPath.string().c_str());
-                        free_space = findFreeSpace(device, free_space.start, blk_count);
-                    }
-                    __u64 pa_blocks = std::min( fmap->fm_extents[i].fe_length / device.getBlockSize() - offset,
-                                                (__u64)free_space.len);
-                    
-                    try {
-                        device.preallocate(fd,
-                                           free_space.start,
-                                           fmap->fm_extents[i].fe_logical / device.getBlockSize() + offset,
-                                           pa_blocks,
-                                           EXT4_MB_MANDATORY);
-                        
-                        offset           += pa_blocks;
-                        blk_count        -= pa_blocks;
-                        free_space.len   -= pa_blocks;
-                        free_space.start += pa_blocks;
-                    }
-                    catch(Extent& e)
-                    {
-                        debug(_("pre-allocate failed: %s: blocks are already in use"), odp.origPath.string().c_str());
-                        free_space = e;
-                    }
-                }
-                if(fallocate(fd, 0,
-                         fmap->fm_extents[i].fe_logical,
-                         fmap->fm_extents[i].fe_length))
-                    throw std::runtime_error(std::string(_("Cannot allocate blocks for donor: "))
-                                     + odp.donorPath.string() + strerror(errno));
-            }
-        }
-        else
-        {       
-            __u64 file_offset = 0;
-            do
+            Extent free_space(piece.physical, piece.physical ? piece.len : 0);
+            __u64 offset = 0;
+            while(offset < piece.len)
             {
                 if(free_space.len == 0)
                 {
                     debug(_("Out of continued space: %s: will might fragmented"), odp.origPath.string().c_str());
-                    free_space = findFreeSpace(device, free_space.start, blk_count);
+                    free_space = findFreeSpace(device, index, free_space.start, piece.len - offset);
                 }
-                __u64 pa_blocks = std::min( odp.blocks - file_offset,
-                                            (__u64)free_space.len);
-                
+                __u64 pa_blocks = std::min(piece.len - offset, (__u64)free_space.len);
+
                 try {
                     device.preallocate(fd,
                                        free_space.start,
-                                       file_offset,
+                                       piece.logical + offset,
                                        pa_blocks,
                                        EXT4_MB_MANDATORY);
-                    
-                    file_offset      += pa_blocks;
-                    blk_count        -= pa_blocks;
+
+                    offset           += pa_blocks;
                     free_space.len   -= pa_blocks;
                     free_space.start += pa_blocks;
                 }
@@ -703,10 +1016,8 @@ void Defrag::createDonorFiles_PA(Device& device,
                     debug(_("pre-allocate failed: %s: blocks are already in use"), odp.origPath.string().c_str());
                     free_space = e;
                 }
-                
-            } while(file_offset < odp.blocks);
-
-            if (fallocate(fd, 0, 0, odp.blocks * device.getBlockSize()) < 0)
+            }
+            if(fallocate(fd, 0, piece.logical * block_size, piece.len * block_size))
                 throw std::runtime_error(std::string(_("Cannot allocate blocks for donor: "))
                                          + odp.donorPath.string() + strerror(errno));
         }
@@ -714,6 +1025,246 @@ void Defrag::createDonorFiles_PA(Device& device,
     }
 }
 
+/*
+ * Return first group the block allocator searches for a regular file
+ * whose inode is in the group of target. See ext4_inode_to_goal_block()
+ * With flex_bg the goal is rounded down to the first group of the flex
+ * group and the group after it is taken.
+ */
+static __u64 goalGroup(Device& device, __u64 target)
+{
+    __u64 group = target / device.getBlocksPerGroup();
+    __u32 flex = 1U << device.getLogGroupsPerFlex();
+
+    if(flex >= 4)
+        group = (group & ~(__u64)(flex - 1)) + 1;
+    return group;
+}
+
+/*
+ * Number of blocks the allocator can be steered to by the inode group
+ */
+static __u64 goalGranularity(Device& device)
+{
+    __u32 flex = 1U << device.getLogGroupsPerFlex();
+    return (__u64)device.getBlocksPerGroup() * (flex >= 4 ? flex : 1);
+}
+
+/*
+ * Allocate a temporary file of blocks near physical block target.
+ *
+ * A stock kernel does not accept a block goal from user space. However the
+ * block allocator derives its goal from the group of the inode unless the
+ * file is handled as stream. So the inode is created in the group of target
+ * by setting inode_goal and stream allocation is turned off by mb_stream_req.
+ * The goal is only as exact as goalGroup(), i.e. one flex group of usually
+ * 2 GiB. Where the blocks landed has to be checked by the caller.
+ */
+fs::path Defrag::allocatePlaceholder(Device& device, __u64 blocks, __u64 target)
+{
+    __s64 old_mb_stream_req = -1;
+    __s64 old_inode_goal = -1;
+    fs::path path;
+
+    try {
+        old_mb_stream_req = device.getTuningParameter("mb_stream_req");
+        old_inode_goal = device.getTuningParameter("inode_goal");
+
+        device.setTuningParameter("mb_stream_req", 0x7fffffff);
+        device.setTuningParameter("inode_goal",
+                                  target / device.getBlocksPerGroup()
+                                  * device.getInodesPerGroup() + 1);
+
+        path = createTempFile(device.getMountPoint(),
+                              blocks * device.getBlockSize());
+
+        device.setTuningParameter("inode_goal", old_inode_goal);
+        device.setTuningParameter("mb_stream_req", old_mb_stream_req);
+    }
+    catch(std::exception& e)
+    {
+        if(old_inode_goal != -1)
+            device.setTuningParameter("inode_goal", old_inode_goal);
+        if(old_mb_stream_req != -1)
+            device.setTuningParameter("mb_stream_req", old_mb_stream_req);
+        throw;
+    }
+    return path;
+}
+
+/*
+ * Return number of physically continuous ranges of a file.
+ */
+static __u32 countRanges(const struct fiemap* fmap)
+{
+    __u32 ranges = 0;
+    __u64 next = 0;
+
+    for(__u32 i = 0; i < fmap->fm_mapped_extents; i++)
+    {
+        const struct fiemap_extent& fe = fmap->fm_extents[i];
+        if(fe.fe_physical != next)
+            ranges++;
+        next = fe.fe_physical + fe.fe_length;
+    }
+    return ranges;
+}
+
+/*
+ * Creating donor files on kernels without pre-allocation support.
+ *
+ * First a placeholder file of the size of all files is allocated at the
+ * free space planned by LayoutPlanner. Where it actually landed is checked
+ * by FIEMAP. If it starts farther than goalGranularity() from the planned
+ * range or is more fragmented than planned, another placeholder is
+ * allocated at the next planned range of another flex group. The best one
+ * is kept. If none landed near its planned range, the locality group mode
+ * is used instead.
+ *
+ * Each donor file gets blocks of its own anywhere, which are exchanged with
+ * the next blocks of the placeholder by EXT4_IOC_MOVE_EXT. Both are
+ * unwritten, so no data is copied. The blocks swapped into the placeholder
+ * are released at once.
+ */
+void Defrag::createDonorFiles_Mainline(Device& device,
+                                       std::vector<OrigDonorPair>& files)
+{
+    __u32 block_size = device.getBlockSize();
+    __u64 total = 0;
+    __u64 next = 0;
+    std::vector<__u64> targets;     // start of each planned range
+
+    BOOST_FOREACH(OrigDonorPair& odp, files)
+        BOOST_FOREACH(PlannedExtent& piece, odp.plan)
+        {
+            total += piece.len;
+            if(piece.physical == 0)
+                continue;
+            if(piece.physical != next)
+                targets.push_back(piece.physical);
+            next = piece.physical + piece.len;
+        }
+
+    if(total == 0)
+        return;
+    if(targets.empty())
+        targets.push_back(0);
+
+    fs::path placeholder;
+    __u32 placeholder_ranges = 0;
+    bool placeholder_near = false;
+    int placeholder_fd = -1;
+    int fd = -1;
+    __u64 tolerance = goalGranularity(device);
+    std::set<__u64> tried_groups;
+
+    try {
+        for(size_t i = 0; i < targets.size() && tried_groups.size() < PLACEHOLDER_TRIES; i++)
+        {
+            // targets sharing a goal group end up at the same place
+            if(!tried_groups.insert(goalGroup(device, targets[i])).second)
+                continue;
+            interruptionPoint();
+
+            fs::path path = allocatePlaceholder(device, total, targets[i]);
+            __u32 ranges = (__u32)-1;
+            __u64 landed = 0;
+            fd = open(path.string().c_str(), O_RDONLY);
+            if(0 <= fd)
+            {
+                struct fiemap* fmap = ioctl_fiemap(fd);
+                if(fmap && fmap->fm_mapped_extents)
+                {
+                    ranges = countRanges(fmap);
+                    landed = fmap->fm_extents[0].fe_physical / block_size;
+                }
+                free(fmap);
+                close(fd);
+                fd = -1;
+            }
+            __u64 distance = landed > targets[i] ? landed - targets[i] : targets[i] - landed;
+            bool near = ranges != (__u32)-1 && distance < tolerance;
+
+            debug("Placeholder planned at block %llu landed at %llu: %u range(s), planned %u",
+                  targets[i], landed, ranges, (__u32)targets.size());
+
+            if(placeholder.empty()
+               || (near && !placeholder_near)
+               || (near == placeholder_near && ranges < placeholder_ranges))
+            {
+                if(!placeholder.empty())
+                    unlink(placeholder.string().c_str());
+                placeholder = path;
+                placeholder_ranges = ranges;
+                placeholder_near = near;
+            }
+            else
+                unlink(path.string().c_str());
+
+            if(placeholder_near && placeholder_ranges <= targets.size())
+                break;
+        }
+
+        if(!placeholder_near)
+        {
+            info(_("Placeholder did not land near the planned free space. Use locality group instead."));
+            unlink(placeholder.string().c_str());
+            placeholder.clear();
+            createDonorFiles_LocalityGroup(device, files);
+            return;
+        }
+
+        placeholder_fd = open(placeholder.string().c_str(), O_RDWR);
+        if(0 > placeholder_fd)
+            throw std::runtime_error(std::string(_("Cannot open donor file: "))
+                                     + placeholder.string() + strerror(errno));
+
+        __u64 cursor = 0;
+        BOOST_FOREACH(OrigDonorPair& odp, files)
+        {
+            if(odp.blocks == 0)
+                continue;
+            interruptionPoint();
+
+            odp.donorPath = createTempFile(device.getMountPoint(), 0);
+            fd = open(odp.donorPath.string().c_str(), O_RDWR);
+            if(0 > fd)
+                throw std::runtime_error(std::string(_("Cannot open donor file: "))
+                                         + odp.donorPath.string() + strerror(errno));
+
+            BOOST_FOREACH(PlannedExtent& piece, odp.plan)
+                if(fallocate(fd, 0, piece.logical * block_size, piece.len * block_size))
+                    throw std::runtime_error(std::string(_("Cannot allocate blocks for donor: "))
+                                             + odp.donorPath.string() + strerror(errno));
+
+            BOOST_FOREACH(PlannedExtent& piece, odp.plan)
+            {
+                device.moveExtent(fd, placeholder_fd, piece.logical, cursor, piece.len);
+
+                if(fallocate(placeholder_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                             cursor * block_size, piece.len * block_size))
+                    warn(_("Cannot release blocks of placeholder: %s"), strerror(errno));
+                cursor += piece.len;
+            }
+            close(fd);
+            fd = -1;
+        }
+
+        close(placeholder_fd);
+        unlink(placeholder.string().c_str());
+    }
+    catch(std::exception& e)
+    {
+        if(fd != -1)
+            close(fd);
+        if(placeholder_fd != -1)
+            close(placeholder_fd);
+        if(!placeholder.empty())
+            unlink(placeholder.string().c_str());
+        throw;
+    }
+}
+
 /*
  * Creating donor files using locality group for small files.
  * All files are placed into an locality group. Therefore increase the limit
@@ -916,27 +1467,57 @@ void Defrag::createDonorFiles_TLD(Device& device,
     }
 }
 
+/*
+ * Pre-allocation and mainline mode place donor files as planned by
+ * LayoutPlanner.
+ */
+static bool isPlannedMode()
+{
+    return defrag_mode == "pa" || defrag_mode == "mainline";
+}
+
 /*
  * Create for each original file an appropriate donor file.
- * Select one of the three mode for creating donor files.
+ * Plan the layout first if the mode needs it.
  */
 void Defrag::createDonorFiles(Device& device, std::vector<OrigDonorPair>& defragPair )
+{
+    if(isPlannedMode())
+    {
+        FreeSpaceIndex index(device);
+        LayoutPlanner(device, index).plan(defragPair);
+        createDonorFiles(device, defragPair, &index);
+    }
+    else
+        createDonorFiles(device, defragPair, NULL);
+}
+
+/*
+ * Select one of the four modes for creating donor files.
+ * Files have to be planned already in pre-allocation and mainline mode.
+ */
+void Defrag::createDonorFiles(Device& device,
+                              std::vector<OrigDonorPair>& defragPair,
+                              FreeSpaceIndex* index)
 {
     /*
-     * set high priority to current thread
+     * set high priority to current thread unless throttled
      */
     pid_t tid;
     tid = syscall(__NR_gettid);
     int old_priority = getpriority(PRIO_PROCESS, tid);
     
-    if(-1 == setpriority(PRIO_PROCESS, tid, -20))
-        warn(_("Cannot set thread priority to -20: %s"), strerror(errno));
+    if(!throttle.enabled())
+        if(-1 == setpriority(PRIO_PROCESS, tid, -20))
+            warn(_("Cannot set thread priority to -20: %s"), strerror(errno));
 
     /*
      * choose mode
      */
     if(defrag_mode == "pa")
-        createDonorFiles_PA(device, defragPair);
+        createDonorFiles_PA(device, defragPair, *index);
+    else if(defrag_mode == "mainline")
+        createDonorFiles_Mainline(device, defragPair);
     else if(defrag_mode == "tld")
         createDonorFiles_TLD(device, defragPair);
     else if(defrag_mode == "locality_group")
@@ -950,118 +1531,374 @@ void Defrag::createDonorFiles(Device& device, std::vector<OrigDonorPair>& defrag
     
 }
 
-__u32 fragmentCount(std::map<__u64, const char*> list)
+/*
+ * Add the placement of the files [first, last) to the scores of the
+ * original and the donor files. Files without donor count as they are.
+ */
+static void scorePlacement(std::vector<OrigDonorPair>& files,
+                           size_t first, size_t last,
+                           PlacementScore& orig,
+                           PlacementScore& donor)
 {
-    int fd;
-    struct fiemap* fmap;
-    __u32 frag_cnt = 0;
-    __u64 last_block  = 0;
-    __u64 gap_size;
-    
-    typedef std::pair<__u64, const char*> f_t;
-    BOOST_FOREACH(f_t iter, list)
-    {
-        fd = open(iter.second, O_RDONLY);
-        if(fd < 0)
-            throw std::logic_error(std::string(_("Cannot open file: "))+iter.second + ": " + strerror(errno));
-        fmap = ioctl_fiemap(fd);
+    ExtentCache* extents = ExtentCache::instance();
 
- 
-        for(__u32 i = 0; i< fmap->fm_mapped_extents; i++)
-        {
-            if(last_block != fmap->fm_extents[i].fe_physical)
-            {
-                // extent is not tied with last block
-                // the gap is the hole between unallocated space in a sparse file
-                if(i == 0)
-                    gap_size = fmap->fm_extents[i].fe_logical;
-                else
-                    gap_size = fmap->fm_extents[i].fe_logical - fmap->fm_extents[i-1].fe_logical - fmap->fm_extents[i-1].fe_length;
-                
-                if(gap_size == 0 || fmap->fm_extents[i].fe_physical - last_block > gap_size)
-                    frag_cnt++;
-            }   
-            last_block = fmap->fm_extents[i].fe_physical + fmap->fm_extents[i].fe_length;
-        }
-        close(fd);
+    for(size_t i = first; i < last; i++)
+    {
+        OrigDonorPair& odp = files[i];
+        const struct fiemap* fmap = extents->get(odp.origPath.string().c_str());
+        orig.add(fmap);
+        if(!odp.donorPath.empty())
+            fmap = extents->get(odp.donorPath.string().c_str());
+        donor.add(fmap);
     }
-    return frag_cnt;
-}    
+}
 
+static void reportPlacement(PlacementScore& orig, PlacementScore& donor)
+{
+    notice(_("Discontinuities before/afterwards:           %u/%u"),
+           orig.getDiscontinuities(), donor.getDiscontinuities());
+    info(_("Seek distance before/afterwards:             %llu/%llu MiB"),
+         orig.getSeekDistance()>>20, donor.getSeekDistance()>>20);
+    notice(_("Predicted read time before/afterwards (%s): %.0f/%.0f ms"),
+           orig.isRotational() ? "HDD" : "SSD",
+           orig.getReadTime(), donor.getReadTime());
+}
+
+/*
+ * Compare the placement of the original files with the one of the donor
+ * files. Both are scored in access order. See PlacementScore
+ */
 void checkImprovement(Device& device, std::vector<OrigDonorPair>& files)
 {
-    int frag_cnt_donor = 0;
-    int frag_cnt_orig = 0;
-    int fd;
-    struct fiemap* fmap;
-    
-    std::map<__u64, const char*> filelist;
+    PlacementScore orig(device.getDeviceNumber());
+    PlacementScore donor(device.getDeviceNumber());
 
+    scorePlacement(files, 0, files.size(), orig, donor);
+    reportPlacement(orig, donor);
 
-    BOOST_FOREACH(OrigDonorPair& odp, files)
+    if(donor.getReadTime() >= orig.getReadTime())
+            throw std::runtime_error(_("There is no improvement possible."));
+}
+
+static void removeDonorFiles(std::vector<OrigDonorPair>& files,
+                             size_t first, size_t last)
+{
+    for(size_t i = first; i < last; i++)
     {
-        const char* file;
+        OrigDonorPair& odp = files[i];
         if(odp.donorPath.empty())
-            file = odp.origPath.string().c_str();
-        else
-            file = odp.donorPath.string().c_str();
-        
-        fd = open(file, O_RDONLY);
-        if(fd < 0)
             continue;
-        fmap = ioctl_fiemap(fd);
-        if(fmap->fm_mapped_extents)
-            filelist.insert(std::pair<__u64, const char*>(fmap->fm_extents[0].fe_physical>>12, file));
-        close(fd);
+        ExtentCache::instance()->invalidate(odp.donorPath.string().c_str());
+        if(-1 == remove(odp.donorPath.string().c_str()))
+            if(errno != ENOENT)
+                error(_("Cannot remove donor file: %s: %s"),
+                         odp.donorPath.string().c_str(), strerror(errno));
+        odp.donorPath.clear();
     }
+}
 
-    frag_cnt_donor = fragmentCount(filelist);
-    filelist.clear();
+/*
+ * Move the blocks of the donor file into the original file
+ * and delete the donor file.
+ * If throttled, blocks are moved in chunks of THROTTLE_CHUNK bytes.
+ */
+void Defrag::moveFile(Device& device, OrigDonorPair& odp, Throttle& throttler)
+{
+    int orig_fd;
+    int donor_fd;
+    __u32 after_frag_cnt;
+    __u32 prev_frag_cnt;    
 
+    /*
+     * prepare original and donor file descriptors
+     */
+#ifdef MOVE_EXT_RDONLY_FLAG
+    orig_fd = open(odp.origPath.string().c_str(), O_RDONLY | O_NOFOLLOW);
+#else
+    orig_fd = open(odp.origPath.string().c_str(), O_RDWR | O_NOFOLLOW);
+#endif
 
-    BOOST_FOREACH(OrigDonorPair& odp, files)
+    if(orig_fd < 0)
     {
-        fd = open(odp.origPath.string().c_str(), O_RDONLY);
-        if(fd < 0)
-            continue;
-        fmap = ioctl_fiemap(fd);
-        if(fmap->fm_mapped_extents)
-            filelist.insert(std::pair<__u64, const char*>(fmap->fm_extents[0].fe_physical>>12, odp.origPath.string().c_str()));
-        close(fd);
+        error(_("Cannot open orig file %s: %s"), 
+              odp.origPath.string().c_str(), strerror(errno));
+        ExtentCache::instance()->invalidate(odp.donorPath.string().c_str());
+        return;
+    }
+    
+    donor_fd = open(odp.donorPath.string().c_str(), 
+                    O_WRONLY | O_CREAT, 0700);
+    if(donor_fd < 0)
+    {
+        error(_("Cannot open donor file %s: %s"), 
+              odp.donorPath.string().c_str(), strerror(errno));
+        ExtentCache::instance()->invalidate(odp.donorPath.string().c_str());
+        close(orig_fd);
+        return;
     }
+    
+    try {
+        prev_frag_cnt = get_frag_count(donor_fd);
 
-    frag_cnt_orig = fragmentCount(filelist);
-    filelist.clear();
+        __u64 chunk = odp.blocks;
+        if(throttle.enabled())
+            chunk = std::max(THROTTLE_CHUNK / device.getBlockSize(), 1U);
+        for(__u64 done = 0; done < odp.blocks; done += chunk)
+        {
+            __u64 len = std::min(chunk, odp.blocks - done);
+            throttler.wait(len * device.getBlockSize());
+            device.moveExtent(orig_fd, donor_fd, done, len);
+        }
+        odp.placed = true;
+              
+        after_frag_cnt = get_frag_count(orig_fd);
+        
+        if(after_frag_cnt != prev_frag_cnt)
+        {
+            if(odp.blocks != get_file_size(orig_fd) / device.getBlockSize())
+                warn(_("%s: File size has changed in the meantime."), odp.origPath.string().c_str());
+            else
+                warn(_("Bug detected in ioctl EXT4_IOC_MOVE_EXT: %s: file fragment count does not match"), odp.origPath.string().c_str());
+        }
+    }
+    catch(std::exception& e)
+    {
+        error("%s", e.what());
+    }
     
-    __u64 total_block_cnt = 0;
-    __u32 best_case;
-    BOOST_FOREACH(OrigDonorPair& odp, files)
-        total_block_cnt += odp.blocks;
+    if(posix_fadvise(orig_fd, 0, odp.blocks*device.getBlockSize(),
+                    POSIX_FADV_DONTNEED))
+    {
+        warn(_("fadvice failed: %s"), strerror(errno));
+    }
 
-    best_case = total_block_cnt / device.freeBlocksPerFlex() + (bool)(total_block_cnt % device.freeBlocksPerFlex());
+    // the inode number of the donor is free for reuse
+    ExtentCache::instance()->invalidate(donor_fd);
+    if (unlink(odp.donorPath.string().c_str()) < 0)
+        error(_("Cannot unlink donor fd: %s"), strerror(errno));
+    odp.donorPath.clear();
 
-    notice(_("Total fragment count before/afterwards/best-case:  %d/%d/%d"), frag_cnt_orig, frag_cnt_donor, best_case);
-    if(frag_cnt_donor >= frag_cnt_orig)
-            throw std::runtime_error(_("There is no improvement possible."));
+    close(orig_fd);
+    close(donor_fd);
+}
+
+/*
+ * State shared by the donor thread and the mover in pipelined mode.
+ * A window is a range of pipeline_window files of the list.
+ */
+struct DonorPipeline
+{
+        DonorPipeline(Defrag* d, Device dev, std::vector<OrigDonorPair>* f, size_t w)
+            : defrag(d), device(dev), files(f), window(w),
+              windows((f->size() + w - 1) / w),
+              produced(0), consumed(0), done(false), stop(false),
+              tag(logger.getThreadTag())
+        {
+            pthread_mutex_init(&mutex, NULL);
+            pthread_cond_init(&cond, NULL);
+        }
+        ~DonorPipeline()
+        {
+            pthread_cond_destroy(&cond);
+            pthread_mutex_destroy(&mutex);
+        }
+        Defrag* defrag;
+        Device device;
+        std::vector<OrigDonorPair>* files;
+        size_t window;
+        size_t windows;
+        size_t produced;        // windows with donor files
+        size_t consumed;        // windows finished by the mover
+        bool done;              // donor thread has finished
+        bool stop;              // mover has given up
+        std::string failure;    // error of the donor thread
+        const char* tag;        // log tag of the mover
+        pthread_mutex_t mutex;
+        pthread_cond_t cond;
+};
+
+/*
+ * Create donor files window by window. Stay at most one window ahead
+ * of the mover.
+ */
+void Defrag::produceDonorFiles(DonorPipeline& pipe, FreeSpaceIndex* index)
+{
+    std::vector<OrigDonorPair>& files = *pipe.files;
+
+    for(size_t k = 0; k < pipe.windows; k++)
+    {
+        pthread_mutex_lock(&pipe.mutex);
+        while(k > pipe.consumed + 1 && !pipe.stop)
+            pthread_cond_wait(&pipe.cond, &pipe.mutex);
+        bool stop = pipe.stop;
+        pthread_mutex_unlock(&pipe.mutex);
+        if(stop)
+            return;
+
+        size_t first = k * pipe.window;
+        size_t last  = std::min(first + pipe.window, files.size());
+        std::vector<OrigDonorPair> window(files.begin() + first,
+                                          files.begin() + last);
+        try {
+            createDonorFiles(pipe.device, window, index);
+        }
+        catch(std::exception& e)
+        {
+            // let the mover remove donor files created so far
+            pthread_mutex_lock(&pipe.mutex);
+            for(size_t i = first; i < last; i++)
+                files[i].donorPath = window[i - first].donorPath;
+            pthread_mutex_unlock(&pipe.mutex);
+            throw;
+        }
+
+        pthread_mutex_lock(&pipe.mutex);
+        for(size_t i = first; i < last; i++)
+            files[i].donorPath = window[i - first].donorPath;
+        pipe.produced = k + 1;
+        pthread_cond_broadcast(&pipe.cond);
+        pthread_mutex_unlock(&pipe.mutex);
+    }
+}
+
+void* Defrag::donorThread(void* arg)
+{
+    DonorPipeline* pipe = (DonorPipeline*)arg;
+
+    logger.setThreadTag(pipe->tag);
+    if(pipe->defrag->throttle.idle)
+        Throttle::setIdlePriority();
+    try {
+        if(isPlannedMode())
+        {
+            FreeSpaceIndex index(pipe->device);
+            LayoutPlanner(pipe->device, index).plan(*pipe->files);
+            pipe->defrag->produceDonorFiles(*pipe, &index);
+        }
+        else
+            pipe->defrag->produceDonorFiles(*pipe, NULL);
+    }
+    catch(std::exception& e)
+    {
+        pthread_mutex_lock(&pipe->mutex);
+        pipe->failure = e.what();
+        pthread_mutex_unlock(&pipe->mutex);
+    }
+
+    pthread_mutex_lock(&pipe->mutex);
+    pipe->done = true;
+    pthread_cond_broadcast(&pipe->cond);
+    pthread_mutex_unlock(&pipe->mutex);
+    return NULL;
+}
+
+static void printProgress(int fcnt, __u32 valid_files, size_t list_size,
+                          OrigDonorPair& odp)
+{
+    info(_("[ %*d/%d ] %*llu block(s)    %s"), (int)(log10(list_size)+1), fcnt,
+         valid_files, 
+         6, odp.blocks,
+         odp.origPath.string().c_str());
+}
+
+/*
+ * Pipelined mode: a thread creates the donor files of the next window
+ * while the files of the current one are moved. So allocation and moving
+ * overlap and at most two windows of donor files exist at a time.
+ *
+ * The improvement is checked per window. Files of a window which would
+ * not be read faster stay in place.
+ */
+void Defrag::defragPipelined(Device& device, std::vector<OrigDonorPair>& files,
+                             __u32 valid_files, Throttle& throttler)
+{
+    DonorPipeline pipe(this, device, &files, pipeline_window);
+    PlacementScore orig(device.getDeviceNumber());
+    PlacementScore donor(device.getDeviceNumber());
+    int fcnt = 0;
+    pthread_t tid;
+
+    if(0 != pthread_create(&tid, NULL, donorThread, &pipe))
+        throw std::runtime_error(std::string(_("Cannot create donor thread: "))
+                                 + strerror(errno));
+
+    try {
+        for(size_t k = 0; k < pipe.windows; k++)
+        {
+            pthread_mutex_lock(&pipe.mutex);
+            while(pipe.produced <= k && !pipe.done)
+                pthread_cond_wait(&pipe.cond, &pipe.mutex);
+            bool ready = pipe.produced > k;
+            std::string failure = pipe.failure;
+            pthread_mutex_unlock(&pipe.mutex);
+
+            if(!ready)
+                throw std::runtime_error(failure);
+
+            size_t first = k * pipe.window;
+            size_t last  = std::min(first + pipe.window, files.size());
+
+            PlacementScore window_orig(device.getDeviceNumber());
+            PlacementScore window_donor(device.getDeviceNumber());
+            scorePlacement(files, first, last, window_orig, window_donor);
+
+            if(window_donor.getReadTime() >= window_orig.getReadTime())
+            {
+                info(_("No improvement possible for file(s) %u to %u. They stay in place."),
+                     (__u32)first + 1, (__u32)last);
+                removeDonorFiles(files, first, last);
+            }
+            scorePlacement(files, first, last, orig, donor);
+
+            for(size_t i = first; i < last; i++)
+            {
+                OrigDonorPair& odp = files[i];
+                if(odp.blocks == 0 || odp.donorPath.empty())
+                    continue;
+                interruptionPoint();
+                printProgress(++fcnt, valid_files, files.size(), odp);
+                moveFile(device, odp, throttler);
+            }
+
+            pthread_mutex_lock(&pipe.mutex);
+            pipe.consumed = k + 1;
+            pthread_cond_broadcast(&pipe.cond);
+            pthread_mutex_unlock(&pipe.mutex);
+        }
+    }
+    catch(std::exception& e)
+    {
+        pthread_mutex_lock(&pipe.mutex);
+        pipe.stop = true;
+        pthread_cond_broadcast(&pipe.cond);
+        pthread_mutex_unlock(&pipe.mutex);
+        pthread_join(tid, NULL);
+        throw;
+    }
+    pthread_join(tid, NULL);
+
+    reportPlacement(orig, donor);
 }
+
 /*
  * Main algorithm of related file defragmentation.
  *
  * 1. Check file attributes:
          Sort all files out for all those, who move_ext ioctl will fail.
  * 2. Create all donor files
- *      Select one of the three modes of creating donor files
+ *      Select one of the four modes of creating donor files
+ *      Pre-allocation and mainline mode plan the layout of all files in advance
  * 3. Check improvement
  * 4. Open original and donor file
  * 5. Call move extent ioctl (EXT4_IOC_MOVE_EXT)
  * 6. fadvice to free donor file from page cache
  * 7. Delete donor file
+ *
+ * In pipelined mode steps 2 to 7 are done window by window. See defragPipelined()
  */ 
 void Defrag::defragRelatedFiles(Device device, std::vector<OrigDonorPair>& files)
 {
     int fcnt = 0;
-    int orig_fd;
-    int donor_fd;
     __u32 valid_files = 0;
     
     BOOST_FOREACH(OrigDonorPair& odp, files)
@@ -1076,91 +1913,34 @@ void Defrag::defragRelatedFiles(Device device, std::vector<OrigDonorPair>& files
            device.getDevicePath().c_str(),
            device.getMountPoint().string().c_str());
     
-    try {
-
-        createDonorFiles(device, files);
+    Throttle throttler(throttle, device.getDeviceNumber());
+    if(throttle.idle)
+        Throttle::setIdlePriority();
 
-        checkImprovement(device, files);
-
-        __u32 after_frag_cnt;
-        __u32 prev_frag_cnt;    
-        BOOST_FOREACH(OrigDonorPair& odp, files)
+    try {
+        if(pipeline_window)
+            defragPipelined(device, files, valid_files, throttler);
+        else
         {
-            if(odp.blocks == 0)
-                continue;
-            interruptionPoint();
-            info(_("[ %*d/%d ] %*llu block(s)    %s"), (int)(log10(files.size())+1), ++fcnt, 
-                 valid_files, 
-                 6, odp.blocks,
-                 odp.origPath.string().c_str());
-            
-            /*
-             * prepare original and donor file descriptors
-             */
-#ifdef MOVE_EXT_RDONLY_FLAG
-            orig_fd = open(odp.origPath.string().c_str(), O_RDONLY | O_NOFOLLOW);
-#else
-            orig_fd = open(odp.origPath.string().c_str(), O_RDWR | O_NOFOLLOW);
-#endif
+            createDonorFiles(device, files);
 
-            if(orig_fd < 0)
-            {
-                error(_("Cannot open orig file %s: %s"), 
-                      odp.origPath.string().c_str(), strerror(errno));
-                continue;
-            }
-            
-            donor_fd = open(odp.donorPath.string().c_str(), 
-                            O_WRONLY | O_CREAT, 0700);
-            if(donor_fd < 0)
-            {
-                error(_("Cannot open donor file %s: %s"), 
-                      odp.donorPath.string().c_str(), strerror(errno));
-                continue;
-            }
-            
-            try {
-                prev_frag_cnt = get_frag_count(donor_fd);
+            checkImprovement(device, files);
 
-                device.moveExtent(orig_fd, donor_fd, 0, odp.blocks);              
-                      
-                after_frag_cnt = get_frag_count(orig_fd);
-                
-                if(after_frag_cnt != prev_frag_cnt)
-                {
-                    if(odp.blocks != get_file_size(orig_fd) / device.getBlockSize())
-                        warn(_("%s: File size has changed in the meantime."), odp.origPath.string().c_str());
-                    else
-                        warn(_("Bug detected in ioctl EXT4_IOC_MOVE_EXT: %s: file fragment count does not match"), odp.origPath.string().c_str());
-                }
-            }
-            catch(std::exception& e)
+            BOOST_FOREACH(OrigDonorPair& odp, files)
             {
-                error("%s", e.what());
-            }
-            
-            if(posix_fadvise(orig_fd, 0, odp.blocks*device.getBlockSize(),
-                            POSIX_FADV_DONTNEED))
-            {
-                warn(_("fadvice failed: %s"), strerror(errno));
+                if(odp.blocks == 0)
+                    continue;
+                interruptionPoint();
+                printProgress(++fcnt, valid_files, files.size(), odp);
+                moveFile(device, odp, throttler);
             }
-        
-            if (unlink(odp.donorPath.string().c_str()) < 0)
-                error(_("Cannot unlink donor fd: %s"), strerror(errno));
-            odp.donorPath.clear();
-        
-            close(orig_fd);
-            close(donor_fd);
         }
+        throttler.report();
     }
     
     catch(std::exception& e)
     {
-        BOOST_FOREACH(OrigDonorPair& odp, files)
-            if(-1 == remove(odp.donorPath.string().c_str()))
-                if(errno != ENOENT)
-                    error(_("Cannot remove donor file: %s: %s"),
-                             odp.donorPath.string().c_str(), strerror(errno));
+        removeDonorFiles(files, 0, files.size());
         error("%s", e.what());
     }
 }
@@ -23,24 +23,45 @@
 #include "common.hh"
 #include "fileptr.hh"
 #include "device.hh"
+#include "freespace.hh"
+#include "throttle.hh"
 
 #include <vector>
 #include <string>
+#include <map>
+#include <boost/unordered_map.hpp>
 
 #include <ext2fs/ext2fs.h>
 #include <ext2fs/ext2_fs.h>
 
+/*
+ * Planned piece of a donor file. All values are in blocks.
+ */
+struct PlannedExtent
+{
+        PlannedExtent(__u64 l, __u64 p, __u64 n)
+            : logical(l), physical(p), len(n) {}
+        __u64 logical;
+        __u64 physical;     // 0 if not planned
+        __u64 len;
+};
+
 struct OrigDonorPair
 {
-        OrigDonorPair() : blocks(0), isSparseFile(false) {}
-        OrigDonorPair(fs::path p) : origPath(p), blocks(0), isSparseFile(false) {}
+        OrigDonorPair() : blocks(0), isSparseFile(false), placed(false), goal(0) {}
+        OrigDonorPair(fs::path p) : origPath(p), blocks(0), isSparseFile(false), placed(false), goal(0) {}
 
         fs::path origPath;
         fs::path donorPath;
-        __u64 blocks : 63;
+        __u64 blocks : 62;
         __u64 isSparseFile : 1;
+        __u64 placed : 1;       // moved by this run or kept in place
+        __u64 goal;             // physical block to place the donor file at
+        std::vector<PlannedExtent> plan;
 };
 
+struct DonorPipeline;
+
 class Defrag : public Interruptible
 {
         typedef std::vector<fs::path> filelist_t;
@@ -49,6 +70,14 @@ class Defrag : public Interruptible
         bool doesKernelSupportPA(const char*);
         bool isPAenabled(fs::path& mountPoint, char* device_name);
         void createDonorFiles_PA(
+                        Device& device,
+                        std::vector<OrigDonorPair>& files,
+                        FreeSpaceIndex& index);
+        fs::path allocatePlaceholder(
+                        Device& device,
+                        __u64 blocks,
+                        __u64 target);
+        void createDonorFiles_Mainline(
                         Device& device,
                         std::vector<OrigDonorPair>& files);
         void fillUpLocalityGroup(Device& device);
@@ -61,6 +90,17 @@ class Defrag : public Interruptible
         void createDonorFiles(
                         Device& device,
                         std::vector<OrigDonorPair>& defragPair );
+        void createDonorFiles(
+                        Device& device,
+                        std::vector<OrigDonorPair>& defragPair,
+                        FreeSpaceIndex* index);
+        void produceDonorFiles(DonorPipeline&, FreeSpaceIndex* index);
+        static void* donorThread(void*);
+        void moveFile(Device& device, OrigDonorPair& odp, Throttle&);
+        void defragPipelined(Device& device,
+                             std::vector<OrigDonorPair>& files,
+                             __u32 valid_files,
+                             Throttle&);
 
         void checkFilesAttributes(Device device, std::vector<OrigDonorPair>&);
         
@@ -71,13 +111,37 @@ class Defrag : public Interruptible
         int not_extent_based;
         int empty_files;
         int sparse_files;
+        size_t pipeline_window;     // files per window, 0 if not pipelined
+        unsigned int check_threads; // 0 for default
+        ThrottleConfig throttle;
 };
 
 class Optimizer : public Defrag
 {
+        typedef std::map<Device, std::vector<OrigDonorPair> > filemap_t;
     public:
         Optimizer();
+        void setFullRun(bool);
         void relatedFiles(std::vector<fs::path>&);
+    private:
+        void loadLayout(const char* path);
+        void saveLayout(const char* path, filemap_t&);
+        void keepPlacedFiles(Device device, std::vector<OrigDonorPair>&);
+        void defragDevices(filemap_t&);
+        static void* defragThread(void*);
+
+        /*
+         * Placement of a file achieved by the last run
+         */
+        struct Placement
+        {
+                __u64 size;         // in bytes
+                __u64 physical;     // start in bytes
+        };
+        typedef boost::unordered_map<std::pair<dev_t, ino_t>, Placement> layout_t;
+        layout_t layout;
+        bool full;
+        int in_place;
 };
 
 #endif
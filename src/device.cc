@@ -20,6 +20,8 @@
 #include "device.hh"
 #include "balloc.h"
 #include "logging.hh"
+#include "mounttable.hh"
+#include "fiemap.hh"
 
 #include <fstream>
 #include <stdexcept>
@@ -28,7 +30,6 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
-#include <mntent.h>
 
 #include <boost/lexical_cast.hpp>
 
@@ -113,48 +114,19 @@ Device::Device(dev_t dev)
     get()->devno = dev;
 }
 
-void Device::parseMtabFile(const char* path)
-{
-    FILE* fmtab;
-    struct mntent   *mnt = NULL;
-    struct stat st;
-
-    fmtab = setmntent(path, "r");
-    if(fmtab == NULL)
-        throw std::runtime_error(std::string(_("Cannot access ")) + path + ": " + strerror(errno));
-
-    while((mnt = getmntent(fmtab)) != NULL)
-    {
-        if(0 == strcmp(mnt->mnt_type, "rootfs"))
-            continue;
-        if(stat(mnt->mnt_dir, &st))
-            continue;
-        if(st.st_dev == get()->devno)
-        {
-            get()->mount_point = mnt->mnt_dir;
-            get()->fs_name = mnt->mnt_type;
-            break;
-        }
-    }
-
-    endmntent(fmtab);
-}
-
+/*
+ * Receive mount point and filesystem type from the shared mount table
+ */
 void Device::parseMtab()
 {
-    if(0 ==access("/proc/mounts", R_OK))
+    MountEntry entry;
+    if(MountTable::instance()->find(get()->devno, entry))
     {
-        parseMtabFile("/proc/mounts");
-        if( get()->fs_name == "ext2")
-            // maybe /proc/mounts is not up to date cause user forget to setup
-            // rootfstype=ext4 to kernel parameters.
-            parseMtabFile(MOUNTED);
+        get()->mount_point = entry.mount_point;
+        get()->fs_name = entry.fs_type;
     }
-    else if(0 == access(MOUNTED, R_OK))
-        parseMtabFile(MOUNTED);
-    else
-        throw std::runtime_error(_("Neither /proc/mounts nor /etc/mtab is readable."));
 }
+
 fs::path Device::getMountPoint()
 {
     if(get()->mount_point.empty())
@@ -393,6 +365,20 @@ void Device::moveExtent( int orig_fd,
                          int   donor_fd,
                          __u64 logical,
                          __u64 len)
+{
+    moveExtent(orig_fd, donor_fd, logical, logical, len);
+}
+
+/*
+ * Exchange the blocks of orig_fd at logical with the ones of donor_fd at
+ * donor_logical. Offsets and lengths of EXT4_IOC_MOVE_EXT are in blocks.
+ * Different offsets need Linux 3.18.
+ */
+void Device::moveExtent( int orig_fd,
+                         int   donor_fd,
+                         __u64 logical,
+                         __u64 donor_logical,
+                         __u64 len)
 {
     __u64 moved_blocks = 0;
     while(moved_blocks < len)
@@ -401,12 +387,9 @@ void Device::moveExtent( int orig_fd,
         memset(&move_data, 0, sizeof(struct move_extent));
 
         move_data.donor_fd    = donor_fd;
-        move_data.orig_start  = (logical + moved_blocks)
-                             * getBlockSize();
-        /* Logical offset of orig and donor should be same */
-        move_data.donor_start = move_data.orig_start;
-        move_data.len         = (len - moved_blocks)
-                             * getBlockSize();
+        move_data.orig_start  = logical + moved_blocks;
+        move_data.donor_start = donor_logical + moved_blocks;
+        move_data.len         = len - moved_blocks;
 
         if(0 >  ioctl(orig_fd, EXT4_IOC_MOVE_EXT, &move_data))
         {
@@ -418,13 +401,27 @@ void Device::moveExtent( int orig_fd,
                << _("donor:   ") << donor_fd << " "
                << getPathFromFd(donor_fd)<< "\n"
                << _("logical: ") << logical << "\n"
+               << _("donor logical: ") << donor_logical << "\n"
                << _("len:     ") << len     << "\n";
 
+            // extents might have been moved partially
+            ExtentCache::instance()->invalidate(orig_fd);
+            ExtentCache::instance()->invalidate(donor_fd);
             throw std::runtime_error(ss.str());
         }
 
-        moved_blocks += move_data.moved_len<<12;
+        // end of the original file
+        if(move_data.moved_len == 0)
+            break;
+        moved_blocks += move_data.moved_len;
     }
+    ExtentCache::instance()->invalidate(orig_fd);
+    ExtentCache::instance()->invalidate(donor_fd);
+}
+
+dev_t Device::getDeviceNumber()
+{
+    return get()->devno;
 }
 
 __u32 Device::getBlockSize()
@@ -457,6 +454,36 @@ __u32 Device::getLogGroupsPerFlex()
     return get()->fs->super->s_log_groups_per_flex;
 }
 
+__u32 Device::getInodesPerGroup()
+{
+    return get()->fs->super->s_inodes_per_group;
+}
+
+/*
+ * Append all ranges of free blocks to list by reading the block bitmaps.
+ * On a mounted filesystem the bitmaps on disk may lag behind.
+ */
+bool Device::readFreeExtents(std::vector<Extent>& list)
+{
+    ext2_filsys fs = get()->fs;
+    if(ext2fs_read_block_bitmap(fs))
+        return false;
+
+    blk64_t end = ext2fs_blocks_count(fs->super) - 1;
+    blk64_t start = fs->super->s_first_data_block;
+    blk64_t used;
+
+    while(start <= end
+          && 0 == ext2fs_find_first_zero_block_bitmap2(fs->block_map, start, end, &start))
+    {
+        if(ext2fs_find_first_set_block_bitmap2(fs->block_map, start, end, &used))
+            used = end + 1;
+        list.push_back(Extent(start, used - start));
+        start = used;
+    }
+    return true;
+}
+
 bool Device::operator<(const Device& other) const
 {
     return get()->devno < other.get()->devno;
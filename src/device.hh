@@ -23,6 +23,7 @@
 #include "common.hh"
 
 #include <string>
+#include <vector>
 #include <ext2fs/ext2fs.h>
 #include <ext2fs/ext2_fs.h>
 
@@ -79,6 +80,7 @@ class Device: private boost::shared_ptr<DevicePrivate>
         Device(fs::path file);
         Device(dev_t);
         bool open();
+        dev_t       getDeviceNumber();
         std::string getDeviceName();
         std::string getDevicePath();
         fs::path    getMountPoint();
@@ -92,6 +94,8 @@ class Device: private boost::shared_ptr<DevicePrivate>
         __u32       getBlocksPerGroup();
         __u32       getGroupCount();
         __u32       getLogGroupsPerFlex();
+        __u32       getInodesPerGroup();
+        bool        readFreeExtents(std::vector<Extent>&);
 
         void preallocate(int   fd,
                          __u64 physical,
@@ -103,12 +107,16 @@ class Device: private boost::shared_ptr<DevicePrivate>
                          int   donor_fd,
                          __u64 logical,  //logical block offset
                          __u64 len);     //block count to be moved
+        void moveExtent( int   orig_fd,
+                         int   donor_fd,
+                         __u64 logical,
+                         __u64 donor_logical,
+                         __u64 len);
         bool operator<(const Device&) const;
     private:
         int getDevNameFromDevfs();
         int getDevNameFromMajorMinor();
         void parseMtab();
-        void parseMtabFile(const char* path);
         void openSysFsExt4File(
                         std::filebuf* fb,
                         std::string filename,
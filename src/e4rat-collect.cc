@@ -26,6 +26,9 @@ extern "C" {
 #include "eventcatcher.hh"
 #include "logging.hh"
 #include "parsefilelist.hh"
+#include "procscan.hh"
+#include "fanotify.hh"
+#include "profile.hh"
 
 #include <iostream>
 #include <sys/types.h>
@@ -44,12 +47,17 @@ extern "C" {
 #include <sys/mman.h>
 #include <sys/prctl.h>
 #include <sys/wait.h>
+#include <sys/time.h>
 #include <pwd.h>
 
 #include <boost/foreach.hpp>
 
 #define PID_FILE "/dev/.e4rat-lite-collect.pid"
 #define MATCH(s, n) strcmp(section, s) == 0 && strcmp(name, n) == 0
+// long options without a short form
+#define OPT_DAEMON 256
+#define OPT_REPLAY 257
+#define OPT_RECORD 258
 
 #ifdef __STRICT_ANSI__
 char *strdup(const char *str) {
@@ -66,10 +74,24 @@ typedef struct
     const char *startup_log_file;
     const char *init_file;
     bool exclude_open_files;
+    bool exclude_cached_files;
     bool ext4_only;
     unsigned int timeout;
+    bool auto_stop;
+    unsigned int auto_stop_rate;
+    unsigned int auto_stop_quiet;
+    const char *profile_file;
+    double profile_decay;
+    double profile_threshold;
+    const char *app_profile_dir;
 } configuration;
 
+static bool parseBool(const char *value)
+{
+    return 0 == strcmp(value, "true") || 0 == strcmp(value, "yes")
+        || 0 == strcmp(value, "1");
+}
+
 static int config_handler(void *user, const char *section, const char *name,
                           const char *value)
 {
@@ -78,11 +100,27 @@ static int config_handler(void *user, const char *section, const char *name,
     if(MATCH("Global", "startup_log_file")) {
         pconfig->startup_log_file = strdup(value);
     } else if(MATCH("Collect", "exclude_open_files")) {
-        pconfig->exclude_open_files = strdup(value);
+        pconfig->exclude_open_files = parseBool(value);
+    } else if(MATCH("Collect", "exclude_cached_files")) {
+        pconfig->exclude_cached_files = parseBool(value);
     } else if(MATCH("Collect", "ext4_only")) {
-        pconfig->ext4_only = strdup(value);
+        pconfig->ext4_only = parseBool(value);
     } else if(MATCH("Collect", "timeout")) {
         pconfig->timeout = atoi(value);
+    } else if(MATCH("Collect", "auto_stop")) {
+        pconfig->auto_stop = parseBool(value);
+    } else if(MATCH("Collect", "auto_stop_rate")) {
+        pconfig->auto_stop_rate = atoi(value);
+    } else if(MATCH("Collect", "auto_stop_quiet")) {
+        pconfig->auto_stop_quiet = atoi(value);
+    } else if(MATCH("Collect", "profile_file")) {
+        pconfig->profile_file = strdup(value);
+    } else if(MATCH("Collect", "profile_decay")) {
+        pconfig->profile_decay = atof(value);
+    } else if(MATCH("Collect", "profile_threshold")) {
+        pconfig->profile_threshold = atof(value);
+    } else if(MATCH("Global", "app_profile_dir")) {
+        pconfig->app_profile_dir = strdup(value);
     } else if(MATCH("Global", "init_file")) {
         pconfig->init_file = strdup(value);
     } else {
@@ -142,40 +180,33 @@ int system_u(const char *user, const char *command)
     return retval;
 }
 
-void scanOpenFiles(std::vector<FilePtr>& list)
+/*
+ * Add files of running processes to list.
+ * If cached_only is set, only files which are completely in the page
+ * cache are added. Preloading those files is pure waste.
+ */
+void scanOpenFiles(std::vector<FilePtr>& list, bool cached_only = false)
 {
-    char buffer[PATH_MAX + 64];
-    char path[PATH_MAX];
-    ino_t ino;
-    int major;
-    int minor;
+    std::vector<OpenFile> files;
 
     size_t size_early = list.size();
-    debug(_("Scan open files by calling lsof"));
-
-    FILE *pFile = popen("lsof -w /", "r");
-    if(NULL == pFile)
-        return;
+    debug(_("Scan files of running processes"));
 
-    // skip first line
-    if(NULL == fgets(buffer , PATH_MAX+64, pFile))
-        return;
+    scanProcFiles(files);
 
-    while(NULL != fgets(buffer , PATH_MAX+64, pFile))
+    BOOST_FOREACH(OpenFile& f, files)
     {
-        if(EOF == sscanf(buffer, "%*s%*s%*s%*s%*s %x%*c%x %*s %llu %[^\n]s", &major, &minor,(long long unsigned int*)&ino, path))
-        {
-            error(_("scan lsof: %s"), strerror(errno));
-        }
-
-        FilePtr file = FilePtr(makedev(major, minor), ino, path);
+        if(cached_only && !isFileResident(f.path.c_str()))
+            continue;
+        FilePtr file = FilePtr(f.dev, f.ino, f.path);
         if(file.unique())
             list.push_back(file);
     }
 
-    info(_("%*d open files"), 8, list.size() - size_early);
-
-    pclose(pFile);
+    if(cached_only)
+        info(_("%*d open files already cached"), 8, list.size() - size_early);
+    else
+        info(_("%*d open files"), 8, list.size() - size_early);
 }
 
 
@@ -203,6 +234,192 @@ void excludeFileLists(std::vector<const char*>& files, std::vector<FilePtr>& lis
 }
 
 
+/*
+ * Stop collecting once the system has settled.
+ *
+ * A timer ticks once a second. Each tick samples the number of unique
+ * files collected so far. Collection stops when less than rate new files
+ * per second were found during quiet consecutive seconds, or when the
+ * fixed timeout expired. The signal handler only sets flags. The reason
+ * is logged after event processing returned.
+ */
+enum StopReason { STOP_NONE = 0, STOP_TIMEOUT, STOP_SETTLED };
+
+static struct
+{
+    ScanFsAccess* project;
+    unsigned int timeout;
+    unsigned int rate;
+    unsigned int quiet;
+    unsigned int elapsed;
+    unsigned int quiet_seconds;
+    unsigned long last_count;
+    volatile sig_atomic_t reason;
+} auto_stop;
+
+static void autoStopTick(int)
+{
+    auto_stop.elapsed++;
+
+    if(auto_stop.rate)
+    {
+        unsigned long count = auto_stop.project->getInsertCount();
+        // do not stop before the first file has been seen
+        if(count && count - auto_stop.last_count < auto_stop.rate)
+            auto_stop.quiet_seconds++;
+        else
+            auto_stop.quiet_seconds = 0;
+        auto_stop.last_count = count;
+
+        if(auto_stop.quiet_seconds >= auto_stop.quiet)
+        {
+            auto_stop.reason = STOP_SETTLED;
+            Interruptible::interrupt();
+            return;
+        }
+    }
+
+    if(auto_stop.timeout && auto_stop.elapsed >= auto_stop.timeout)
+    {
+        auto_stop.reason = STOP_TIMEOUT;
+        Interruptible::interrupt();
+    }
+}
+
+static void startAutoStop(ScanFsAccess* project, configuration& config)
+{
+    struct sigaction sa;
+    struct itimerval timer;
+
+    memset(&auto_stop, 0, sizeof(auto_stop));
+    auto_stop.project = project;
+    auto_stop.timeout = config.timeout;
+    if(config.auto_stop && config.auto_stop_quiet)
+    {
+        auto_stop.rate = config.auto_stop_rate;
+        auto_stop.quiet = config.auto_stop_quiet;
+    }
+
+    memset(&sa, '\0', sizeof(struct sigaction));
+    sa.sa_handler = autoStopTick;
+    sigaction(SIGALRM, &sa, NULL);
+
+    timer.it_interval.tv_sec = 1;
+    timer.it_interval.tv_usec = 0;
+    timer.it_value = timer.it_interval;
+    setitimer(ITIMER_REAL, &timer, NULL);
+}
+
+static void stopAutoStop()
+{
+    struct itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_REAL, &timer, NULL);
+
+    switch(auto_stop.reason)
+    {
+        case STOP_SETTLED:
+            notice(_("Stopped after %u seconds: less than %u new file(s) per second during %u seconds"),
+                   auto_stop.elapsed, auto_stop.rate, auto_stop.quiet);
+            break;
+        case STOP_TIMEOUT:
+            notice(_("Stopped after timeout of %u seconds"), auto_stop.timeout);
+            break;
+        default:
+            break;
+    }
+}
+
+/*
+ * Learn the startup files across normal boots.
+ *
+ * fanotify replaces the audit listener. Its overhead is low enough to
+ * run on every boot. The collected files are merged into the persistent
+ * profile. The file list is rewritten only if its content changed.
+ */
+static int runDaemon(configuration& config, const char* outPath)
+{
+    ScanFsAccess project;
+    FanotifyListener listener;
+    Profile profile(config.profile_decay);
+
+    if(!profile.load(config.profile_file))
+        warn(_("Cannot load profile %s. Start a new one."), config.profile_file);
+
+    listener.watchExt4Only(config.ext4_only);
+    listener.setEventCatcher(&project);
+    if(!listener.connect())
+        return 1;
+
+    bool pc = createPidFile(PID_FILE);
+    startAutoStop(&project, config);
+    notice(_("Learning startup files. Signal collector to stop by calling `collect -k'"));
+
+    listener.start();
+    stopAutoStop();
+    if(pc)
+        unlink(PID_FILE);
+
+    std::deque<FilePtr> filelist = project.getFileList();
+    notice(_("\t%d file(s) collected"), filelist.size());
+
+    profile.update(filelist);
+    if(!profile.save(config.profile_file))
+        return 1;
+    info(_("Profile %s holds %u file(s)"), config.profile_file, (unsigned int)profile.size());
+
+    bool changed;
+    if(!profile.writeList(outPath, config.profile_threshold, changed))
+        return 1;
+    if(changed)
+        notice(_("File list %s updated"), outPath);
+    else
+        notice(_("File list %s is unchanged"), outPath);
+
+    return 0;
+}
+
+/*
+ * Write one file list per observed application to dir/<name>.
+ * Files are assigned to the application whose process tree accessed
+ * them first. e4rat-lite-prefetchd reads these lists.
+ */
+static void writeAppProfiles(std::deque<FilePtr>& filelist, ScanFsAccess& project,
+                             const char* dir)
+{
+    std::map<std::string, std::string> lists;
+    char buf[64];
+
+    BOOST_FOREACH(FilePtr& f, filelist)
+    {
+        std::string app = project.getApp(f.getPid());
+        // process names may contain slashes
+        if(app.empty() || app.find('/') != std::string::npos || app[0] == '.')
+            continue;
+        std::string& list = lists[app];
+        sprintf(buf, "%u %u ", (__u32)f.getDevice(), (__u32)f.getInode());
+        list += buf;
+        list += f.getPathName();
+        list += '\n';
+    }
+
+    if(lists.empty())
+        return;
+    if(0 != mkdir(dir, 0755) && errno != EEXIST)
+    {
+        error(_("Cannot create directory %s: %s"), dir, strerror(errno));
+        return;
+    }
+
+    for(std::map<std::string, std::string>::iterator it = lists.begin();
+        it != lists.end(); ++it)
+    {
+        std::string path = std::string(dir) + "/" + it->first;
+        if(writeFileAtomic(path.c_str(), it->second))
+            notice(_("Application profile %s written"), path.c_str());
+    }
+}
+
 void printUsage()
 {
     std::cout <<
@@ -215,6 +432,10 @@ _("Usage: e4rat-lite-collect [ option(s) ] [ application name(s) ]\n"
 "    -l --loglevel <number>          set log level\n"
 "\n"
 "    -k --stop                       kill running collector\n"
+"       --daemon                     learn file list across normal boots\n"
+"    -a --app-profiles               store a file list per application name\n"
+"       --replay <file>              read events from audit log or capture file\n"
+"       --record <file>              save received audit records to capture file\n"
 "    -x --execute <command>          quit after command has finished\n"
 "    -u --user <username>            execute command as user\n"
 "    -o --output [file]              dump generated file list to file\n"
@@ -231,6 +452,14 @@ int main(int argc, char *argv[])
 {
     bool create_pid_late = false;
     configuration config;
+    config.exclude_cached_files = false;
+    config.auto_stop = false;
+    config.auto_stop_rate = 2;
+    config.auto_stop_quiet = 10;
+    config.profile_file = "/var/lib/e4rat-lite/profile";
+    config.profile_decay = 0.7;
+    config.profile_threshold = 0.5;
+    config.app_profile_dir = "/var/lib/e4rat-lite/apps";
 
     setlocale(LC_ALL, "");
     bindtextdomain("e4rat-lite", "/usr/share/locale");
@@ -244,6 +473,10 @@ int main(int argc, char *argv[])
     int loglevel = 3; //FIXME
     int verbose  = 7; //FIXME
 
+    bool daemon = false;
+    bool app_profiles = false;
+    const char *replayPath = NULL;
+    const char *recordPath = NULL;
     const char *execute  = NULL;
     const char *username = NULL;
     const char *outPath  = NULL;
@@ -277,13 +510,17 @@ int main(int argc, char *argv[])
             {"user",           required_argument, 0, 'u'},
             {"output",         required_argument, 0, 'o'},
             {"stop",           no_argument,       0, 'k'},
+            {"daemon",         no_argument,       0, OPT_DAEMON},
+            {"app-profiles",   no_argument,       0, 'a'},
+            {"replay",         required_argument, 0, OPT_REPLAY},
+            {"record",         required_argument, 0, OPT_RECORD},
             {0, 0, 0, 0}
         };
 
     int c;
     int option_index = 0;
     opterr = 0;
-    while((c = getopt_long(argc, argv, "hVvql:o:D:d:P:p:L:x:ku:", long_options, &option_index)) != EOF)
+    while((c = getopt_long(argc, argv, "hVvql:o:D:d:P:p:L:x:ku:a", long_options, &option_index)) != EOF)
     {
         // parse optional arguments
         if(optarg != NULL && optarg[0] == '-')
@@ -334,6 +571,18 @@ int main(int argc, char *argv[])
             case 'u':
                 username = optarg;
                 break;
+            case OPT_DAEMON:
+                daemon = true;
+                break;
+            case 'a':
+                app_profiles = true;
+                break;
+            case OPT_REPLAY:
+                replayPath = optarg;
+                break;
+            case OPT_RECORD:
+                recordPath = optarg;
+                break;
             case 'k':
             {
                 pid_t pid = readPidFile(PID_FILE);
@@ -368,13 +617,25 @@ int main(int argc, char *argv[])
     logger.setVerboseLevel(verbose);
     logger.setLogLevel(loglevel);
 
-    if(getuid() != 0)
+    // replaying recorded events needs neither the audit socket nor root
+    if(!replayPath && getuid() != 0)
     {
         std::cerr << _("You need root privileges to run this program.\n");
         return 1;
     }
 
-    if(isAuditDaemonRunning())
+    if(daemon)
+    {
+        struct sigaction sa;
+        memset(&sa, '\0', sizeof(struct sigaction));
+        sa.sa_handler = signalHandler;
+        sigaction(SIGINT, &sa, NULL);
+        sigaction(SIGTERM, &sa, NULL);
+
+        return runDaemon(config, outPath ? outPath : config.startup_log_file);
+    }
+
+    if(!replayPath && isAuditDaemonRunning())
     {
         std::cerr << _("In order to use this program you first have to stop the audit daemon auditd.\n");
         return 1;
@@ -393,12 +654,23 @@ int main(int argc, char *argv[])
         outPath = config.startup_log_file;
         verbose = 0;
     } else {
-        if(true == config.exclude_open_files || exclude_filenames.size())
+        // open and cached files of this system say nothing about a replayed one
+        if(replayPath)
+        {
+            config.exclude_open_files = false;
+            config.exclude_cached_files = false;
+        }
+
+        if(true == config.exclude_open_files
+           || true == config.exclude_cached_files
+           || exclude_filenames.size())
         {
             info(_("Generating exclude file list ..."));
             try {
                 if(true == config.exclude_open_files)
                     scanOpenFiles(excludeList);
+                else if(true == config.exclude_cached_files)
+                    scanOpenFiles(excludeList, true);
                 excludeFileLists(exclude_filenames, excludeList);
             } catch(std::exception& e) {
                 std::cout << e.what() << std::endl;
@@ -407,7 +679,7 @@ int main(int argc, char *argv[])
             info(_("Total number of excluded files: %d"), excludeList.size());
         }
 
-        if(!createPidFile(PID_FILE))
+        if(!replayPath && !createPidFile(PID_FILE))
         {
             std::cerr << _("It seems that e4rat-lite-collect is already running.\n");
             std::cerr << _("Remove pid file ") << PID_FILE << _(" to unlock.\n");
@@ -439,9 +711,12 @@ int main(int argc, char *argv[])
     if(config.ext4_only)
         listener.watchExt4Only();
 
-    CONNECT(&listener, eventParsed, boost::bind(&EventCatcher::handleAuditEvent, &project, _1));
+    listener.setEventCatcher(&project);
+
+    if(recordPath && !listener.recordTo(recordPath))
+        goto err2;
 
-    if(execute || 1 == getpid())
+    if(!replayPath && (execute || 1 == getpid()))
     {
         sem_t *sem = (sem_t*) mmap(NULL, sizeof(sem_t),
                                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
@@ -488,7 +763,7 @@ int main(int argc, char *argv[])
 
                 exit(EXIT_SUCCESS);
          }
-    } else {
+    } else if(!replayPath) {
         listener.connect();
     }
 
@@ -497,29 +772,50 @@ int main(int argc, char *argv[])
         bool pc = createPidFile(PID_FILE);
         unsigned int timeout = config.timeout;
 
-        if(timeout)
+        if(timeout || config.auto_stop)
         {
-            sigaction(SIGALRM, &sa, NULL);
-            alarm(config.timeout);
-            notice(_("Stop collecting files automatically after %d seconds"), timeout);
+            startAutoStop(&project, config);
+            if(config.auto_stop)
+                notice(_("Stop collecting files automatically once less than %u new file(s) per second are found during %u seconds"),
+                       config.auto_stop_rate, config.auto_stop_quiet);
+            if(timeout)
+                notice(_("Stop collecting files automatically after %d seconds"), timeout);
         } else {
             if(pc == false)
                 notice(_("Signal collector to stop by calling `killall %s'"));
             else
                 notice(_("Signal collector to stop by calling `collect -k'"));
         }
-    } else {
+    } else if(!replayPath) {
         notice(_("Press 'Ctrl-C' to stop collecting files"));
     }
 
     info(_("Starting event processing ..."));
 
-    if(false == listener.start())
+    if(replayPath)
+    {
+        if(false == listener.replay(replayPath))
+            goto err2;
+    }
+    else if(false == listener.start())
         goto err2;
 
+    if(create_pid_late)
+        stopAutoStop();
+
     filelist = project.getFileList();
 
     notice(_("\t%d file(s) collected"), filelist.size());
+    {
+        unsigned long hits = project.getLinkCacheHits();
+        unsigned long lookups = hits + project.getLinkCacheMisses();
+        if(lookups)
+            notice(_("\t%lu/%lu symbolic link(s) resolved from cache (%.1f%%)"),
+                   hits, lookups, 100.0 * hits / lookups);
+    }
+
+    if(app_profiles)
+        writeAppProfiles(filelist, project, config.app_profile_dir);
 
     if(filelist.empty())
         goto out;
@@ -538,8 +834,18 @@ int main(int argc, char *argv[])
     if(outStream != stdout)
         notice(_("Save file list to %s"), outPath);
 
+    /*
+     * Access details are appended as optional tab separated column.
+     * Readers of file lists ignore everything following "\tt=".
+     */
     BOOST_FOREACH(FilePtr f, filelist)
-        fprintf(outStream, "%u %u %s\n",(__u32)f.getDevice(),(__u32)f.getInode(), f.getPath().string().c_str());
+    {
+        fprintf(outStream, "%u %u %s",(__u32)f.getDevice(),(__u32)f.getInode(), f.getPathName());
+        if(f.getAccessCount())
+            fprintf(outStream, "\tt=%u n=%u pid=%d comm=%s",
+                    f.getFirstAccess(), f.getAccessCount(), f.getPid(), f.getComm());
+        fprintf(outStream, "\n");
+    }
     fclose(outStream);
 
 out:
@@ -0,0 +1,321 @@
+/*
+ * e4rat-merge.cc - Merge several file lists into one consensus list
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "logging.hh"
+#include "common.hh"
+#include "parsefilelist.hh"
+
+#include <iostream>
+#include <algorithm>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <linux/limits.h>
+
+#include <boost/foreach.hpp>
+#include <boost/unordered_map.hpp>
+
+/*
+ * Entry of one input list.
+ * Constructors are necessary to use common file list parser
+ */
+class ListEntry
+{
+    public:
+        ListEntry(dev_t d, ino_t i, fs::path p)
+            : dev(d), ino(i), path(p.string()) {}
+        ListEntry(fs::path p)
+            : dev(0), ino(0), path(p.string())
+        {
+            // lists without device and inode number
+            struct stat st;
+            if(0 == stat(path.c_str(), &st))
+            {
+                dev = st.st_dev;
+                ino = st.st_ino;
+            }
+        }
+        dev_t dev;
+        ino_t ino;
+        std::string path;
+};
+
+struct FileKey
+{
+        FileKey(dev_t d, ino_t i) : dev(d), ino(i) {}
+        bool operator==(const FileKey& other) const
+        {
+            return ino == other.ino && dev == other.dev;
+        }
+        dev_t dev;
+        ino_t ino;
+};
+
+size_t hash_value(const FileKey& key)
+{
+    size_t seed = 0;
+    boost::hash_combine(seed, key.dev);
+    boost::hash_combine(seed, key.ino);
+    return seed;
+}
+
+/*
+ * Aggregated information of one file over all runs
+ */
+struct MergedFile
+{
+        dev_t dev;
+        ino_t ino;
+        std::string path;       // path of the latest run the file was seen in
+        unsigned int runs;      // number of runs the file was seen in
+        int last_run;
+        double rank_sum;        // sum of positions normalized to [0,1)
+        double time_sum;        // sum of first access times in milliseconds
+        double score;
+};
+
+struct CompareScore
+{
+        bool operator()(const MergedFile* a, const MergedFile* b) const
+        {
+            return a->score < b->score;
+        }
+};
+
+/*
+ * Return time of first access of the list details. See e4rat-lite-collect(8)
+ * Return false if the details do not contain a time.
+ */
+static bool parseTime(const std::string& details, double& time)
+{
+    if(details.compare(0, 2, "t=") != 0)
+        return false;
+    char* end;
+    time = strtod(details.c_str() + 2, &end);
+    return end != details.c_str() + 2;
+}
+
+void printUsage()
+{
+    std::cout <<
+_("Usage: e4rat-lite-merge [ option(s) ] list(s)\n"
+"\n"
+"  OPTIONS:\n"
+"    -V --version                    print version and exit\n"
+"    -h --help                       print help and exit\n"
+"    -v --verbose                    increment verbosity level\n"
+"    -q --quiet                      set verbose level to 0\n"
+"    -l --loglevel <number>          set log level\n"
+"\n"
+"    -k --min-runs <number>          keep files seen in at least <number> lists\n"
+"    -r --rank                       order by position even if lists contain times\n"
+"    -o --output <file>              write merged list to file instead of stdout\n")
+        ;
+}
+
+int main(int argc, char* argv[])
+{
+    setlocale(LC_ALL, "");
+    bindtextdomain("e4rat-lite", "/usr/share/locale");
+    textdomain("e4rat-lite");
+
+    int loglevel = 3;
+    int verbose  = 7;
+    unsigned int min_runs = 0;
+    bool rank_only = false;
+    const char* outPath = NULL;
+    FILE* outStream = stdout;
+
+    static struct option long_options[] =
+        {
+            {"verbose", no_argument, 0, 'v'},
+            {"version", no_argument, 0, 'V'},
+            {"quiet", no_argument, 0, 'q'},
+            {"help", no_argument, 0, 'h'},
+            {"loglevel", required_argument, 0, 'l'},
+            {"min-runs", required_argument, 0, 'k'},
+            {"rank", no_argument, 0, 'r'},
+            {"output", required_argument, 0, 'o'},
+            {0, 0, 0, 0}
+        };
+
+    int c;
+    int option_index = 0;
+    while((c = getopt_long(argc, argv, "Vvhql:k:ro:", long_options, &option_index)) != EOF)
+    {
+        switch(c)
+        {
+            case 'h':
+                goto out;
+            case 'V':
+                std::cout << PROGRAM_NAME << " " << VERSION << std::endl;
+                return 0;
+            case 'v':
+                verbose <<= 1;
+                verbose |= 1;
+                break;
+            case 'q':
+                verbose = 0;
+                break;
+            case 'l':
+                loglevel = atoi(optarg);
+                break;
+            case 'k':
+                min_runs = atoi(optarg);
+                break;
+            case 'r':
+                rank_only = true;
+                break;
+            case 'o':
+                outPath = optarg;
+                break;
+            default:
+                std::cerr << _("Unrecognised option: ") << optopt << std::endl;
+                goto out;
+        }
+    }
+
+    logger.setVerboseLevel(verbose);
+    logger.setLogLevel(loglevel);
+
+    if(optind == argc)
+        goto out;
+
+    {
+        typedef boost::unordered_map<FileKey, size_t, boost::hash<FileKey> > index_t;
+        index_t index;
+        std::vector<MergedFile> files;
+        unsigned int runs = 0;
+        bool use_time = !rank_only;
+
+        try {
+            for(int i = optind; i < argc; i++)
+            {
+                std::vector<ListEntry> list;
+                std::vector<std::string> details;
+
+                FILE* file = fopen(argv[i], "r");
+                if(NULL == file)
+                {
+                    warn(_("File %s does not exist."), argv[i]);
+                    continue;
+                }
+                info(_("Parsing file %s"), argv[i]);
+                parseInputStream(file, list, &details);
+                fclose(file);
+
+                if(list.empty())
+                    continue;
+
+                if(index.empty())
+                {
+                    index.rehash(list.size() * 2);
+                    files.reserve(list.size() * 2);
+                }
+
+                for(size_t pos = 0; pos < list.size(); pos++)
+                {
+                    ListEntry& e = list[pos];
+                    if(e.dev == 0 && e.ino == 0)
+                        continue;
+
+                    double time = 0;
+                    if(use_time && !parseTime(details[pos], time))
+                    {
+                        info(_("%s has no access times. Order by position."), argv[i]);
+                        use_time = false;
+                    }
+
+                    std::pair<index_t::iterator, bool> ret
+                        = index.insert(index_t::value_type(FileKey(e.dev, e.ino), files.size()));
+                    if(ret.second)
+                    {
+                        MergedFile m;
+                        m.dev = e.dev;
+                        m.ino = e.ino;
+                        m.runs = 0;
+                        m.last_run = -1;
+                        m.rank_sum = m.time_sum = 0;
+                        files.push_back(m);
+                    }
+
+                    MergedFile& m = files[ret.first->second];
+                    // count files listed twice only once
+                    if(m.last_run == (int)runs)
+                        continue;
+                    m.last_run = runs;
+                    m.runs++;
+                    m.path = e.path;
+                    m.rank_sum += (pos + 0.5) / list.size();
+                    m.time_sum += time;
+                }
+                runs++;
+            }
+        } catch(std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            exit(EXIT_FAILURE);
+        }
+
+        if(runs == 0)
+            goto out;
+
+        // default: files seen in at least half of the runs
+        if(min_runs == 0)
+            min_runs = (runs + 1) / 2;
+
+        std::vector<MergedFile*> result;
+        BOOST_FOREACH(MergedFile& m, files)
+        {
+            if(m.runs < min_runs)
+                continue;
+            m.score = (use_time ? m.time_sum : m.rank_sum) / m.runs;
+            result.push_back(&m);
+        }
+        // files are ordered by first appearance. Keep it on equal scores
+        std::stable_sort(result.begin(), result.end(), CompareScore());
+
+        notice(_("Merged %u list(s): %u file(s) kept of %u (seen in at least %u list(s))"),
+               runs, (unsigned int)result.size(), (unsigned int)files.size(), min_runs);
+
+        if(outPath)
+        {
+            outStream = fopen(outPath, "w");
+            if(NULL == outStream)
+            {
+                error(_("Cannot open output file: %s: %s"), outPath, strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        BOOST_FOREACH(MergedFile* m, result)
+        {
+            fprintf(outStream, "%u %u %s\t", (__u32)m->dev, (__u32)m->ino, m->path.c_str());
+            if(use_time)
+                fprintf(outStream, "t=%u ", (unsigned int)(m->score + 0.5));
+            fprintf(outStream, "c=%.2f\n", (double)m->runs / runs);
+        }
+        if(outStream != stdout)
+            fclose(outStream);
+    }
+
+    return 0;
+
+out:
+    printUsage();
+    exit(EXIT_FAILURE);
+}
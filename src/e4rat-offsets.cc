@@ -20,17 +20,20 @@
 
 #include "common.hh"
 #include "fiemap.hh"
+#include "placement.hh"
 #include "parsefilelist.hh"
 
 #include <iostream>
 #include <cstdio>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <getopt.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <fstream>
 #include <linux/limits.h>
+#include <map>
 #include <boost/foreach.hpp>
 
 /*
@@ -58,6 +61,9 @@ int main(int argc, char* argv[])
     int prev_block = 0;
     int l = 13;
     std::vector<FileInfo> filelist;
+    typedef std::map<dev_t, PlacementScore> scores_t;
+    scores_t scores;
+    struct stat st;
 
     try {
         FILE* file;
@@ -106,7 +112,7 @@ int main(int argc, char* argv[])
             continue;
         }
         
-        fmap = ioctl_fiemap(fd);
+        fmap = ioctl_fiemap(fd, FIEMAP_FLAG_SYNC);
         if(NULL == fmap)
         {
             std::cerr << "Cannot receive file extents: "
@@ -139,10 +145,29 @@ int main(int argc, char* argv[])
 
             printf("\n");
         }
+
+        if(0 == fstat(fd, &st))
+        {
+            scores_t::iterator it = scores.find(st.st_dev);
+            if(it == scores.end())
+                it = scores.insert(scores_t::value_type(st.st_dev, PlacementScore(st.st_dev))).first;
+            it->second.add(fmap);
+        }
         free(fmap);
         close(fd);
     }
 
+    for(scores_t::iterator it = scores.begin(); it != scores.end(); ++it)
+    {
+        PlacementScore& score = it->second;
+        printf("\ndevice %u:%u (%s)\n", major(it->first), minor(it->first),
+               score.isRotational() ? "rotational" : "non-rotational");
+        printf("  discontinuities:      %u\n", score.getDiscontinuities());
+        printf("  seek distance:        %llu MiB\n", score.getSeekDistance()>>20);
+        printf("  data read:            %llu MiB\n", score.getBytes()>>20);
+        printf("  predicted read time:  %.0f ms\n", score.getReadTime());
+    }
+
     exit(EXIT_SUCCESS);
 
 out:
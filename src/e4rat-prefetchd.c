@@ -0,0 +1,377 @@
+/*
+ * e4rat-prefetchd.c - Prefetch files of applications on start
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// readahead(2), fanotify(7) and getmntent(3)
+#define _GNU_SOURCE
+
+#include "config.h"
+#include "intl.hh"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <mntent.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/fanotify.h>
+#include <sys/stat.h>
+#include <linux/limits.h>
+
+#ifndef FAN_OPEN_EXEC
+#define FAN_OPEN_EXEC 0x00001000
+#endif
+
+#define LINE (PATH_MAX + 256)
+#define NAME_LEN 15             // process names are limited to 16 bytes
+#define MAX_RECENT 64
+#define REPEAT_DELAY 30         // seconds until an application is prefetched again
+#define MATCH(s, n) strcmp(section, s) == 0 && strcmp(name, n) == 0
+
+/*
+ * File set of one application start. Worker threads take files from
+ * the list until it is empty. The last thread frees the job.
+ */
+typedef struct {
+    char **paths;
+    int count;
+    int next;
+    int refs;
+    pthread_mutex_t lock;
+} Job;
+
+typedef struct {
+    char name[NAME_LEN + 1];
+    time_t when;
+} Recent;
+
+static Recent recent[MAX_RECENT];
+static int threads = 4;
+
+static void free_job(Job *job) {
+    for(int i = 0; i < job->count; i ++)
+        free(job->paths[i]);
+    free(job->paths);
+    pthread_mutex_destroy(& job->lock);
+    free(job);
+}
+
+static void *worker(void *arg) {
+    Job *job = arg;
+    struct stat st;
+
+    while(1) {
+        pthread_mutex_lock(& job->lock);
+        int i = job->next ++;
+        pthread_mutex_unlock(& job->lock);
+        if(i >= job->count)
+            break;
+
+        int fd = open(job->paths[i], O_RDONLY | O_NOATIME);
+        if(fd < 0 && errno == EPERM)
+            fd = open(job->paths[i], O_RDONLY);
+        if(fd < 0)
+            continue;
+        if(0 == fstat(fd, & st))
+            readahead(fd, 0, st.st_size);
+        close(fd);
+    }
+
+    pthread_mutex_lock(& job->lock);
+    int last = -- job->refs == 0;
+    pthread_mutex_unlock(& job->lock);
+    if(last)
+        free_job(job);
+
+    return 0;
+}
+
+/*
+ * Return path of a file list line. Device and inode number as well as
+ * optional details introduced by "\t<key>=" are cut off.
+ */
+static char *parse_line(char *line) {
+    if(*line != '/') {
+        while(*line >= '0' && *line <= '9')
+            line ++;
+        if(*line ++ != ' ')
+            return 0;
+        while(*line >= '0' && *line <= '9')
+            line ++;
+        if(*line ++ != ' ')
+            return 0;
+    }
+
+    for(char *tab = strchr(line, '\t'); tab; tab = strchr(tab + 1, '\t')) {
+        char *p = tab + 1;
+        while(*p >= 'a' && *p <= 'z')
+            p ++;
+        if(p > tab + 1 && *p == '=') {
+            *tab = 0;
+            break;
+        }
+    }
+    return *line == '/' ? line : 0;
+}
+
+static Job *load_profile(const char *path) {
+    FILE *stream = fopen(path, "r");
+    if(! stream)
+        return 0;
+
+    Job *job = calloc(1, sizeof(Job));
+    int size = 0;
+    char buf[LINE];
+
+    while(fgets(buf, sizeof buf, stream)) {
+        buf[strcspn(buf, "\n")] = 0;
+        char *p = parse_line(buf);
+        if(! p)
+            continue;
+        if(job->count >= size) {
+            size = size ? size * 2 : 256;
+            job->paths = realloc(job->paths, sizeof(char *) * size);
+        }
+        job->paths[job->count ++] = strdup(p);
+    }
+    fclose(stream);
+
+    pthread_mutex_init(& job->lock, 0);
+    return job;
+}
+
+/*
+ * Return true if name has been prefetched during the last REPEAT_DELAY
+ * seconds. Otherwise remember it.
+ */
+static int seen_recently(const char *name) {
+    time_t now = time(0);
+    int oldest = 0;
+
+    for(int i = 0; i < MAX_RECENT; i ++) {
+        if(0 == strcmp(recent[i].name, name)) {
+            if(now - recent[i].when < REPEAT_DELAY)
+                return 1;
+            oldest = i;
+            break;
+        }
+        if(recent[i].when < recent[oldest].when)
+            oldest = i;
+    }
+
+    strcpy(recent[oldest].name, name);
+    recent[oldest].when = now;
+    return 0;
+}
+
+static void prefetch(const char *dir, const char *exe) {
+    char name[NAME_LEN + 1];
+    char path[PATH_MAX];
+    pthread_attr_t attr;
+    pthread_t tid;
+
+    const char *base = strrchr(exe, '/');
+    base = base ? base + 1 : exe;
+    strncpy(name, base, NAME_LEN);
+    name[NAME_LEN] = 0;
+
+    if(! name[0] || seen_recently(name))
+        return;
+
+    snprintf(path, sizeof path, "%s/%s", dir, name);
+    Job *job = load_profile(path);
+    if(! job)
+        return;
+    if(job->count == 0) {
+        free_job(job);
+        return;
+    }
+
+    printf(_("Prefetching %d files of %s.\n"), job->count, name);
+
+    pthread_attr_init(& attr);
+    pthread_attr_setdetachstate(& attr, PTHREAD_CREATE_DETACHED);
+
+    int n = threads < job->count ? threads : job->count;
+    job->refs = n;
+    for(int i = 0; i < n; i ++) {
+        if(0 != pthread_create(& tid, & attr, worker, job)) {
+            // a thread that did not start will not drop its reference
+            pthread_mutex_lock(& job->lock);
+            job->refs -= n - i - 1;
+            pthread_mutex_unlock(& job->lock);
+            worker(job);
+            break;
+        }
+    }
+    pthread_attr_destroy(& attr);
+}
+
+/*
+ * Mark every mounted filesystem backed by a block device
+ */
+static int mark_mounts(int fan_fd) {
+    struct mntent *ent;
+    int marked = 0;
+
+    FILE *mtab = setmntent("/proc/self/mounts", "r");
+    if(! mtab)
+        return 0;
+
+    while((ent = getmntent(mtab))) {
+        if(ent->mnt_fsname[0] != '/')
+            continue;
+        if(0 == fanotify_mark(fan_fd, FAN_MARK_ADD | FAN_MARK_MOUNT,
+                              FAN_OPEN_EXEC, AT_FDCWD, ent->mnt_dir))
+            marked ++;
+        else
+            printf(_("Cannot watch %s: %s.\n"), ent->mnt_dir, strerror(errno));
+    }
+    endmntent(mtab);
+
+    return marked;
+}
+
+static void printUsage() {
+    printf(_("Usage: e4rat-lite-prefetchd [ option(s) ]\n"
+    "\n"
+    "-V --version                           print version and exit\n"
+    "-h --help                              print help and exit\n"
+    "\n"
+    "-d --dir <path to directory>           alternate application profile directory\n"
+    "-t --threads <number>                  number of threads per application\n"
+    "\n"));
+}
+
+typedef struct
+{
+    const char *app_profile_dir;
+} configuration;
+
+static int config_handler(void *user, const char *section, const char *name,
+                          const char *value)
+{
+    configuration *pconfig = (configuration*)user;
+
+    if(MATCH("Global", "app_profile_dir")) {
+        pconfig->app_profile_dir = strdup(value);
+    } else {
+        return 0;    // unknown section/name, error
+    }
+
+    return 1;
+}
+
+int main(int argc, char **argv) {
+    configuration config;
+    config.app_profile_dir = "/var/lib/e4rat-lite/apps";
+
+    setlocale(LC_ALL, "");
+    bindtextdomain("e4rat-lite", "/usr/share/locale");
+    textdomain("e4rat-lite");
+
+    if(ini_parse("/etc/e4rat-lite.conf", config_handler, &config) < 0) {
+        printf(_("Unable to load the configuration file: %s\n"), strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    static struct option long_options[] =
+    {
+        {"help",        no_argument,       0, 'h'},
+        {"version",     no_argument,       0, 'V'},
+        {"dir",         required_argument, 0, 'd'},
+        {"threads",     required_argument, 0, 't'},
+        {0, 0, 0, 0}
+    };
+
+    int c;
+    int option_index = 0;
+    const char *dir = config.app_profile_dir;
+
+    while ((c = getopt_long(argc, argv, "d:t:hV", long_options, &option_index)) != EOF)
+    {
+        switch(c)
+        {
+            case 'h':
+                goto err1;
+            case 'V':
+                goto err2;
+            case 'd':
+                dir = optarg;
+                break;
+            case 't':
+                threads = atoi(optarg);
+                if(threads < 1)
+                    threads = 1;
+                break;
+            default:
+                goto err1;
+        }
+    }
+
+    int fan_fd = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC, O_RDONLY | O_LARGEFILE);
+    if(fan_fd < 0) {
+        printf(_("Error: %s.\n"), strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if(0 == mark_mounts(fan_fd)) {
+        printf(_("Error: no filesystem to watch. FAN_OPEN_EXEC needs Linux 5.0 or newer.\n"));
+        exit(EXIT_FAILURE);
+    }
+
+    // messages of a daemon go to a log, not to a terminal
+    setvbuf(stdout, 0, _IOLBF, 0);
+    printf(_("Waiting for applications listed in %s.\n"), dir);
+
+    char buf[4096] __attribute__((aligned(__alignof__(struct fanotify_event_metadata))));
+    while(1) {
+        ssize_t len = read(fan_fd, buf, sizeof buf);
+        if(len < 0) {
+            if(errno == EINTR)
+                continue;
+            printf(_("Error: %s.\n"), strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+
+        struct fanotify_event_metadata *meta = (struct fanotify_event_metadata *) buf;
+        while(FAN_EVENT_OK(meta, len)) {
+            if(meta->fd >= 0) {
+                char name[64];
+                char exe[PATH_MAX];
+
+                sprintf(name, "/proc/self/fd/%d", meta->fd);
+                ssize_t n = readlink(name, exe, sizeof exe - 1);
+                close(meta->fd);
+                if(n > 0) {
+                    exe[n] = 0;
+                    prefetch(dir, exe);
+                }
+            }
+            meta = FAN_EVENT_NEXT(meta, len);
+        }
+    }
+
+err1:
+    printUsage();
+    exit(1);
+err2:
+    printf("%s %s\n", PROGRAM_NAME, VERSION);
+    exit(1);
+}
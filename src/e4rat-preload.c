@@ -37,6 +37,7 @@
 #define EARLY 200
 #define BLOCK 300
 #define BUF (1024*1024)
+#define LINE (4096 + 256)
 #define MATCH(s, n) strcmp(section, s) == 0 && strcmp(name, n) == 0
 
 #ifdef __STRICT_ANSI__
@@ -91,12 +92,24 @@ static FileDesc *parse_line(int n, const char *line) {
     if((* line ++) != ' ')
         return 0;
 
+    // skip optional details introduced by "\t<key>="
+    const char *extra = 0;
+    for(const char *tab = strchr(line, '\t'); tab && !extra; tab = strchr(tab + 1, '\t')) {
+        const char *p = tab + 1;
+        while(*p >= 'a' && *p <= 'z')
+            p ++;
+        if(p > tab + 1 && *p == '=')
+            extra = tab;
+    }
+
     FileDesc *f = malloc(sizeof(FileDesc));
 
     f->n = n;
     f->dev = dev;
     f->inode = inode;
     f->path = strdup(line);
+    if(extra)
+        f->path[extra - line] = 0;
 
     return f;
 }
@@ -124,7 +137,7 @@ static void load_list(const char *LIST) {
     }
 
     while(1) {
-        char buf[512];
+        char buf[LINE];
         if(! fgets(buf, sizeof buf, stream))
             break;
         if(buf[0] && buf[strlen(buf) - 1] == '\n')
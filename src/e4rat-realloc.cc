@@ -60,7 +60,9 @@ _("Usage: e4rat-lite-realloc [ option(s) ] [ mode ] files(s)\n"
 "    -h --help                       print help and exit\n"
 "    -v --verbose                    increment verbosity level\n"
 "    -q --quiet                      set verbose level to 0\n"
-"    -l --loglevel <number>          set log level\n\n")
+"    -l --loglevel <number>          set log level\n"
+"\n"
+"    -f --full                       move all files, ignore the layout of the last run\n\n")
         ;
 }
 
@@ -83,12 +85,13 @@ int main(int argc, char *argv[])
             {"quiet", no_argument, 0, 'q'},
             {"help", no_argument, 0, 'h'},
             {"loglevel", required_argument, 0, 'l'},
+            {"full", no_argument, 0, 'f'},
             {0, 0, 0, 0}
         };
 
     char c;
     int option_index = 0;
-    while((c = getopt_long(argc, argv, "Vvhql", long_options, &option_index)) != EOF)
+    while((c = getopt_long(argc, argv, "Vvhqlf", long_options, &option_index)) != EOF)
     {
         switch(c)
         {
@@ -107,6 +110,9 @@ int main(int argc, char *argv[])
             case 'l':
                 loglevel = atoi(optarg);
                 break;
+            case 'f':
+                optimizer.setFullRun(true);
+                break;
             default:
                 std::cerr << _("Unrecognised option: ") << optopt << std::endl;
                 goto out;
@@ -23,9 +23,44 @@
 
 #include <boost/foreach.hpp>
 
+ScanFsAccess::ScanFsAccess()
+{
+    start_time = 0;
+    inserted = 0;
+    link_cache_hits = 0;
+    link_cache_misses = 0;
+}
+
+/*
+ * Return time of event in milliseconds since collection started
+ */
+unsigned int ScanFsAccess::relativeTime(AuditEvent* event)
+{
+    // collection starts with the first event. Replayed logs carry their own time
+    if(start_time == 0)
+        start_time = event->time;
+    if(event->time < start_time)
+        return 0;
+    return event->time - start_time;
+}
+
+void ScanFsAccess::recordAccess(FilePtr& f, AuditEvent* event)
+{
+    f.recordAccess(relativeTime(event), event->pid, event->comm);
+}
+
 void ScanFsAccess::insert(FilePtr& f)
 {
     list.push_back(f);
+    inserted++;
+}
+
+/*
+ * Number of files collected so far. Safe to call from a signal handler.
+ */
+unsigned long ScanFsAccess::getInsertCount()
+{
+    return inserted;
 }
 
 std::deque<FilePtr> ScanFsAccess::getFileList()
@@ -38,6 +73,18 @@ std::deque<FilePtr> ScanFsAccess::getFileList()
     return ret;
 }
 
+/*
+ * Return name of the observed application process pid belongs to.
+ * An empty string is returned if pid has not been observed.
+ */
+std::string ScanFsAccess::getApp(pid_t pid)
+{
+    std::map<pid_t, std::string>::iterator it = observe_pids.find(pid);
+    if(it == observe_pids.end())
+        return std::string();
+    return it->second;
+}
+
 void ScanFsAccess::observeApp(std::string comm)
 {
     // name of process is limited to 16 characters
@@ -46,30 +93,85 @@ void ScanFsAccess::observeApp(std::string comm)
     observe_apps.insert(comm);
 }
 
-fs::path ScanFsAccess::readLink(fs::path& path)
+/*
+ * Follow symbolic link path by one hop.
+ * Return false if path is not a symbolic link.
+ *
+ * Resolved links are cached by path. An entry is valid as long as the
+ * link's inode number and ctime are unchanged. Replacing or modifying
+ * a link changes at least one of them.
+ */
+bool ScanFsAccess::followLink(std::string& path)
 {
+    struct stat st;
+    if(0 > lstat(path.c_str(), &st) || !S_ISLNK(st.st_mode))
+        return false;
+
+    LinkCacheEntry& entry = link_cache[path];
+    if(entry.ino == st.st_ino
+       && entry.ctime_sec == st.st_ctim.tv_sec
+       && entry.ctime_nsec == st.st_ctim.tv_nsec)
+    {
+        link_cache_hits++;
+        path = entry.target;
+        return true;
+    }
+    link_cache_misses++;
+
     char lnk_buf[PATH_MAX];
-    memset(&lnk_buf, '\0', PATH_MAX);
-    if(0 > readlink(path.string().c_str(), (char*)&lnk_buf, PATH_MAX))
-        throw "";
-    return realpath(lnk_buf, path.parent_path());
+    ssize_t len = readlink(path.c_str(), lnk_buf, PATH_MAX - 1);
+    if(0 > len)
+    {
+        link_cache.erase(path);
+        return false;
+    }
+    lnk_buf[len] = '\0';
+
+    entry.ino = st.st_ino;
+    entry.ctime_sec = st.st_ctim.tv_sec;
+    entry.ctime_nsec = st.st_ctim.tv_nsec;
+    // relative targets are resolved from the directory holding the link
+    std::string::size_type slash = path.rfind('/');
+    std::string dir = path.substr(0, slash == 0 ? 1 : slash);
+    char target[PATH_MAX];
+    if(normalizePath(target, sizeof(target), lnk_buf, dir.c_str()))
+        entry.target = target;
+    else
+        entry.target = realpath(lnk_buf, dir).string();
+
+    path = entry.target;
+    return true;
 }
 
 fs::path ScanFsAccess::getPath2RegularFile(fs::path& path)
 {
-    fs::path linkTo = path;
+    std::string linkTo = path.string();
 
-    try {
-        while(1)
-            linkTo = readLink(linkTo);
-    }
-    catch(...)
-    {}
+    // same limit as the kernel's MAXSYMLINKS
+    for(int hops = 0; hops < 40; hops++)
+        if(!followLink(linkTo))
+            break;
 
     return linkTo;
 }
+
+unsigned long ScanFsAccess::getLinkCacheHits()
+{
+    return link_cache_hits;
+}
+
+unsigned long ScanFsAccess::getLinkCacheMisses()
+{
+    return link_cache_misses;
+}
     
-void ScanFsAccess::handleAuditEvent(boost::shared_ptr<AuditEvent> event)
+void ScanFsAccess::handleAuditEvents(AuditEvent* const* events, size_t count)
+{
+    for(size_t i = 0; i < count; i++)
+        handleAuditEvent(events[i]);
+}
+
+void ScanFsAccess::handleAuditEvent(AuditEvent* event)
 {
     // Since Linux set audit filter AUDT_FILTER_ENTRY as deprecated, there is no way
     // to monitor exit() syscall events.
@@ -78,7 +180,7 @@ void ScanFsAccess::handleAuditEvent(boost::shared_ptr<AuditEvent> event)
     // watched before.
     if(event->type == Fork)
     {
-        std::set<pid_t>::iterator it;
+        std::map<pid_t, std::string>::iterator it;
         it = observe_pids.find(event->exit);
         if(it != observe_pids.end())
             observe_pids.erase(it);
@@ -93,15 +195,27 @@ void ScanFsAccess::handleAuditEvent(boost::shared_ptr<AuditEvent> event)
             return;
 
         debug(_("Valid process name %. insert pid %d"), event->comm.c_str(), event->pid);
-            observe_pids.insert(event->pid);
+            observe_pids[event->pid] = event->comm;
     }
     }
     debug(_("syscall: %d RO: %d"), event->type, event->readOnly);
+
+    // file has been seen before. Only count the access
+    if(event->known)
+    {
+        FileDepot::instance()->recordAccess(event->dev, event->ino,
+                                            relativeTime(event), event->pid, event->comm);
+        return;
+    }
     
     switch(event->type)
     {
         case Fork:
-            observe_pids.insert(event->exit);
+        {
+            // children belong to the application of their parent
+            std::map<pid_t, std::string>::iterator it = observe_pids.find(event->pid);
+            observe_pids[event->exit] = it != observe_pids.end() ? it->second : event->comm;
+        }
             break;
         case Creat:
         case Truncate:
@@ -138,6 +252,8 @@ void ScanFsAccess::handleAuditEvent(boost::shared_ptr<AuditEvent> event)
             if(event->type == Execve)
             {
                 FilePtr file = FilePtr(event->exe);
+                if(!file.empty())
+                    recordAccess(file, event);
                 if(file.unique())
                 {
                     info(_("Insert executable: \t%s"), event->exe.string().c_str());
@@ -148,10 +264,14 @@ void ScanFsAccess::handleAuditEvent(boost::shared_ptr<AuditEvent> event)
         default:
         {
             FilePtr file;
-            file = FilePtr(event->dev, event->ino, getPath2RegularFile(event->path));
+            if(event->symlink)
+                file = FilePtr(event->dev, event->ino, getPath2RegularFile(event->path));
+            else
+                file = FilePtr(event->dev, event->ino, event->path);
+            recordAccess(file, event);
             if(file.unique())
             {
-                info(_("Insert regular file: \t%s"), file.getPath().string().c_str());
+                info(_("Insert regular file: \t%s"), file.getPathName());
                 insert(file);
             }
         }
@@ -22,18 +22,26 @@
 
 #include "fileptr.hh"
 #include "common.hh"
-#include "signals.hh"
 
 #include <string>
 #include <deque>
 #include <set>
+#include <map>
+#include <boost/unordered_map.hpp>
 
 class AuditEvent;
 
+/*
+ * Sink of parsed audit events.
+ * Events are delivered in batches to keep the per-event overhead low.
+ * They are owned by the listener and must not be referenced after
+ * handleAuditEvents() returned.
+ */
 class EventCatcher
 {
     public:
-        virtual void handleAuditEvent(boost::shared_ptr<AuditEvent> event) = 0;
+        virtual ~EventCatcher() {}
+        virtual void handleAuditEvents(AuditEvent* const* events, size_t count) = 0;
 };
 
 /*
@@ -45,18 +53,40 @@ class EventCatcher
 class ScanFsAccess : public EventCatcher
 {
     public:
+        ScanFsAccess();
         void observeApp(std::string);
+        std::string getApp(pid_t);
         std::deque<FilePtr> getFileList();
+        unsigned long getInsertCount();
+        unsigned long getLinkCacheHits();
+        unsigned long getLinkCacheMisses();
     protected:
-        virtual void handleAuditEvent(boost::shared_ptr<AuditEvent>);
+        virtual void handleAuditEvents(AuditEvent* const*, size_t);
     private:
+        void handleAuditEvent(AuditEvent*);
         void insert(FilePtr&);
-        fs::path readLink(fs::path& path);
+        void recordAccess(FilePtr&, AuditEvent*);
+        unsigned int relativeTime(AuditEvent*);
+        bool followLink(std::string& path);
         fs::path getPath2RegularFile(fs::path& path);
 
         std::set<std::string> observe_apps;
-        std::set<pid_t> observe_pids;
+        std::map<pid_t, std::string> observe_pids;   // pid -> observed application
         std::deque<FilePtr> list;
+        volatile unsigned long inserted;  // read by the auto stop timer
+        unsigned long long start_time;   // milliseconds since the epoch of the first event
+
+        struct LinkCacheEntry
+        {
+                LinkCacheEntry() : ino(0), ctime_sec(0), ctime_nsec(0) {}
+                ino_t ino;
+                time_t ctime_sec;
+                long ctime_nsec;
+                std::string target;
+        };
+        boost::unordered_map<std::string, LinkCacheEntry> link_cache;
+        unsigned long link_cache_hits;
+        unsigned long link_cache_misses;
 };
 
 #endif
@@ -0,0 +1,220 @@
+/*
+ * fanotify.cc - Listen to file accesses using fanotify(7)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "fanotify.hh"
+#include "eventcatcher.hh"
+#include "fileptr.hh"
+#include "logging.hh"
+
+#include <cstdio>
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <mntent.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/fanotify.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <linux/limits.h>
+
+#define EVENT_BATCH_SIZE 64
+#define EVENT_BUFFER_SIZE (64*1024)
+
+FanotifyListener::FanotifyListener()
+    : fan_fd(-1), ext4_only(false), self(getpid()), catcher(NULL),
+      events(EVENT_BATCH_SIZE), events_received(0), events_lost(0)
+{
+    batch.reserve(EVENT_BATCH_SIZE);
+}
+
+FanotifyListener::~FanotifyListener()
+{
+    if(fan_fd != -1)
+        close(fan_fd);
+}
+
+void FanotifyListener::setEventCatcher(EventCatcher* c)
+{
+    catcher = c;
+}
+
+void FanotifyListener::watchExt4Only(bool v)
+{
+    ext4_only = v;
+}
+
+/*
+ * Mark every mounted filesystem backed by a block device.
+ * Pseudo filesystems like proc or tmpfs are never preloaded.
+ */
+void FanotifyListener::markMounts()
+{
+    struct mntent* ent;
+    FILE* mtab = setmntent("/proc/self/mounts", "r");
+    if(NULL == mtab)
+        mtab = setmntent("/etc/mtab", "r");
+    if(NULL == mtab)
+    {
+        error(_("Cannot read mount table: %s"), strerror(errno));
+        return;
+    }
+
+    while(NULL != (ent = getmntent(mtab)))
+    {
+        if(ext4_only ? strcmp(ent->mnt_type, "ext4") : ent->mnt_fsname[0] != '/')
+            continue;
+
+        if(0 != fanotify_mark(fan_fd, FAN_MARK_ADD | FAN_MARK_MOUNT,
+                              FAN_OPEN | FAN_CLOSE_WRITE, AT_FDCWD, ent->mnt_dir))
+            warn(_("Cannot watch %s: %s"), ent->mnt_dir, strerror(errno));
+        else
+            debug("Watch mount point %s", ent->mnt_dir);
+    }
+    endmntent(mtab);
+}
+
+bool FanotifyListener::connect()
+{
+    fan_fd = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_NONBLOCK,
+                           O_RDONLY | O_LARGEFILE | O_NOATIME);
+    if(fan_fd == -1)
+    {
+        error(_("Cannot initialize fanotify: %s"), strerror(errno));
+        return false;
+    }
+    markMounts();
+    return true;
+}
+
+/*
+ * Translate a fanotify event to an AuditEvent.
+ * The path and the process name are only looked up for unknown files.
+ */
+void FanotifyListener::handleEvent(int fd, unsigned long long mask, pid_t pid)
+{
+    struct stat st;
+    if(0 != fstat(fd, &st) || !S_ISREG(st.st_mode))
+        return;
+
+    AuditEvent* event = &events[batch.size()];
+    event->reset();
+    event->type = Open;
+    event->pid = pid;
+    event->dev = st.st_dev;
+    event->ino = st.st_ino;
+    event->successful = true;
+    event->readOnly = !(mask & FAN_CLOSE_WRITE);
+
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    event->time = (unsigned long long)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+
+    if(event->readOnly && FileDepot::instance()->contains(event->dev, event->ino))
+        event->known = true;
+    else
+    {
+        char name[64];
+        char buf[PATH_MAX];
+
+        sprintf(name, "/proc/self/fd/%d", fd);
+        ssize_t len = readlink(name, buf, sizeof(buf) - 1);
+        if(len <= 0 || buf[0] != '/')
+            return;
+        buf[len] = '\0';
+        event->path = buf;
+
+        sprintf(name, "/proc/%d/comm", pid);
+        FILE* comm = fopen(name, "r");
+        if(comm)
+        {
+            if(fgets(buf, sizeof(buf), comm))
+            {
+                buf[strcspn(buf, "\n")] = '\0';
+                event->comm = buf;
+            }
+            fclose(comm);
+        }
+    }
+
+    batch.push_back(event);
+    if(batch.size() == EVENT_BATCH_SIZE)
+        flushEvents();
+}
+
+void FanotifyListener::flushEvents()
+{
+    if(batch.empty())
+        return;
+    if(catcher)
+        catcher->handleAuditEvents(&batch[0], batch.size());
+    batch.clear();
+}
+
+void FanotifyListener::start()
+{
+    char buf[EVENT_BUFFER_SIZE];
+    struct pollfd pfd;
+    pfd.fd = fan_fd;
+    pfd.events = POLLIN;
+
+    try {
+        while(1)
+        {
+            interruptionPoint();
+
+            ssize_t len = read(fan_fd, buf, sizeof(buf));
+            if(len <= 0)
+            {
+                if(len < 0 && errno != EAGAIN && errno != EINTR)
+                {
+                    error(_("Cannot read fanotify events: %s"), strerror(errno));
+                    break;
+                }
+                // queue is drained: hand over pending events before going to sleep
+                flushEvents();
+                poll(&pfd, 1, -1);
+                continue;
+            }
+
+            struct fanotify_event_metadata* meta = (struct fanotify_event_metadata*)buf;
+            while(FAN_EVENT_OK(meta, len))
+            {
+                events_received++;
+                if(meta->mask & FAN_Q_OVERFLOW)
+                    events_lost++;
+                else if(meta->fd >= 0)
+                {
+                    if(meta->pid != self)
+                        handleEvent(meta->fd, meta->mask, meta->pid);
+                    close(meta->fd);
+                }
+                meta = FAN_EVENT_NEXT(meta, len);
+            }
+        }
+    }
+    catch(UserInterrupt&)
+    {}
+    flushEvents();
+
+    close(fan_fd);
+    fan_fd = -1;
+
+    notice(_("%lu fanotify events received"), events_received);
+    if(events_lost)
+        warn(_("Event queue overflowed %lu time(s). Some files may be missing"), events_lost);
+}
@@ -0,0 +1,62 @@
+/*
+ * fanotify.hh - Listen to file accesses using fanotify(7)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FANOTIFY_HH
+#define FANOTIFY_HH
+
+#include "common.hh"
+#include "listener.hh"
+
+#include <vector>
+
+/*
+ * Lightweight alternative to the audit listener.
+ *
+ * All mounted filesystems are marked for open and close-write events.
+ * The kernel hands over an open file descriptor per event, so neither
+ * audit rules nor path resolution are needed. Events are translated to
+ * AuditEvents and passed in batches to the same EventCatcher the audit
+ * listener uses. Opened for writing is reported when the file is closed.
+ *
+ * fanotify does not report fork(2) nor the working directory. Therefore
+ * observing applications by process name is not supported.
+ */
+class FanotifyListener : public Interruptible
+{
+    public:
+        FanotifyListener();
+        ~FanotifyListener();
+        void setEventCatcher(EventCatcher*);
+        void watchExt4Only(bool = true);
+        bool connect();
+        void start();
+    private:
+        void markMounts();
+        void handleEvent(int fd, unsigned long long mask, pid_t pid);
+        void flushEvents();
+
+        int fan_fd;
+        bool ext4_only;
+        pid_t self;
+        EventCatcher* catcher;
+        std::vector<AuditEvent> events;
+        std::vector<AuditEvent*> batch;
+        unsigned long events_received;
+        unsigned long events_lost;
+};
+
+#endif
@@ -29,25 +29,23 @@
 #include <stdlib.h>
 #include <unistd.h>
 
-/*
- * Call fiemap ioctl on file descriptor fd.
- * Determine the size of struct fiemap by extent_count.
- * If extent_count is set to 0, it chooses the size by itself to receive all extents.
- *
- * Returns NULL on error
- */
-struct fiemap* ioctl_fiemap(int fd, unsigned int extent_count)
+#define PROBE_EXTENTS 32
+
+static unsigned long ioctl_count = 0;
+
+static size_t fiemap_size(__u32 extent_count)
 {
-    if(!extent_count)
-        extent_count = 10;
-    
-    struct fiemap* fmap = (struct fiemap*)calloc(1, 
-                sizeof(struct fiemap) + extent_count * sizeof(struct fiemap_extent));
+    return sizeof(struct fiemap) + extent_count * sizeof(struct fiemap_extent);
+}
 
+static bool query_fiemap(int fd, struct fiemap* fmap, __u32 extent_count, __u32 flags)
+{
+    memset(fmap, 0, sizeof(struct fiemap));
     fmap->fm_length = FIEMAP_MAX_OFFSET;
-    fmap->fm_flags |= FIEMAP_FLAG_SYNC;
+    fmap->fm_flags = flags;
     fmap->fm_extent_count = extent_count;
 
+    __sync_fetch_and_add(&ioctl_count, 1);
     if(ioctl(fd, FS_IOC_FIEMAP, fmap) < 0)
     {
         char __filename[PATH_MAX];
@@ -62,22 +60,69 @@ struct fiemap* ioctl_fiemap(int fd, unsigned int extent_count)
         }
         else
             error(_("ioctl_fiemap and readlink failed: %s"), strerror(errno));
-        
-        free(fmap);
-        return NULL;
+        return false;
     }
-    
-    if(fmap->fm_mapped_extents == fmap->fm_extent_count)
-        return ioctl_fiemap(fd, extent_count<<1);
+    return true;
+}
 
-    if(fmap->fm_mapped_extents < fmap->fm_extent_count)
+/*
+ * Call fiemap ioctl on file descriptor fd.
+ *
+ * Most files have only a few extents. They are received by a single call
+ * into a buffer on the stack. Otherwise the number of extents is queried
+ * first, so the second call receives all of them. The returned struct
+ * fiemap is allocated with the size needed and has to be freed.
+ *
+ * Pass FIEMAP_FLAG_SYNC to write back dirty pages before mapping.
+ *
+ * Returns NULL on error
+ */
+struct fiemap* ioctl_fiemap(int fd, __u32 flags)
+{
+    union {
+        struct fiemap fmap;
+        char buf[sizeof(struct fiemap) + PROBE_EXTENTS * sizeof(struct fiemap_extent)];
+    } probe;
+    struct fiemap* fmap;
+
+    if(!query_fiemap(fd, &probe.fmap, PROBE_EXTENTS, flags))
+        return NULL;
+
+    if(probe.fmap.fm_mapped_extents < PROBE_EXTENTS)
     {
-        fmap = (struct fiemap*) realloc(fmap, sizeof(struct fiemap) 
-                                        + fmap->fm_mapped_extents  * sizeof(struct fiemap_extent));
-        fmap->fm_extent_count = fmap->fm_mapped_extents;
+        fmap = (struct fiemap*)malloc(fiemap_size(probe.fmap.fm_mapped_extents));
+        memcpy(fmap, &probe, fiemap_size(probe.fmap.fm_mapped_extents));
     }
-    
+    else
+    {
+        fmap = NULL;
+        // one spare extent reveals extents added in the meantime
+        do {
+            struct fiemap head;
+            if(!query_fiemap(fd, &head, 0, flags))
+                goto err;
+            __u32 extent_count = head.fm_mapped_extents + 1;
+            fmap = (struct fiemap*)realloc(fmap, fiemap_size(extent_count));
+            if(!query_fiemap(fd, fmap, extent_count, flags))
+                goto err;
+        } while(fmap->fm_mapped_extents == fmap->fm_extent_count);
+
+        fmap = (struct fiemap*)realloc(fmap, fiemap_size(fmap->fm_mapped_extents));
+    }
+
+    fmap->fm_extent_count = fmap->fm_mapped_extents;
     return fmap;
+err:
+    free(fmap);
+    return NULL;
+}
+
+/*
+ * Return number of fiemap ioctls since program start
+ */
+unsigned long get_fiemap_ioctl_count()
+{
+    return ioctl_count;
 }
 
 /*
@@ -92,7 +137,7 @@ struct fiemap* get_fiemap(const char* file)
         error(_("open: %s: %s"), file, strerror(errno));
         return NULL;
     }
-    struct fiemap* fmap = ioctl_fiemap(fd, 0);
+    struct fiemap* fmap = ioctl_fiemap(fd, FIEMAP_FLAG_SYNC);
     close(fd);
     return fmap;
 }
@@ -100,7 +145,7 @@ struct fiemap* get_fiemap(const char* file)
 /*
  * Test whether file is a sparse file
  */
-bool is_sparse_file(struct fiemap* fmap)
+bool is_sparse_file(const struct fiemap* fmap)
 {
     __u64 estimated = 0;
     for(unsigned int j=0; j < fmap->fm_mapped_extents; j++)
@@ -118,10 +163,10 @@ bool is_sparse_file(struct fiemap* fmap)
 
 __u64 get_allocated_file_size(const char* file)
 {
-    return get_allocated_file_size(get_fiemap(file));
+    return get_allocated_file_size(ExtentCache::instance()->get(file));
         
 }
-__u64 get_allocated_file_size(struct fiemap* fmap)
+__u64 get_allocated_file_size(const struct fiemap* fmap)
 {
     __u64 result = 0;
     
@@ -142,10 +187,10 @@ __u64 get_allocated_file_size(struct fiemap* fmap)
  */
 __u64 get_file_size(int fd)
 {
-    return get_file_size(ioctl_fiemap(fd));
+    return get_file_size(ExtentCache::instance()->get(fd));
 }
 
-__u64 get_file_size(struct fiemap* fmap)
+__u64 get_file_size(const struct fiemap* fmap)
 {
     if(NULL == fmap)
         return 0;
@@ -162,9 +207,9 @@ __u64 get_file_size(struct fiemap* fmap)
 __u32 get_frag_count(int fd)
 {
     __u32 result = 1;
-    struct fiemap* fmap;
+    const struct fiemap* fmap;
     
-    fmap = ioctl_fiemap(fd, 0);
+    fmap = ExtentCache::instance()->get(fd);
     if(NULL == fmap)
         return 0;
 
@@ -175,3 +220,162 @@ __u32 get_frag_count(int fd)
     return result;
 }
 
+DEFINE_SINGLETON(ExtentCache);
+
+ExtentCache::ExtentCache()
+    : bytes(0), peak_bytes(0)
+{
+    pthread_mutex_init(&lock, NULL);
+}
+
+ExtentCache::~ExtentCache()
+{
+    clear();
+    pthread_mutex_destroy(&lock);
+}
+
+/*
+ * Physical locations of delayed allocations are not known until the
+ * pages are written back. Only then the map has to be synced.
+ */
+static bool has_delalloc(const struct fiemap* fmap)
+{
+    for(unsigned int j=0; j < fmap->fm_mapped_extents; j++)
+        if(fmap->fm_extents[j].fe_flags & FIEMAP_EXTENT_UNKNOWN)
+            return true;
+    return false;
+}
+
+const struct fiemap* ExtentCache::lookup(dev_t dev, ino_t ino, int fd)
+{
+    pthread_mutex_lock(&lock);
+    cache_t::iterator it = cache.find(std::make_pair(dev, ino));
+    if(it != cache.end())
+    {
+        pthread_mutex_unlock(&lock);
+        return it->second;
+    }
+    pthread_mutex_unlock(&lock);
+
+    struct fiemap* fmap = ioctl_fiemap(fd);
+    if(fmap && has_delalloc(fmap))
+    {
+        free(fmap);
+        fmap = ioctl_fiemap(fd, FIEMAP_FLAG_SYNC);
+    }
+    if(NULL == fmap)
+        return NULL;
+
+    pthread_mutex_lock(&lock);
+    std::pair<cache_t::iterator, bool> ret
+        = cache.insert(cache_t::value_type(std::make_pair(dev, ino), fmap));
+    if(ret.second)
+    {
+        bytes += fiemap_size(fmap->fm_extent_count);
+        if(bytes > peak_bytes)
+            peak_bytes = bytes;
+    }
+    else
+    {
+        // another thread was faster
+        free(fmap);
+        fmap = ret.first->second;
+    }
+    pthread_mutex_unlock(&lock);
+
+    return fmap;
+}
+
+/*
+ * Return extent map of file descriptor fd. Returns NULL on error
+ */
+const struct fiemap* ExtentCache::get(int fd)
+{
+    struct stat st;
+    if(0 > fstat(fd, &st))
+        return NULL;
+    return lookup(st.st_dev, st.st_ino, fd);
+}
+
+/*
+ * Return extent map of a file. The file is only opened on a cache miss.
+ * Returns NULL on error
+ */
+const struct fiemap* ExtentCache::get(const char* path)
+{
+    struct stat st;
+    if(0 > stat(path, &st))
+        return NULL;
+
+    pthread_mutex_lock(&lock);
+    cache_t::iterator it = cache.find(std::make_pair(st.st_dev, st.st_ino));
+    const struct fiemap* fmap = it != cache.end() ? it->second : NULL;
+    pthread_mutex_unlock(&lock);
+    if(fmap)
+        return fmap;
+
+    int fd = open64(path, O_RDONLY);
+    if (fd < 0)
+    {
+        error(_("open: %s: %s"), path, strerror(errno));
+        return NULL;
+    }
+    fmap = lookup(st.st_dev, st.st_ino, fd);
+    close(fd);
+    return fmap;
+}
+
+void ExtentCache::erase(dev_t dev, ino_t ino)
+{
+    pthread_mutex_lock(&lock);
+    cache_t::iterator it = cache.find(std::make_pair(dev, ino));
+    if(it != cache.end())
+    {
+        bytes -= fiemap_size(it->second->fm_extent_count);
+        free(it->second);
+        cache.erase(it);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Forget the extent map of fd. Call it whenever the extents of a file
+ * have been changed.
+ */
+void ExtentCache::invalidate(int fd)
+{
+    struct stat st;
+    if(0 == fstat(fd, &st))
+        erase(st.st_dev, st.st_ino);
+}
+
+/*
+ * Forget the extent map of a file. Call it before a file is deleted,
+ * as its inode number may be reused by a new file.
+ */
+void ExtentCache::invalidate(const char* path)
+{
+    struct stat st;
+    if(0 == stat(path, &st))
+        erase(st.st_dev, st.st_ino);
+}
+
+void ExtentCache::clear()
+{
+    pthread_mutex_lock(&lock);
+    for(cache_t::iterator it = cache.begin(); it != cache.end(); ++it)
+        free(it->second);
+    cache.clear();
+    bytes = 0;
+    pthread_mutex_unlock(&lock);
+}
+
+size_t ExtentCache::memoryUsage()
+{
+    return bytes;
+}
+
+size_t ExtentCache::getPeakMemory()
+{
+    return peak_bytes;
+}
@@ -72,12 +72,49 @@ struct fiemap {
                                                     * merged for efficiency. */
 
 
-struct fiemap* ioctl_fiemap(int fd, unsigned int extent_count = 0);
+struct fiemap* ioctl_fiemap(int fd, __u32 flags = 0);
 struct fiemap* get_fiemap(const char* file);
-bool is_sparse_file(struct fiemap* fmap);
+bool is_sparse_file(const struct fiemap* fmap);
 __u64 get_allocated_file_size(const char* file);
-__u64 get_allocated_file_size(struct fiemap* fmap);
+__u64 get_allocated_file_size(const struct fiemap* fmap);
 __u64 get_file_size(int fd);
-__u64 get_file_size(struct fiemap* fmap);
+__u64 get_file_size(const struct fiemap* fmap);
 __u32 get_frag_count(int fd);
+unsigned long get_fiemap_ioctl_count();
+
+#include "singleton.hh"
+
+#include <sys/types.h>
+#include <boost/unordered_map.hpp>
+
+/*
+ * Extent maps of the current run keyed by device and inode number.
+ *
+ * Each map is fetched once without FIEMAP_FLAG_SYNC. Only files with
+ * delayed allocations are synced. Returned maps are owned by the cache
+ * and stay valid until the file is invalidated, which happens after
+ * its extents have been moved. See Device::moveExtent()
+ */
+class ExtentCache
+{
+        DECLARE_SINGLETON(ExtentCache);
+    public:
+        const struct fiemap* get(int fd);
+        const struct fiemap* get(const char* path);
+        void invalidate(int fd);
+        void invalidate(const char* path);
+        void clear();
+        size_t memoryUsage();
+        size_t getPeakMemory();
+    private:
+        const struct fiemap* lookup(dev_t, ino_t, int fd);
+        void erase(dev_t, ino_t);
+
+        typedef boost::unordered_map<std::pair<dev_t, ino_t>, struct fiemap*> cache_t;
+        cache_t cache;
+        size_t bytes;
+        size_t peak_bytes;
+        pthread_mutex_t lock;
+};
+
 #endif /* _LINUX_FIEMAP_H */
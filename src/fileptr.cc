@@ -2,7 +2,7 @@
  * fileptr.cc - Pointer to an unique file object
  *
  * Copyright (C) 2011 by Andreas Rid
- * 
+ *
  * This program is free software: you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
  * the Free Software Foundation, either version 3 of the License, or
@@ -23,7 +23,13 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdint.h>
 #include <stdexcept>
+#include <algorithm>
+
+#define STRING_CHUNK_SIZE (64*1024)
+#define RECORD_CHUNK_SIZE 1024
+#define MIN_TABLE_SIZE 1024
 
 bool isFileUnique(const char* path)
 {
@@ -35,142 +41,375 @@ bool isFileUnique(const char* path)
         err_msg += strerror(errno);
         throw std::runtime_error(err_msg);
     }
-    
+
     FilePtr file(st.st_dev, st.st_ino, path);
     return file.unique();
 }
 
-DEFINE_SINGLETON(FileDepot);
+/*
+ * FNV-1a
+ */
+static size_t hashString(const char* str, size_t len)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for(size_t i = 0; i < len; i++)
+    {
+        h ^= (unsigned char)str[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
 
-FileDepot::FileDepot() 
-{}
-FileDepot::~FileDepot()
+static size_t hashKey(dev_t dev, ino_t ino)
+{
+    uint64_t h = (uint64_t)ino ^ ((uint64_t)dev << 40) ^ ((uint64_t)dev >> 24);
+    // finalizer of MurmurHash3
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+StringPool::StringPool()
+    : chunk_used(0), chunk_size(0), table(MIN_TABLE_SIZE), count(0), bytes(0)
 {}
 
-bool FileDepot::key_t::operator<(const FileDepot::key_t& other) const
+StringPool::~StringPool()
 {
-    if(this->dev < other.dev)
-        return true;
-    else if(this->dev == other.dev)
-        if(this->ino < other.ino)
-            return true;
+    for(std::vector<char*>::iterator it = chunks.begin(); it != chunks.end(); ++it)
+        delete[] *it;
+}
+
+/*
+ * Return a pointer to a persistent copy of str.
+ * The copy is valid until the pool is destroyed.
+ */
+const char* StringPool::intern(const char* str, size_t len)
+{
+    size_t mask = table.size() - 1;
+    size_t i = hashString(str, len) & mask;
+    while(table[i])
+    {
+        if(0 == strncmp(table[i], str, len) && table[i][len] == '\0')
+            return table[i];
+        i = (i + 1) & mask;
+    }
 
-    return false;
+    if(chunk_used + len + 1 > chunk_size)
+    {
+        // strings longer than a chunk get their own chunk
+        chunk_size = std::max((size_t)STRING_CHUNK_SIZE, len + 1);
+        chunks.push_back(new char[chunk_size]);
+        chunk_used = 0;
+        bytes += chunk_size;
+    }
+    char* copy = chunks.back() + chunk_used;
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    chunk_used += len + 1;
+
+    table[i] = copy;
+    if(++count * 2 > table.size())
+        grow();
+    return copy;
 }
 
-void FileDepot::insert(key_t key, FilePtr& file)
+void StringPool::grow()
 {
-    std::pair<files_it_t, bool> ret = files.insert(files_pair_t(key, file));
-    if(ret.second == false)
+    std::vector<const char*> old(table.size() * 2);
+    old.swap(table);
+
+    size_t mask = table.size() - 1;
+    for(std::vector<const char*>::iterator it = old.begin(); it != old.end(); ++it)
     {
-        boost::shared_ptr<FilePtrPrivate> a = ret.first->second.lock();
-        file = a;
+        if(*it == NULL)
+            continue;
+        size_t i = hashString(*it, strlen(*it)) & mask;
+        while(table[i])
+            i = (i + 1) & mask;
+        table[i] = *it;
     }
 }
 
-void FileDepot::insert(dev_t dev, ino_t ino, FilePtr& file)
+size_t StringPool::memoryUsage() const
 {
-    key_t key;
-    genKey(&key, dev, ino);
-    insert(key, file);
+    return bytes + table.capacity() * sizeof(const char*);
 }
 
-void FileDepot::insert(FilePtr& file)
+DEFINE_SINGLETON(FileDepot);
+
+FileDepot::FileDepot()
+    : table(MIN_TABLE_SIZE), count(0), chunk_used(RECORD_CHUNK_SIZE), free_list(NULL)
+{}
+
+FileDepot::~FileDepot()
 {
-    key_t key;
-    struct stat st;
+    for(std::vector<FileRecord*>::iterator it = chunks.begin(); it != chunks.end(); ++it)
+        delete[] *it;
+}
 
-    if(stat(file.getPath().string().c_str(), &st) == 0)
+/*
+ * Return index of the slot holding (dev, ino) or of the empty slot
+ * where it would be inserted.
+ */
+size_t FileDepot::slot(dev_t dev, ino_t ino) const
+{
+    size_t mask = table.size() - 1;
+    size_t i = hashKey(dev, ino) & mask;
+    while(table[i])
     {
-        genKey(&key, st.st_dev, st.st_ino);
-        insert(key, file);
+        if(table[i]->ino == ino && table[i]->dev == dev)
+            break;
+        i = (i + 1) & mask;
     }
+    return i;
 }
 
-void FileDepot::remove(FilePtr file)
+FileRecord* FileDepot::allocRecord()
 {
-    struct stat st;
-    key_t key;
-    
-    if(!file)
+    if(free_list)
+    {
+        FileRecord* r = free_list;
+        free_list = r->next_free;
+        return r;
+    }
+    if(chunk_used == RECORD_CHUNK_SIZE)
+    {
+        chunks.push_back(new FileRecord[RECORD_CHUNK_SIZE]);
+        chunk_used = 0;
+    }
+    return &chunks.back()[chunk_used++];
+}
+
+void FileDepot::rehash(size_t size)
+{
+    std::vector<FileRecord*> old(size);
+    old.swap(table);
+
+    for(std::vector<FileRecord*>::iterator it = old.begin(); it != old.end(); ++it)
+        if(*it)
+            table[slot((*it)->dev, (*it)->ino)] = *it;
+}
+
+/*
+ * Return the record of (dev, ino) with its reference count incremented.
+ * A new record is created if the file is not known yet.
+ */
+FileRecord* FileDepot::acquire(dev_t dev, ino_t ino, const char* path, size_t len)
+{
+    size_t i = slot(dev, ino);
+    if(table[i])
+    {
+        table[i]->refs++;
+        return table[i];
+    }
+
+    FileRecord* r = allocRecord();
+    r->dev = dev;
+    r->ino = ino;
+    r->path = paths.intern(path, len);
+    r->refs = 1;
+    r->valid = true;
+    r->first_access = 0;
+    r->access_count = 0;
+    r->pid = 0;
+    r->comm = NULL;
+
+    table[i] = r;
+    // keep load factor below 0.5 for short probe sequences
+    if(++count * 2 > table.size())
+        rehash(table.size() * 2);
+    return r;
+}
+
+/*
+ * Drop one reference. The last reference removes the record using
+ * backward shift deletion. Therefore no tombstones are left behind.
+ */
+void FileDepot::release(FileRecord* r)
+{
+    if(--r->refs)
         return;
-    fs::path p = file.getPath();
-    
-    if(stat(file.getPath().string().c_str(), &st) == 0)
+
+    size_t mask = table.size() - 1;
+    size_t i = slot(r->dev, r->ino);
+    size_t j = i;
+    while(1)
     {
-        genKey(&key, st.st_dev, st.st_ino);
-        files.erase(key);
+        j = (j + 1) & mask;
+        if(table[j] == NULL)
+            break;
+        size_t home = hashKey(table[j]->dev, table[j]->ino) & mask;
+        // move entry j to the hole at i unless its home lies cyclically in (i, j]
+        if((j > i && (home <= i || home > j))
+           || (j < i && (home <= i && home > j)))
+        {
+            table[i] = table[j];
+            i = j;
+        }
     }
+    table[i] = NULL;
+    count--;
+
+    r->next_free = free_list;
+    free_list = r;
 }
 
+bool FileDepot::contains(dev_t dev, ino_t ino)
+{
+    return table[slot(dev, ino)] != NULL;
+}
 
-void FileDepot::genKey(key_t* key, dev_t dev, ino_t ino)
+/*
+ * Count an access to a file. Time and accessor are kept of the first access.
+ */
+void FileDepot::recordAccess(FileRecord* r, unsigned int time, pid_t pid, const std::string& comm)
 {
-    key->dev = dev;
-    key->ino = ino;
+    if(r->access_count++)
+        return;
+
+    r->first_access = time;
+    r->pid = pid;
+    r->comm = paths.intern(comm.c_str(), comm.size());
 }
 
-FilePtrPrivate::FilePtrPrivate()
+/*
+ * Count an access to a file already known by (dev, ino).
+ * Return false if the file is unknown.
+ */
+bool FileDepot::recordAccess(dev_t dev, ino_t ino, unsigned int time, pid_t pid, const std::string& comm)
 {
-    ino = dev = flags = 0;
-    valid = true;
+    FileRecord* r = table[slot(dev, ino)];
+    if(r == NULL)
+        return false;
+
+    recordAccess(r, time, pid, comm);
+    return true;
 }
 
-FilePtr::FilePtr(dev_t dev, ino_t ino, fs::path path, bool valid)
-    : boost::shared_ptr<FilePtrPrivate>(new FilePtrPrivate)
+size_t FileDepot::size() const
 {
-    get()->path = path;
-    get()->dev = dev;
-    get()->ino = ino;
-    FileDepot::instance()->insert(dev, ino, *this);
+    return count;
+}
 
-    if(false == valid)
-        get()->valid = false;
+/*
+ * Return number of bytes allocated by records, hash table and paths
+ */
+size_t FileDepot::memoryUsage() const
+{
+    return chunks.size() * RECORD_CHUNK_SIZE * sizeof(FileRecord)
+        + table.capacity() * sizeof(FileRecord*)
+        + paths.memoryUsage();
 }
 
-FilePtr::FilePtr(fs::path path, bool valid)
-    : boost::shared_ptr<FilePtrPrivate>(new FilePtrPrivate)
+FilePtr::FilePtr(dev_t dev, ino_t ino, const fs::path& path, bool valid)
+{
+    init(dev, ino, path.string(), valid);
+}
+
+FilePtr::FilePtr(const fs::path& path, bool valid)
+    : record(NULL)
 {
     struct stat st;
     if(stat(path.string().c_str(), &st) == 0)
-    {
-        get()->path = path;
-        get()->dev = st.st_dev;
-        get()->ino = st.st_ino;
-        FileDepot::instance()->insert(st.st_dev, st.st_ino, *this);
-        if(false == valid)
-            get()->valid = false;
-    }
+        init(st.st_dev, st.st_ino, path.string(), valid);
 }
 
 FilePtr::FilePtr()
+    : record(NULL)
 {}
 
+FilePtr::FilePtr(const FilePtr& other)
+    : record(other.record)
+{
+    if(record)
+        record->refs++;
+}
+
+FilePtr& FilePtr::operator=(const FilePtr& other)
+{
+    if(other.record)
+        other.record->refs++;
+    if(record)
+        FileDepot::instance()->release(record);
+    record = other.record;
+    return *this;
+}
+
 FilePtr::~FilePtr()
 {
-    if(this->unique())
-        FileDepot::instance()->remove(*this);
+    if(record)
+        FileDepot::instance()->release(record);
+}
+
+void FilePtr::init(dev_t dev, ino_t ino, const std::string& path, bool valid)
+{
+    record = FileDepot::instance()->acquire(dev, ino, path.c_str(), path.size());
+    if(false == valid)
+        record->valid = false;
+}
+
+bool FilePtr::unique() const
+{
+    return record && record->refs == 1;
+}
+
+bool FilePtr::empty() const
+{
+    return record == NULL;
+}
+
+fs::path FilePtr::getPath() const
+{
+    return fs::path(record->path);
+}
+
+const char* FilePtr::getPathName() const
+{
+    return record->path;
+}
+
+void FilePtr::recordAccess(unsigned int time, pid_t pid, const std::string& comm)
+{
+    FileDepot::instance()->recordAccess(record, time, pid, comm);
+}
+
+unsigned int FilePtr::getFirstAccess() const
+{
+    return record->first_access;
+}
+
+unsigned int FilePtr::getAccessCount() const
+{
+    return record->access_count;
+}
+
+pid_t FilePtr::getPid() const
+{
+    return record->pid;
 }
 
-const fs::path& FilePtr::getPath() const
+const char* FilePtr::getComm() const
 {
-    return get()->path;
+    return record->comm;
 }
 
 void FilePtr::setInvalid()
 {
-    get()->valid = false;
+    record->valid = false;
 }
 bool FilePtr::isValid() const
 {
-    return get()->valid;
+    return record->valid;
 }
 ino_t FilePtr::getInode() const
 {
-    return get()->ino;
+    return record->ino;
 }
 
 dev_t FilePtr::getDevice() const
 {
-    return get()->dev;
+    return record->dev;
 }
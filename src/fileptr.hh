@@ -2,7 +2,7 @@
  * fileptr.hh - Pointer to an unique file object
  *
  * Copyright (C) 2011 by Andreas Rid
- * 
+ *
  * This program is free software: you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
  * the Free Software Foundation, either version 3 of the License, or
@@ -23,77 +23,117 @@
 #include "singleton.hh"
 
 #include <string>
-#include <map>
-#include <boost/shared_ptr.hpp>
-#include <boost/weak_ptr.hpp>
+#include <vector>
 #include <boost/filesystem.hpp>
 
 namespace fs = boost::filesystem;
 
 
-struct FilePtrPrivate
+/*
+ * Append-only pool of null-terminated strings.
+ * Equal strings are stored only once.
+ */
+class StringPool
+{
+    public:
+        StringPool();
+        ~StringPool();
+        const char* intern(const char* str, size_t len);
+        size_t memoryUsage() const;
+    private:
+        void grow();
+        std::vector<char*> chunks;
+        size_t chunk_used;
+        size_t chunk_size;
+        std::vector<const char*> table;  // open addressing hash set
+        size_t count;
+        size_t bytes;
+};
+
+/*
+ * File record as stored in the arena of FileDepot.
+ * A record is reference counted by FilePtr objects.
+ */
+struct FileRecord
 {
         friend class FilePtr;
+        friend class FileDepot;
     private:
-        FilePtrPrivate();
-        ino_t ino;
         dev_t dev;
-        unsigned int flags;
-        fs::path path;
+        ino_t ino;
+        union {
+            const char* path;    // interned in FileDepot's string pool
+            FileRecord* next_free;
+        };
+        unsigned int refs;
         bool valid;
+        unsigned int first_access;  // milliseconds since start of collection
+        unsigned int access_count;
+        pid_t pid;                  // process that accessed the file first
+        const char* comm;
 };
 
-typedef boost::weak_ptr<FilePtrPrivate> WeakFilePtr;
-
-class FilePtr : public boost::shared_ptr<FilePtrPrivate>
+class FilePtr
 {
-        typedef std::map<ino_t,WeakFilePtr> map_t;
-        
     public:
-        FilePtr(dev_t, ino_t, fs::path, bool = true);
-        FilePtr(fs::path, bool = true);
+        FilePtr(dev_t, ino_t, const fs::path&, bool = true);
+        FilePtr(const fs::path&, bool = true);
     public:
         FilePtr();
+        FilePtr(const FilePtr&);
+        FilePtr& operator=(const FilePtr&);
         ~FilePtr();
-        FilePtr(boost::shared_ptr<FilePtrPrivate>& other)
-            : boost::shared_ptr<FilePtrPrivate>(other)
-        {
-            
-        }
+        bool unique() const;
+        bool empty() const;
         void setInvalid();
         bool isValid() const;
         ino_t getInode() const;
         dev_t getDevice() const;
-        const fs::path& getPath() const;
+        fs::path getPath() const;
+        const char* getPathName() const;
+        void recordAccess(unsigned int time, pid_t pid, const std::string& comm);
+        unsigned int getFirstAccess() const;
+        unsigned int getAccessCount() const;
+        pid_t getPid() const;
+        const char* getComm() const;
     private:
+        void init(dev_t, ino_t, const std::string&, bool);
+        FileRecord* record;
 };
 
+/*
+ * FileDepot keeps track of all existing file objects.
+ *
+ * Records are looked up by (dev, ino) in an open addressing hash table.
+ * The records themselves are allocated in chunks and recycled using a
+ * free list. Paths are interned in a string pool. Removing a file needs
+ * neither a system call nor a free().
+ */
 class FileDepot
 {
         DECLARE_SINGLETON(FileDepot);
-        friend class Collector;
         friend class FilePtr;
     public:
-        struct key_t
-        {
-                dev_t dev;
-                ino_t ino;
-                bool operator<(const key_t&) const;
-        };
-        
-        typedef std::pair<key_t, WeakFilePtr> files_pair_t;
-        typedef std::map<key_t, WeakFilePtr> files_t;        
-        typedef files_t::iterator files_it_t;
-        
+        bool contains(dev_t, ino_t);
+        bool recordAccess(dev_t, ino_t, unsigned int time, pid_t, const std::string& comm);
+        size_t size() const;
+        size_t memoryUsage() const;
     protected:
-        void insert(dev_t, ino_t, FilePtr&);
-        void insert(FilePtr&);
-        void remove(FilePtr);
+        FileRecord* acquire(dev_t, ino_t, const char* path, size_t len);
+        void release(FileRecord*);
+        void recordAccess(FileRecord*, unsigned int time, pid_t, const std::string& comm);
 
     private:
-        files_t files;
-        inline void genKey(key_t*, dev_t, ino_t);
-        void insert(key_t, FilePtr&);
+        size_t slot(dev_t, ino_t) const;
+        FileRecord* allocRecord();
+        void rehash(size_t);
+
+        std::vector<FileRecord*> table;
+        size_t count;
+        std::vector<FileRecord*> chunks;
+        size_t chunk_used;
+        FileRecord* free_list;
+        StringPool paths;
 };
 
 #endif
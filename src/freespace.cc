@@ -0,0 +1,273 @@
+/*
+ * freespace.cc - Index of free block ranges of a filesystem
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "freespace.hh"
+#include "logging.hh"
+
+#include <algorithm>
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/sysmacros.h>
+#include <linux/fs.h>
+#include <linux/fsmap.h>
+
+#ifndef FS_IOC_GETFSMAP
+#define FS_IOC_GETFSMAP _IOWR('X', 59, struct fsmap_head)
+#endif
+
+#define FSMAP_RECORDS 1024
+
+struct CompareStart
+{
+        bool operator()(const Extent& e, __u64 block) const
+        {
+            return e.start < block;
+        }
+};
+
+FreeSpaceIndex::FreeSpaceIndex(Device _device)
+    : device(_device), leaves(0), blocks_per_flex(0)
+{
+    refresh();
+}
+
+void FreeSpaceIndex::refresh()
+{
+    blocks_per_flex = (__u64)device.getBlocksPerGroup() << device.getLogGroupsPerFlex();
+    runs.clear();
+    if(!readFsMap())
+    {
+        runs.clear();
+        if(!device.readFreeExtents(runs))
+            warn(_("Cannot read free space of %s"), device.getDevicePath().c_str());
+    }
+    build();
+    debug("%u free block range(s) with %llu blocks on %s", (unsigned int)runs.size(),
+          getFreeBlocks(), device.getDevicePath().c_str());
+}
+
+/*
+ * Receive free space records of the data device by FS_IOC_GETFSMAP.
+ * Return false if the kernel or filesystem does not support it.
+ */
+bool FreeSpaceIndex::readFsMap()
+{
+    int fd = open(device.getMountPoint().string().c_str(), O_RDONLY | O_DIRECTORY);
+    if(fd < 0)
+        return false;
+
+    // device number as encoded by the kernel
+    dev_t devno = device.getDeviceNumber();
+    __u32 fmr_device = (minor(devno) & 0xff) | (major(devno) << 8)
+                     | ((minor(devno) & ~0xff) << 12);
+    __u32 blocksize = device.getBlockSize();
+
+    std::vector<char> buf(fsmap_sizeof(FSMAP_RECORDS));
+    struct fsmap_head* head = (struct fsmap_head*)&buf[0];
+    head->fmh_count = FSMAP_RECORDS;
+    memset(&head->fmh_keys[1], 0xff, sizeof(struct fsmap));
+    head->fmh_keys[1].fmr_reserved[0] = 0;
+    head->fmh_keys[1].fmr_reserved[1] = 0;
+    head->fmh_keys[1].fmr_reserved[2] = 0;
+
+    bool done = false;
+    while(!done)
+    {
+        if(0 > ioctl(fd, FS_IOC_GETFSMAP, head))
+        {
+            debug("FS_IOC_GETFSMAP: %s", strerror(errno));
+            close(fd);
+            return false;
+        }
+        if(head->fmh_entries == 0)
+            break;
+
+        for(__u32 i = 0; i < head->fmh_entries; i++)
+        {
+            struct fsmap& rec = head->fmh_recs[i];
+            if(rec.fmr_flags & FMR_OF_LAST)
+                done = true;
+            if(rec.fmr_owner != FMR_OWN_FREE || rec.fmr_device != fmr_device)
+                continue;
+
+            __u64 start = rec.fmr_physical / blocksize;
+            __u64 len = rec.fmr_length / blocksize;
+            if(!runs.empty() && runs.back().start + runs.back().len == start)
+                runs.back().len += len;
+            else if(len)
+                runs.push_back(Extent(start, len));
+        }
+        // continue behind the last record
+        head->fmh_keys[0] = head->fmh_recs[head->fmh_entries - 1];
+    }
+    close(fd);
+    return true;
+}
+
+void FreeSpaceIndex::build()
+{
+    leaves = 1;
+    while(leaves < runs.size())
+        leaves <<= 1;
+
+    tree.assign(2 * leaves, 0);
+    for(size_t i = 0; i < runs.size(); i++)
+        tree[leaves + i] = runs[i].len;
+    for(size_t i = leaves - 1; i > 0; i--)
+        tree[i] = std::max(tree[2*i], tree[2*i+1]);
+}
+
+void FreeSpaceIndex::update(size_t run)
+{
+    size_t i = leaves + run;
+    tree[i] = runs[run].len;
+    for(i >>= 1; i > 0; i >>= 1)
+        tree[i] = std::max(tree[2*i], tree[2*i+1]);
+}
+
+/*
+ * Return index of first run ending behind block
+ */
+size_t FreeSpaceIndex::runAt(__u64 block) const
+{
+    size_t i = std::lower_bound(runs.begin(), runs.end(), block, CompareStart())
+             - runs.begin();
+    if(i > 0 && runs[i-1].start + runs[i-1].len > block)
+        i--;
+    return i;
+}
+
+/*
+ * Return first run of at least len blocks with index from or above
+ * in subtree node covering the runs first to last. Return -1 if there is none.
+ */
+int FreeSpaceIndex::findNode(size_t node, size_t first, size_t last,
+                             size_t from, __u64 len) const
+{
+    if(last < from || tree[node] < len)
+        return -1;
+    if(first == last)
+        return first;
+
+    size_t middle = (first + last) / 2;
+    int ret = findNode(2*node, first, middle, from, len);
+    if(ret < 0)
+        ret = findNode(2*node+1, middle + 1, last, from, len);
+    return ret;
+}
+
+Extent FreeSpaceIndex::largest() const
+{
+    if(runs.empty() || tree[1] == 0)
+        return Extent();
+    return runs[findNode(1, 0, leaves - 1, 0, tree[1])];
+}
+
+/*
+ * A run containing hint is used from hint on.
+ * Return an empty extent if no run is long enough.
+ */
+Extent FreeSpaceIndex::findFirst(__u64 len, __u64 hint) const
+{
+    if(runs.empty() || len == 0)
+        return Extent();
+
+    size_t i = runAt(hint);
+    if(i < runs.size() && runs[i].start < hint)
+    {
+        __u64 tail = runs[i].start + runs[i].len - hint;
+        if(tail >= len)
+            return Extent(hint, tail);
+        i++;
+    }
+    if(i >= runs.size())
+        return Extent();
+
+    int ret = findNode(1, 0, leaves - 1, i, len);
+    if(ret < 0)
+        return Extent();
+    return runs[ret];
+}
+
+void FreeSpaceIndex::findInFlex(__u32 flex, std::vector<Extent>& list) const
+{
+    __u64 first = flex * blocks_per_flex;
+    __u64 last = first + blocks_per_flex;
+
+    for(size_t i = runAt(first); i < runs.size() && runs[i].start < last; i++)
+    {
+        if(runs[i].len == 0)
+            continue;
+        __u64 start = std::max(first, (__u64)runs[i].start);
+        __u64 end = std::min(last, runs[i].start + runs[i].len);
+        list.push_back(Extent(start, end - start));
+    }
+}
+
+void FreeSpaceIndex::reserve(const Extent& extent)
+{
+    __u64 start = extent.start;
+    __u64 end = extent.start + extent.len;
+    bool rebuild = false;
+
+    for(size_t i = runAt(start); i < runs.size() && runs[i].start < end; i++)
+    {
+        Extent& run = runs[i];
+        __u64 run_end = run.start + run.len;
+        if(run.len == 0)
+            continue;
+
+        if(start <= run.start)
+        {
+            // head of run is used
+            run.len = run_end > end ? run_end - end : 0;
+            run.start = std::min(end, run_end);
+        }
+        else if(end >= run_end)
+            // tail of run is used
+            run.len = start - run.start;
+        else
+        {
+            // run is split into two
+            run.len = start - run.start;
+            runs.insert(runs.begin() + i + 1, Extent(end, run_end - end));
+            rebuild = true;
+            break;
+        }
+        if(!rebuild)
+            update(i);
+    }
+
+    if(rebuild)
+        build();
+}
+
+__u64 FreeSpaceIndex::getFreeBlocks() const
+{
+    __u64 total = 0;
+    for(size_t i = 0; i < runs.size(); i++)
+        total += runs[i].len;
+    return total;
+}
+
+size_t FreeSpaceIndex::size() const
+{
+    return runs.size();
+}
@@ -0,0 +1,74 @@
+/*
+ * freespace.hh - Index of free block ranges of a filesystem
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FREE_SPACE_HH
+#define FREE_SPACE_HH
+
+#include "device.hh"
+
+#include <vector>
+
+/*
+ * FreeSpaceIndex holds a snapshot of the free block ranges of a device.
+ *
+ * Free space is received by the FS_IOC_GETFSMAP ioctl (Linux 4.12).
+ * Otherwise the block bitmaps are read by libext2fs.
+ *
+ * Ranges are sorted by start block. A segment tree on top stores the
+ * longest range of each subtree. So the longest range and the first
+ * range of a minimum length behind a block are found in logarithmic
+ * time. Blocks handed out should be reserved to keep the snapshot
+ * up to date.
+ */
+class FreeSpaceIndex
+{
+    public:
+        FreeSpaceIndex(Device);
+
+        //updates snapshot
+        void refresh();
+
+        //Return longest free range
+        Extent largest() const;
+
+        //Return first free range of at least len blocks behind block hint
+        Extent findFirst(__u64 len, __u64 hint = 0) const;
+
+        //Append free ranges of flex group to list
+        void findInFlex(__u32 flex, std::vector<Extent>& list) const;
+
+        //Mark blocks as used
+        void reserve(const Extent&);
+
+        __u64 getFreeBlocks() const;
+        size_t size() const;
+    private:
+        bool readFsMap();
+        void build();
+        void update(size_t run);
+        size_t runAt(__u64 block) const;
+        int findNode(size_t node, size_t first, size_t last,
+                     size_t from, __u64 len) const;
+
+        Device device;
+        std::vector<Extent> runs;
+        std::vector<__u64> tree;    // longest run per subtree, root is 1
+        size_t leaves;
+        __u64 blocks_per_flex;
+};
+
+#endif
@@ -20,7 +20,9 @@
 #include "listener.hh"
 #include "common.hh"
 #include "logging.hh"
-#include "device.hh"
+#include "mounttable.hh"
+#include "fileptr.hh"
+#include "eventcatcher.hh"
 
 #include <libaudit.h>
 #include <auparse.h>
@@ -36,10 +38,10 @@
 #include <linux/unistd.h>
 //mount flags
 #include <linux/fs.h>
-#include <sys/vfs.h>
 
 #include <boost/foreach.hpp>
 #include <sys/utsname.h>
+#include <sys/time.h>
 
 #include <fstream>
 
@@ -72,28 +74,113 @@ void checkSocketCaptured(pid_t audit_pid)
     }
 }
 
+#define EVENT_BATCH_SIZE 64
+
+// upper limit of filter rules per architecture
+#define MAX_KERNEL_RULES 64
+
 AuditEvent::AuditEvent()
 {
+    reset();
+}
+
+void AuditEvent::reset()
+{
+    type = Unknown;
+    time = 0;
+    pid = ppid = exit = 0;
+    comm.clear();
+    exe.clear();
+    path.clear();
+    cwd.clear();
     ino = 0;
     dev = 0;
     readOnly = false;
     successful = false;
+    known = false;
+    symlink = false;
 }
 
 AuditListener::AuditListener()
 {
     audit_fd = -1;
+    catcher = NULL;
+    watch_wildcards = false;
+    records_received = 0;
     ext4_only = false;
+    paths_resolved = 0;
+    paths_known = 0;
+    replaying = false;
+    capture = NULL;
 }
 
 AuditListener::~AuditListener()
 {
+    if(capture)
+        fclose(capture);
+}
+
+void AuditListener::setEventCatcher(EventCatcher* c)
+{
+    catcher = c;
+}
+
+/*
+ * Take an event out of the pool. Events are never freed
+ * until the listener is destroyed.
+ */
+AuditEvent* AuditListener::allocEvent()
+{
+    if(free_events.empty())
+    {
+        event_pool.push_back(AuditEvent());
+        return &event_pool.back();
+    }
+    AuditEvent* event = free_events.back();
+    free_events.pop_back();
+    return event;
+}
+
+void AuditListener::releaseEvent(AuditEvent* event)
+{
+    event->reset();
+    free_events.push_back(event);
+}
+
+void AuditListener::emitEvent(AuditEvent* event)
+{
+    batch.push_back(event);
+    if(batch.size() >= EVENT_BATCH_SIZE)
+        flushEvents();
+}
+
+/*
+ * Pass all pending events to the catcher and recycle them
+ */
+void AuditListener::flushEvents()
+{
+    if(batch.empty())
+        return;
+
+    if(catcher)
+        catcher->handleAuditEvents(&batch[0], batch.size());
+
+    BOOST_FOREACH(AuditEvent* event, batch)
+        releaseEvent(event);
+    batch.clear();
+}
+
+static bool hasWildcard(const std::string& path)
+{
+    return path.find_first_of("*?") != std::string::npos;
 }
 
 void AuditListener::excludePath(std::string path)
 {
-    exclude_paths.push_back(
-    path2regex(realpath(path).string()));
+    std::string p = realpath(path).string();
+    exclude_paths.insert(p);
+    if(!hasWildcard(p))
+        literal_exclude_paths.push_back(p);
 }
 
 void AuditListener::watchPath(std::string path)
@@ -102,8 +189,12 @@ void AuditListener::watchPath(std::string path)
         // does not make sense and can leads to unwanted behaviour
         return;
 
-    watch_paths.push_back(
-    path2regex(realpath(path).string()));
+    std::string p = realpath(path).string();
+    watch_paths.insert(p);
+    if(hasWildcard(p))
+        watch_wildcards = true;
+    else
+        literal_watch_paths.push_back(p);
 }
 
 void AuditListener::excludeDevice(std::string wildcard)
@@ -159,22 +250,40 @@ void addSyscall(struct audit_rule_data* rule, const char* sc, int machine)
     audit_rule_syscall_data(rule, syscall_nr);
 }
 
-void AuditListener::activateRules(int machine)
+static void addField(struct audit_rule_data** rule, const std::string& pair)
+{
+    char field[PATH_MAX+16];
+    strncpy(field, pair.c_str(), sizeof(field));
+    field[sizeof(field)-1] = '\0';
+    if(0 > audit_rule_fieldpair_data(rule, field, AUDIT_FILTER_EXIT))
+        error(_("audit_rule_fieldpair_data failed: %s"), field);
+}
+
+/*
+ * Create a rule matching successful syscalls of architecture machine.
+ * Either syscalls accessing files or syscalls creating processes.
+ */
+static struct audit_rule_data* createRule(int machine, bool file_access)
 {
-    char field[128];
     struct audit_rule_data* rule = (struct audit_rule_data*) calloc(1, sizeof(audit_rule_data));
 
-    addSyscall(rule, "execve", machine);
-    addSyscall(rule, "open", machine);
-    addSyscall(rule, "openat", machine);
-    addSyscall(rule, "truncate", machine);
-    if(machine == MACH_X86)
-        addSyscall(rule, "truncate64", machine);
-    addSyscall(rule, "creat", machine);
-    addSyscall(rule, "mknod", machine);
-    addSyscall(rule, "fork", machine);
-    addSyscall(rule, "vfork", machine);
-    addSyscall(rule, "clone", machine);
+    if(file_access)
+    {
+        addSyscall(rule, "execve", machine);
+        addSyscall(rule, "open", machine);
+        addSyscall(rule, "openat", machine);
+        addSyscall(rule, "truncate", machine);
+        if(machine == MACH_X86)
+            addSyscall(rule, "truncate64", machine);
+        addSyscall(rule, "creat", machine);
+        addSyscall(rule, "mknod", machine);
+    }
+    else
+    {
+        addSyscall(rule, "fork", machine);
+        addSyscall(rule, "vfork", machine);
+        addSyscall(rule, "clone", machine);
+    }
 
 #if 0
     /*
@@ -182,33 +291,140 @@ void AuditListener::activateRules(int machine)
      *       Its creation does not get logged when filetype=file is enabled.
      *       Don't know why.
      */
-    strcpy(field, "filetype=file");
-    audit_rule_fieldpair_data(&rule, field, AUDIT_FILTER_EXIT);
+    addField(&rule, "filetype=file");
 #endif
 
     /*
      * Restrict to successful syscall events
      */
-    strcpy(field, "success=1");
-    if(0 > audit_rule_fieldpair_data(&rule, field, AUDIT_FILTER_EXIT))
-        error(_("audit_rule_fieldpair_data failed: %s"), field);
+    addField(&rule, "success=1");
 
     /*
      * Specify arch
      */
-    strcpy(field, "arch=");
-    strcat(field, audit_machine_to_name(machine));
-    if(0 > audit_rule_fieldpair_data(&rule, field, AUDIT_FILTER_EXIT))
-        error(_("audit_rule_fieldpair_data failed: %s"), field);
+    addField(&rule, std::string("arch=") + audit_machine_to_name(machine));
+
+    return rule;
+}
+
+/*
+ * Return audit rule field restricting events to files below path
+ */
+static std::string pathField(const std::string& path)
+{
+    struct stat st;
+    if(0 == stat(path.c_str(), &st) && S_ISDIR(st.st_mode))
+        return "dir=" + path;
+    return "path=" + path;
+}
+
+static void addDeviceFields(struct audit_rule_data** rule, dev_t dev)
+{
+    char field[64];
+    sprintf(field, "devmajor=%u", major(dev));
+    addField(rule, field);
+    sprintf(field, "devminor=%u", minor(dev));
+    addField(rule, field);
+}
+
+/*
+ * Pass rule to the kernel. On success the rule is remembered
+ * to be removed later. Otherwise it is freed.
+ */
+bool AuditListener::insertRule(struct audit_rule_data* rule, int action, bool prepend)
+{
+    int filter = AUDIT_FILTER_EXIT;
+    if(prepend)
+        filter |= AUDIT_FILTER_PREPEND;
+
+    if(0 >= audit_add_rule_data(audit_fd, rule, filter, action) && errno != EEXIST)
+    {
+        debug("Cannot insert rule: %s", strerror(errno));
+        free(rule);
+        return false;
+    }
+    rule_vec.push_back(std::pair<struct audit_rule_data*, int>(rule, action));
+    return true;
+}
+
+/*
+ * Insert all rules of one architecture.
+ *
+ * Watched paths and devices are passed to the kernel as rule fields.
+ * Fields of one rule are combined by AND. Therefore one rule per watched
+ * path and device combination is needed. Excluded paths and devices are
+ * turned into "never" rules in front of them. Events filtered in
+ * the kernel never cross the netlink socket. The filters in user space
+ * are still applied to everything received.
+ *
+ * Path patterns containing wildcards cannot be expressed as rule fields.
+ * If any watched path has a wildcard, paths are not filtered in the kernel.
+ */
+void AuditListener::activateRules(int machine)
+{
+    std::vector<std::string> paths;
+    if(!watch_wildcards)
+        paths = literal_watch_paths;
+    std::vector<dev_t> devices(watch_devices.begin(), watch_devices.end());
+
+    if(paths.size() * std::max(devices.size(), (size_t)1) > MAX_KERNEL_RULES)
+        devices.clear();
+    if(paths.size() > MAX_KERNEL_RULES)
+        paths.clear();
 
     /*
-     * Insert rule
+     * Process creation has no file to filter on
      */
-    if ( 0 >= audit_add_rule_data(audit_fd, rule, AUDIT_FILTER_EXIT, AUDIT_ALWAYS))
-        if(errno != EEXIST)
-            error(_("Cannot insert rules: %s"), strerror(errno));
+    if(!insertRule(createRule(machine, false), AUDIT_ALWAYS))
+        error(_("Cannot insert rules: %s"), strerror(errno));
+
+    BOOST_FOREACH(dev_t dev, exclude_devices)
+    {
+        struct audit_rule_data* rule = createRule(machine, true);
+        addDeviceFields(&rule, dev);
+        insertRule(rule, AUDIT_NEVER, true);
+    }
+
+    BOOST_FOREACH(std::string& path, literal_exclude_paths)
+    {
+        struct audit_rule_data* rule = createRule(machine, true);
+        addField(&rule, pathField(path));
+        insertRule(rule, AUDIT_NEVER, true);
+    }
 
-    rule_vec.push_back(rule);
+    size_t first_filter_rule = rule_vec.size();
+    bool filtered = !paths.empty() || !devices.empty();
+    for(size_t p = 0; filtered && p < std::max(paths.size(), (size_t)1); p++)
+        for(size_t d = 0; filtered && d < std::max(devices.size(), (size_t)1); d++)
+        {
+            struct audit_rule_data* rule = createRule(machine, true);
+            if(!paths.empty())
+                addField(&rule, pathField(paths[p]));
+            if(!devices.empty())
+                addDeviceFields(&rule, devices[d]);
+            filtered = insertRule(rule, AUDIT_ALWAYS);
+        }
+
+    if(!filtered)
+    {
+        /*
+         * Either nothing to filter or the kernel refused a filter rule,
+         * for instance because it is built without CONFIG_AUDIT_TREE.
+         * Fall back to a single rule covering all files.
+         */
+        while(rule_vec.size() > first_filter_rule)
+        {
+            audit_delete_rule_data(audit_fd, rule_vec.back().first,
+                                   AUDIT_FILTER_EXIT, rule_vec.back().second);
+            free(rule_vec.back().first);
+            rule_vec.pop_back();
+        }
+        if(!insertRule(createRule(machine, true), AUDIT_ALWAYS))
+            error(_("Cannot insert rules: %s"), strerror(errno));
+    }
+    else
+        info(_("%u audit rule(s) filter watched paths and devices in the kernel"),
+             (unsigned int)(rule_vec.size() - first_filter_rule));
 }
 
 /*
@@ -252,16 +468,17 @@ void AuditListener::removeAuditRules()
     if (audit_fd < 0)
         return;
 
-    BOOST_FOREACH(struct audit_rule_data* rule, rule_vec)
+    typedef std::pair<struct audit_rule_data*, int> rule_t;
+    BOOST_FOREACH(rule_t& rule, rule_vec)
     {
         if ( 0 > audit_delete_rule_data(audit_fd,
-                                        rule,
+                                        rule.first,
                                         AUDIT_FILTER_EXIT,
-                                        AUDIT_ALWAYS))
+                                        rule.second))
         {
             debug(_("Cannot remove rules: %s"), strerror(errno));
         }
-        free(rule);
+        free(rule.first);
     }
     rule_vec.clear();
 }
@@ -290,6 +507,13 @@ void AuditListener::closeAuditSocket()
 
     audit_close(audit_fd);
     audit_fd = -1;
+
+    // capture ends with the socket
+    if(capture)
+    {
+        fclose(capture);
+        capture = NULL;
+    }
 }
 
 /*
@@ -373,31 +597,37 @@ void AuditListener::waitForEvent(struct audit_reply* reply)
     struct timeval tv;
     int    retval;
 
-repeat:
-    do {
+    while(1)
+    {
         interruptionPoint();
 
-        tv.tv_sec = 60;
-        tv.tv_usec = 0;
-        FD_ZERO(&read_mask);
-        FD_SET(audit_fd, &read_mask);
+        // as long as messages are queued there is no need to select(2)
+        if(0 <= audit_get_reply(audit_fd, reply, GET_REPLY_NONBLOCKING, 0))
+            return;
+
+        // socket is drained: hand over pending events before going to sleep
+        flushEvents();
+
+        do {
+            interruptionPoint();
 
-        retval = select(audit_fd+1, &read_mask, NULL, NULL, &tv);
+            tv.tv_sec = 60;
+            tv.tv_usec = 0;
+            FD_ZERO(&read_mask);
+            FD_SET(audit_fd, &read_mask);
 
-        if(retval == 0)
-            /*
-             * Timeout received.
-             * This occurs when another process captured the audit socket session.
-             * Request status to find out the audit session owner.
-             */
-            audit_request_status(audit_fd);
+            retval = select(audit_fd+1, &read_mask, NULL, NULL, &tv);
 
-    } while (retval == -1 && errno == EINTR);
+            if(retval == 0)
+                /*
+                 * Timeout received.
+                 * This occurs when another process captured the audit socket session.
+                 * Request status to find out the audit session owner.
+                 */
+                audit_request_status(audit_fd);
 
-    retval = audit_get_reply(audit_fd, reply,
-                             GET_REPLY_NONBLOCKING, 0);
-    if(0 > retval)
-        goto repeat;
+        } while (retval == -1 && errno == EINTR);
+    }
 }
 
 /*
@@ -406,20 +636,20 @@ repeat:
  *
  * Return NULL on error
  */
-auparse_state_t* AuditListener::initAuParse(struct audit_reply* reply)
+auparse_state_t* AuditListener::initAuParse(int type, const char* data)
 {
     auparse_state_t *au;
     std::string parse_str;
 
     // prepend a message type header in order to use the auparse library functions
-    if(reply->type == AUDIT_PATH)
+    if(type == AUDIT_PATH)
         parse_str = "type=PATH msg=";
-    else if(reply->type == AUDIT_CWD)
+    else if(type == AUDIT_CWD)
         parse_str = "type=CWD msg=";
     else
         parse_str = "type=UNKNOWN msg=";
 
-    parse_str += reply->msg.data;
+    parse_str += data;
     parse_str += "\n";
 
     au = auparse_init(AUSOURCE_BUFFER, parse_str.c_str());
@@ -434,7 +664,7 @@ auparse_state_t* AuditListener::initAuParse(struct audit_reply* reply)
 /*
  * Parse Field cwd="current working directory"
  */
-void AuditListener::parseCwdEvent(auparse_state_t* au, boost::shared_ptr<AuditEvent> auditEvent)
+void AuditListener::parseCwdEvent(auparse_state_t* au, AuditEvent* auditEvent)
 {
     auditEvent->cwd = parsePathField(au, "cwd");
 }
@@ -443,16 +673,15 @@ void AuditListener::parseCwdEvent(auparse_state_t* au, boost::shared_ptr<AuditEv
  * Parse path="filename" field.
  * It is filename the syscall event refers to.
  */
-void AuditListener::parsePathEvent(auparse_state_t* au, boost::shared_ptr<AuditEvent> auditEvent)
+void AuditListener::parsePathEvent(auparse_state_t* au, AuditEvent* auditEvent)
 {
     struct stat st;
 
-    if(!auditEvent->path.empty())
+    if(!auditEvent->path.empty() || auditEvent->known)
         return;
 
-    auditEvent->path = realpath(parsePathField(au, "name"),
-                                 auditEvent->cwd);
-
+    //notice: you have to read audit message fields in the right order
+    std::string name = parsePathField(au, "name");
     auditEvent->ino  = atoll(parseField(au, "inode").c_str());
 
     std::string dev_buf = parseField(au, "dev");
@@ -463,8 +692,38 @@ void AuditListener::parsePathEvent(auparse_state_t* au, boost::shared_ptr<AuditE
         auditEvent->dev = makedev(strtol(dev_buf.substr(0, found).c_str(), NULL, 16),
                                   strtol(dev_buf.substr(found+1).c_str(),NULL, 16));
 
-    if(0 > stat(auditEvent->path.string().c_str(), &st)
-       || !S_ISREG(st.st_mode))
+    /*
+     * Most events are read accesses to files we have already seen.
+     * Skip resolving and validating the path of those files.
+     */
+    if((auditEvent->type == Open || auditEvent->type == OpenAt)
+       && auditEvent->readOnly
+       && FileDepot::instance()->contains(auditEvent->dev, auditEvent->ino))
+    {
+        auditEvent->known = true;
+        paths_known++;
+        return;
+    }
+    paths_resolved++;
+
+    char path_buf[PATH_MAX];
+    if(normalizePath(path_buf, sizeof(path_buf), name.c_str(), auditEvent->cwd.string().c_str()))
+        auditEvent->path = path_buf;
+    else
+        auditEvent->path = realpath(name, auditEvent->cwd);
+
+    /*
+     * lstat(2) tells whether the path is a symbolic link. Only links
+     * have to be followed. Regular files are passed on as they are.
+     */
+    int ret = lstat(auditEvent->path.string().c_str(), &st);
+    if(0 == ret && S_ISLNK(st.st_mode))
+    {
+        auditEvent->symlink = true;
+        ret = stat(auditEvent->path.string().c_str(), &st);
+    }
+
+    if(0 > ret || !S_ISREG(st.st_mode))
     {
         auditEvent->path.clear();
         auditEvent->ino = auditEvent->dev = 0;
@@ -488,12 +747,15 @@ void AuditListener::parsePathEvent(auparse_state_t* au, boost::shared_ptr<AuditE
 /*
  * Main entry point of parsing syscall audit event
  */
-void AuditListener::parseSyscallEvent(auparse_state_t* au, boost::shared_ptr<AuditEvent> auditEvent)
+void AuditListener::parseSyscallEvent(auparse_state_t* au, AuditEvent* auditEvent)
 {
     __u64 arch;
     int machine;
     int syscall;
 
+    auditEvent->time = (unsigned long long)auparse_get_time(au) * 1000
+                       + auparse_get_milli(au);
+
     //notice: you have to read audit message fields in the right order
 
     arch = strtoll(parseField(au, "arch").c_str(), NULL, 16);
@@ -523,7 +785,7 @@ void AuditListener::parseSyscallEvent(auparse_state_t* au, boost::shared_ptr<Aud
     else if(0 == strcmp(sc_name, "execve"))
         auditEvent->type = Execve;
     else if(0 == strcmp(sc_name, "openat"))
-        auditEvent->type = Open;
+        auditEvent->type = OpenAt;
     else if(0 == strcmp(sc_name, "truncate"))
         auditEvent->type = Truncate;
     else if(0 == strcmp(sc_name, "creat"))
@@ -551,7 +813,9 @@ void AuditListener::parseSyscallEvent(auparse_state_t* au, boost::shared_ptr<Aud
 
     if(auditEvent->type == Open || auditEvent->type == OpenAt)
     {
-        int flags = strtol(parseField(au, "a1").c_str(), NULL, 16);
+        // openat(2) takes the directory fd first
+        const char* arg = auditEvent->type == OpenAt ? "a2" : "a1";
+        int flags = strtol(parseField(au, arg).c_str(), NULL, 16);
 
         if(!(  flags & O_WRONLY
             || flags & O_RDWR
@@ -566,52 +830,18 @@ void AuditListener::parseSyscallEvent(auparse_state_t* au, boost::shared_ptr<Aud
 }
 
 /*
- * test whether path does match regex
- * return true either on exactly match
- *                 or regex represents a subdirectory of path
- *        otherwise false
- */
-bool doesRegexMatchPath(fs::path& p, boost::regex& filter)
-{
-    boost::match_results<std::string::const_iterator> what;
-    if( boost::regex_search(p.string(), what, filter,
-                            boost::match_default | boost::match_continuous  ))
-    {
-        //partial match beginning at first character found
-        size_t match_end =  distance(what[0].first, what[0].second);
-
-        //test for exact match
-        if(match_end >= p.string().size())
-            return true;
-        //test whether partial path match points to a directory
-        if('/' == p.string().at(match_end))
-            return true;
-
-    }
-    return false;
-}
-
-/*
- * Test whether file is excluded by an path regex
+ * Test whether file is excluded by an path filter
  * Return true path is ignored
  *        otherwise false
  */
 bool AuditListener::ignorePath(fs::path& p)
 {
-    if(!watch_paths.empty())
-    {
-        BOOST_FOREACH(boost::regex filter, watch_paths)
-            if(doesRegexMatchPath(p,filter))
-                goto path_valid;
+    const std::string& path = p.string();
 
+    if(!watch_paths.empty() && !watch_paths.match(path))
         return true;
-    }
-path_valid:
-    BOOST_FOREACH(boost::regex filter, exclude_paths)
-        if(doesRegexMatchPath(p, filter))
-            return true;
 
-    return false;
+    return exclude_paths.match(path);
 }
 
 
@@ -629,26 +859,25 @@ bool AuditListener::ignoreDevice(dev_t dev)
 
     if(ext4_only && ext4_devices_cache.end() == ext4_devices_cache.find(dev))
     {
-        try {
-            Device device(dev);
-            if(device.getFileSystem() == "ext4")
-                ext4_devices_cache.insert(dev);
-            else
+        if(MountTable::instance()->isExt4(dev))
+            ext4_devices_cache.insert(dev);
+        else
+        {
+            MountEntry mnt;
+            if(!MountTable::instance()->find(dev, mnt))
             {
-                std::string dev_name = device.getDevicePath();
-                if(dev_name.at(0) != '/') //it's virtual fs: display mount point instead of cunfusing device name.
-                    dev_name = device.getMountPoint().string();
-                info(_("%s is not an ext4 filesystem."), dev_name.c_str());
-                info(_("Filesystem of %s is %s"), dev_name.c_str(), device.getFileSystem().c_str());
-                exclude_devices.insert(dev);
-                return true;
+                // Damn! Keep going. We can drop this file later.
+                info(_("Cannot find mount point of device %u:%u"), major(dev), minor(dev));
+                return false;
             }
-        }
-        catch(std::exception& e)
-        {
-            // Damn! Keep going. We can drop this file later.
-            info("%s", e.what());
-            return false;
+
+            std::string dev_name = mnt.source;
+            if(dev_name.empty() || dev_name.at(0) != '/') //it's virtual fs: display mount point instead of cunfusing device name.
+                dev_name = mnt.mount_point.string();
+            info(_("%s is not an ext4 filesystem."), dev_name.c_str());
+            info(_("Filesystem of %s is %s"), dev_name.c_str(), mnt.fs_type.c_str());
+            exclude_devices.insert(dev);
+            return true;
         }
     }
     return false;
@@ -657,139 +886,320 @@ bool AuditListener::ignoreDevice(dev_t dev)
 /*
  * Check if filesystem type is ignored
  */
-bool AuditListener::checkFileSystemType(fs::path& p)
+bool AuditListener::checkFileSystemType(dev_t dev)
 {
-    struct statfs fs;
-    if(0 > statfs(p.string().c_str(), &fs))
-        return false;
+    if(watch_fs_types.empty())
+        return true;
 
-    if(!watch_fs_types.empty())
-    {
-        if(watch_fs_types.end() == watch_fs_types.find(fs.f_type))
-            return false;
-    }
-    return true;
+    return watch_fs_types.end() != watch_fs_types.find(MountTable::instance()->getFsMagic(dev));
 }
 
 /*
- * Infinite loop of listening to the Linux audit system
+ * Parse one audit record. Records of the same event share a serial number.
+ * The event is passed to the catcher when its EOE record arrives.
  */
-void AuditListener::exec()
+void AuditListener::processRecord(int type, const char* data)
 {
-    struct audit_reply reply;
     auparse_state_t *au;
-    typedef std::map<__u32, boost::shared_ptr<AuditEvent> > msgdb_t;
-    msgdb_t msgdb;
     msgdb_t::iterator msgdb_it;
-    boost::shared_ptr<AuditEvent> auditEvent;
+    AuditEvent* auditEvent;
     __u32 msgid;
 
-    while(1)
-    {
-        waitForEvent(&reply);
+    au = initAuParse(type, data);
 
-        reply.msg.data[reply.len] = '\0';
-        au = initAuParse(&reply);
+    debug("%d: %s", type, data);
 
-        debug("%d: %*s", reply.type, reply.len, reply.msg.data);
-
-        msgid = auparse_get_serial(au);
-        msgdb_it = msgdb.find(msgid);
-        if(msgdb_it != msgdb.end())
-            auditEvent = msgdb_it->second;
-        else
-        {
-            auditEvent =  boost::shared_ptr<AuditEvent>(new AuditEvent);
-            msgdb.insert(std::pair<__u32, boost::shared_ptr<AuditEvent> >(msgid, auditEvent));
-        }
+    msgid = auparse_get_serial(au);
+    msgdb_it = msgdb.find(msgid);
+    if(msgdb_it == msgdb.end())
+        msgdb_it = msgdb.insert(std::pair<__u32, AuditEvent*>(msgid, allocEvent())).first;
+    auditEvent = msgdb_it->second;
 
-        switch(reply.type)
-        {
-            // event is syscall event
-            case AUDIT_SYSCALL:
-                parseSyscallEvent(au,auditEvent);
+    switch(type)
+    {
+        // event is syscall event
+        case AUDIT_SYSCALL:
+            parseSyscallEvent(au,auditEvent);
+            break;
+
+        // change working directory
+        case AUDIT_CWD:
+            if(auditEvent->type == Unknown
+               || !auditEvent->successful)
                 break;
 
-            // change working directory
-            case AUDIT_CWD:
-                if(auditEvent->type == Unknown
-                   || !auditEvent->successful)
-                    break;
+            parseCwdEvent(au, auditEvent);
+            break;
 
-                parseCwdEvent(au, auditEvent);
+        // event refers to file
+        case AUDIT_PATH:
+            if(auditEvent->type == Unknown
+               || !auditEvent->successful)
                 break;
 
-            // event refers to file
-            case AUDIT_PATH:
-                if(auditEvent->type == Unknown
-                   || !auditEvent->successful)
-                    break;
+            parsePathEvent(au,auditEvent);
+            break;
+
+        // end of multi record event
+        case AUDIT_EOE:
+            if(auditEvent->type != Unknown
+               && auditEvent->successful
+               && ( auditEvent->type == Fork
+                    || auditEvent->known
+                    || ( !auditEvent->path.empty()
+                         && !ignorePath(auditEvent->path)
+                         && !ignoreDevice(auditEvent->dev)
+                         && checkFileSystemType(auditEvent->dev)
+                        )
+                  ))
+            {
+                debug(_("Parsed Event: %d %s"), auditEvent->type, auditEvent->path.string().c_str());
+                emitEvent(auditEvent);
+            }
+            else
+                releaseEvent(auditEvent);
 
-                parsePathEvent(au,auditEvent);
+            msgdb.erase(msgdb_it);
+            break;
+        case AUDIT_CONFIG_CHANGE:
+            // changes of a replayed system do not affect us
+            if(replaying)
                 break;
 
-            // end of multi record event
-            case AUDIT_EOE:
-                if(auditEvent->type != Unknown
-                   && auditEvent->successful
-                   && ( auditEvent->type == Fork
-                        || ( !auditEvent->path.empty()
-                             && !ignorePath(auditEvent->path)
-                             && !ignoreDevice(auditEvent->dev)
-                             && checkFileSystemType(auditEvent->path)
-                            )
-                      ))
-                {
-                    debug(_("Parsed Event: %d %s"), auditEvent->type, auditEvent->path.string().c_str());
-                    eventParsed(auditEvent);
-                }
-
-                msgdb.erase(msgdb_it);
+            auparse_first_field(au);
+            if(0 == auparse_next_field(au))
                 break;
-            case AUDIT_CONFIG_CHANGE:
-                auparse_first_field(au);
-                if(0 == auparse_next_field(au))
-                    break;
 
-                if(0 == strcmp("audit_pid", auparse_get_field_name(au)))
-                {
-                    /*
-                     * There is no guarantee that we get the message that someone else has
-                     * captured the audit socket session. Therefore periodically the status
-                     * of the netlink socket is checked as well.
-                     */
-                    pid_t audit_pid = strtol(auparse_get_field_str(au), NULL, 10);
-                    checkSocketCaptured(audit_pid);
-                }
-                else
+            if(0 == strcmp("audit_pid", auparse_get_field_name(au)))
+            {
+                /*
+                 * There is no guarantee that we get the message that someone else has
+                 * captured the audit socket session. Therefore periodically the status
+                 * of the netlink socket is checked as well.
+                 */
+                pid_t audit_pid = strtol(auparse_get_field_str(au), NULL, 10);
+                checkSocketCaptured(audit_pid);
+            }
+            else
+            {
+                while(auparse_next_field(au))
                 {
-                    while(auparse_next_field(au))
+                    if(0 == strcmp("op", auparse_get_field_name(au)))
                     {
-                        if(0 == strcmp("op", auparse_get_field_name(au)))
+                        // The message does not contain what rules has been changed
+                        // Test weather op field is equal to "remove rule"
+                        // auparse cannot parse fields containing spaces
+                        if(parseField(au, "op") == "\"remove")
                         {
-                            // The message does not contain what rules has been changed
-                            // Test weather op field is equal to "remove rule"
-                            // auparse cannot parse fields containing spaces
-                            if(parseField(au, "op") == "\"remove")
-                            {
-                                warn(_("Audit configuration has changed. Reinserting audit rules."));
-                                insertAuditRules();
-                            }
-                            break;
+                            warn(_("Audit configuration has changed. Reinserting audit rules."));
+                            insertAuditRules();
                         }
+                        break;
                     }
                 }
-                break;
-            // get netlink status
-            case AUDIT_GET:
-                checkSocketCaptured(reply.status->pid);
-                break;
-            default:
-                break;
+            }
+            break;
+        default:
+            break;
+    }
+
+    // single record messages are not terminated by EOE
+    if(type == AUDIT_CONFIG_CHANGE && auditEvent->type == Unknown)
+    {
+        releaseEvent(auditEvent);
+        msgdb.erase(msgdb_it);
+    }
+    auparse_destroy(au);
+}
+
+/*
+ * Infinite loop of listening to the Linux audit system
+ */
+void AuditListener::exec()
+{
+    struct audit_reply reply;
+
+    while(1)
+    {
+        waitForEvent(&reply);
+        records_received++;
+
+        // get netlink status
+        if(reply.type == AUDIT_GET)
+        {
+            checkSocketCaptured(reply.status->pid);
+            continue;
+        }
+
+        if(capture)
+            writeCaptureRecord(reply.type, reply.msg.data, reply.len);
+
+        reply.msg.data[reply.len] = '\0';
+        processRecord(reply.type, reply.msg.data);
+    }
+}
+
+/*
+ * Raw capture file of netlink records written by --record.
+ *
+ *   header: CAPTURE_MAGIC, __u32 version
+ *   record: __u32 type, __u32 length, data without terminating null byte
+ *
+ * Integers are stored in host byte order.
+ */
+#define CAPTURE_MAGIC "E4RATCAP"
+#define CAPTURE_VERSION 1
+
+bool AuditListener::recordTo(const char* path)
+{
+    capture = fopen(path, "w");
+    if(NULL == capture)
+    {
+        error(_("Cannot open capture file %s: %s"), path, strerror(errno));
+        return false;
+    }
+    __u32 version = CAPTURE_VERSION;
+    fwrite(CAPTURE_MAGIC, 1, sizeof(CAPTURE_MAGIC) - 1, capture);
+    fwrite(&version, sizeof(version), 1, capture);
+    return true;
+}
+
+void AuditListener::writeCaptureRecord(int type, const char* data, size_t len)
+{
+    __u32 header[2] = { (__u32)type, (__u32)len };
+    fwrite(header, sizeof(header), 1, capture);
+    fwrite(data, 1, len, capture);
+}
+
+/*
+ * Feed records of a capture file into the parser.
+ * Return false if the file is not a valid capture.
+ */
+bool AuditListener::replayCapture(FILE* file)
+{
+    char magic[sizeof(CAPTURE_MAGIC) - 1];
+    __u32 version;
+    __u32 header[2];
+    std::vector<char> data(MAX_AUDIT_MESSAGE_LENGTH + 1);
+
+    if(1 != fread(magic, sizeof(magic), 1, file)
+       || 0 != memcmp(magic, CAPTURE_MAGIC, sizeof(magic))
+       || 1 != fread(&version, sizeof(version), 1, file)
+       || version != CAPTURE_VERSION)
+        return false;
+
+    while(1 == fread(header, sizeof(header), 1, file))
+    {
+        interruptionPoint();
+
+        if(header[1] > MAX_AUDIT_MESSAGE_LENGTH
+           || header[1] != fread(&data[0], 1, header[1], file))
+        {
+            error(_("Capture file is truncated"));
+            break;
         }
-        auparse_reset(au);
+        data[header[1]] = '\0';
+        records_received++;
+        processRecord(header[0], &data[0]);
+    }
+    return true;
+}
+
+/*
+ * Feed an audit log written by auditd(8) into the parser.
+ * auditd does not log EOE records. auparse groups records to events,
+ * the terminating EOE record is generated for each event.
+ */
+bool AuditListener::replayLog(const char* path)
+{
+    auparse_state_t* au = auparse_init(AUSOURCE_FILE, path);
+    if(NULL == au)
+    {
+        error(_("Cannot open audit log %s: %s"), path, strerror(errno));
+        return false;
+    }
+
+    try {
+        while(0 < auparse_next_event(au))
+        {
+            interruptionPoint();
+
+            if(0 >= auparse_first_record(au))
+                continue;
+            do {
+                int type = auparse_get_type(au);
+                const char* text = auparse_get_record_text(au);
+                const char* msg = text ? strstr(text, "msg=") : NULL;
+                if(NULL == msg || type == AUDIT_EOE)
+                    continue;
+
+                // enriched logs append interpreted fields after a 0x1d separator
+                std::string data(msg + 4, strcspn(msg + 4, "\x1d\n"));
+                records_received++;
+                processRecord(type, data.c_str());
+            } while(0 < auparse_next_record(au));
+
+            const au_event_t* e = auparse_get_timestamp(au);
+            if(e)
+            {
+                char eoe[64];
+                sprintf(eoe, "audit(%lu.%03u:%lu): ", (unsigned long)e->sec, e->milli, e->serial);
+                processRecord(AUDIT_EOE, eoe);
+            }
+        }
+    }
+    catch(...)
+    {
+        auparse_destroy(au);
+        throw;
     }
     auparse_destroy(au);
+    return true;
+}
+
+/*
+ * Run the event pipeline on recorded input instead of the audit socket.
+ * Neither root privileges nor audit rules are needed.
+ */
+bool AuditListener::replay(const char* path)
+{
+    struct timeval start, end;
+    bool ret = true;
+
+    FILE* file = fopen(path, "r");
+    if(NULL == file)
+    {
+        error(_("Cannot open %s: %s"), path, strerror(errno));
+        return false;
+    }
+
+    replaying = true;
+    gettimeofday(&start, NULL);
+    try {
+        if(!replayCapture(file))
+            ret = replayLog(path);
+    }
+    catch(UserInterrupt&)
+    {}
+    fclose(file);
+    flushEvents();
+    gettimeofday(&end, NULL);
+    replaying = false;
+
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+    notice(_("%lu audit records replayed in %.2f seconds (%.0f records/s)"),
+           records_received, secs, secs > 0 ? records_received / secs : 0);
+    printStatistics();
+
+    return ret;
+}
+
+void AuditListener::printStatistics()
+{
+    unsigned long total = paths_known + paths_resolved;
+    if(total)
+        notice(_("%lu/%lu file events (%.1f%%) skipped by (dev, ino) lookup: at least %lu stat()/readlink() calls avoided"),
+               paths_known, total, 100.0 * paths_known / total, 2 * paths_known);
 }
 
 
@@ -825,8 +1235,12 @@ bool Listener::start()
     {
         return false;
     }
+    flushEvents();
     removeAuditRules();
     closeAuditSocket();
 
+    notice(_("%lu audit records received"), records_received);
+    printStatistics();
+
     return true;
 }
@@ -21,9 +21,13 @@
 #define LISTENER_HH
 
 #include "common.hh"
-#include "signals.hh"
+#include "pathfilter.hh"
 
 #include <set>
+#include <map>
+#include <cstdio>
+#include <deque>
+#include <vector>
 #include <sys/stat.h>
 #include <libaudit.h>
 
@@ -41,12 +45,16 @@ enum AuditEventType
     Fork,
 };
 
-// AuditEvent is an structure emitted by eventParsed() signal.
+class EventCatcher;
+
+// AuditEvent is an structure passed to the EventCatcher.
 class AuditEvent
 {
     public:
         AuditEvent();
+        void reset();
         AuditEventType type;
+        unsigned long long time;    // milliseconds since the epoch
         pid_t pid;
         pid_t ppid;
         std::string comm;
@@ -58,6 +66,8 @@ class AuditEvent
         pid_t  exit;
         bool readOnly;
         bool successful;
+        bool known;     // file has been seen before. path is not resolved
+        bool symlink;   // path refers to a symbolic link
 };
 
 
@@ -65,21 +75,25 @@ class AuditEvent
  * Linux Audit Listener Class
  * It connects directly to the Linux audit socket.
  *
- * Signal eventParsed() is emitted on every successfully parsed event.
+ * Successfully parsed events are collected in batches and handed over
+ * to the EventCatcher. A batch is passed on when it is full or before the
+ * listener would block waiting for the next message. Events are owned by
+ * the listener and recycled after the catcher has returned.
  */
 class AuditListener : public Interruptible
 {
-        SIGNAL(eventParsed, boost::shared_ptr<AuditEvent>);
-
     public:
         AuditListener();
         ~AuditListener();
+        void setEventCatcher(EventCatcher*);
         void excludePath(std::string);
         void watchPath(std::string);
         void watchFileSystemType(long);
         void excludeDevice(std::string);
         void watchDevice(std::string);
         void watchExt4Only(bool = true);
+        bool recordTo(const char* path);
+        bool replay(const char* path);
     protected:
         virtual void exec();
         void insertAuditRules();
@@ -90,26 +104,51 @@ class AuditListener : public Interruptible
         std::string parsePathField(auparse_state_t*, const char*);
     private:
         void activateRules(int machine);
+        bool insertRule(struct audit_rule_data*, int action, bool prepend = false);
         void waitForEvent(struct audit_reply* reply);
-        auparse_state_t* initAuParse(struct audit_reply*);
-        void parseCwdEvent(auparse_state_t*, boost::shared_ptr<AuditEvent>);
-        void parsePathEvent(auparse_state_t*, boost::shared_ptr<AuditEvent>);
-        void parseSyscallEvent(auparse_state_t*, boost::shared_ptr<AuditEvent>);
+        auparse_state_t* initAuParse(int type, const char* data);
+        void processRecord(int type, const char* data);
+        void writeCaptureRecord(int type, const char* data, size_t len);
+        bool replayCapture(FILE*);
+        bool replayLog(const char* path);
+        void parseCwdEvent(auparse_state_t*, AuditEvent*);
+        void parsePathEvent(auparse_state_t*, AuditEvent*);
+        void parseSyscallEvent(auparse_state_t*, AuditEvent*);
+        AuditEvent* allocEvent();
+        void releaseEvent(AuditEvent*);
+        void emitEvent(AuditEvent*);
         bool ignorePath(fs::path&);
         bool ignoreDevice(dev_t dev);
-        bool checkFileSystemType(fs::path& p);
+        bool checkFileSystemType(dev_t dev);
 
-        std::vector<struct audit_rule_data*> rule_vec;
+        std::vector<std::pair<struct audit_rule_data*, int> > rule_vec;
         int auditFlags;
         int auditAction;                
         int audit_fd;
-        std::vector<boost::regex> exclude_paths;
-        std::vector<boost::regex> watch_paths;
+        PathFilter exclude_paths;
+        PathFilter watch_paths;
+        std::vector<std::string> literal_watch_paths;
+        std::vector<std::string> literal_exclude_paths;
+        bool watch_wildcards;
         std::set<dev_t> watch_devices;
         std::set<dev_t> exclude_devices;
         std::set<long>  watch_fs_types;
         bool ext4_only;
         std::set<dev_t>ext4_devices_cache;
+        EventCatcher* catcher;
+        std::deque<AuditEvent> event_pool;
+        std::vector<AuditEvent*> free_events;
+        std::vector<AuditEvent*> batch;
+        typedef std::map<__u32, AuditEvent*> msgdb_t;
+        msgdb_t msgdb;                  // events waiting for their EOE record
+        bool replaying;
+        FILE* capture;
+    protected:
+        void flushEvents();
+        void printStatistics();
+        unsigned long paths_resolved;
+        unsigned long paths_known;
+        unsigned long records_received;
 };
 
 /*
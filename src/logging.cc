@@ -68,6 +68,9 @@ Logging::Logging()
         displayToolName = false;
 
     target = "/dev/kmsg";
+
+    pthread_mutex_init(&mutex, NULL);
+    pthread_key_create(&tag, NULL);
 }
 
 Logging::~Logging()
@@ -84,6 +87,9 @@ Logging::~Logging()
 
     if(queue.size())
         fprintf(stderr, _("Discard %zu unwritten log message(s).\n"), queue.size());
+
+    pthread_key_delete(tag);
+    pthread_mutex_destroy(&mutex);
 }
 
 void Logging::setLogLevel(int l)
@@ -112,8 +118,14 @@ void Logging::write(LogLevel level, const char* format, ...)
     va_list args;
     va_start(args, format);
 
-    vsnprintf(msg, MSG_SIZE, format, args);
-    
+    const char* thread_tag = (const char*)pthread_getspecific(tag);
+    int len = 0;
+    if(thread_tag)
+        len = snprintf(msg, MSG_SIZE, "%s: ", thread_tag);
+    vsnprintf(msg + len, MSG_SIZE - len, format, args);
+
+    pthread_mutex_lock(&mutex);
+
     if((level & verboselevel))
     {
         FILE* out;
@@ -142,6 +154,7 @@ void Logging::write(LogLevel level, const char* format, ...)
     }
     
 out:
+    pthread_mutex_unlock(&mutex);
     va_end(args);    
 }
 
@@ -149,3 +162,17 @@ void Logging::redirectStdout2Stderr(bool s)
 {
     redirectOut2Err = s;
 }
+
+/*
+ * Tag all messages of the calling thread. The string has to outlive the
+ * thread or the next call. NULL removes the tag.
+ */
+void Logging::setThreadTag(const char* t)
+{
+    pthread_setspecific(tag, t);
+}
+
+const char* Logging::getThreadTag()
+{
+    return (const char*)pthread_getspecific(tag);
+}
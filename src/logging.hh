@@ -36,6 +36,9 @@
  * 
  * Error and Warning messages will be send to stderr,
  * others to stdout.
+ *
+ * Logging may be used by several threads. A thread can set a tag which
+ * is prepended to all of its messages.
  */
 
 #ifndef LOGGING_HH
@@ -45,6 +48,7 @@
 
 #include <ostream>
 #include <deque>
+#include <pthread.h>
 
 enum LogLevel
 {
@@ -74,6 +78,8 @@ class Logging
         void errStream(FILE*);
         void outStream(FILE*);
         void redirectStdout2Stderr(bool);
+        void setThreadTag(const char*);
+        const char* getThreadTag();
     private:
         void dumpQueue();
         bool targetAvailable();
@@ -88,6 +94,8 @@ class Logging
          */
         std::string target;
         std::deque<QueuedEvent> queue;
+        pthread_mutex_t mutex;
+        pthread_key_t tag;
 };
 
 extern Logging logger;
@@ -0,0 +1,299 @@
+/*
+ * mounttable.cc - Registry of mounted filesystems
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mounttable.hh"
+#include "logging.hh"
+
+#include <set>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <mntent.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <sys/sysmacros.h>
+
+#define MOUNTINFO "/proc/self/mountinfo"
+
+DEFINE_SINGLETON(MountTable);
+
+MountTable::MountTable()
+{
+    fd = -1;
+    pthread_mutex_init(&lock, NULL);
+    load();
+}
+
+MountTable::~MountTable()
+{
+    if(fd >= 0)
+        close(fd);
+    pthread_mutex_destroy(&lock);
+}
+
+/*
+ * Replace octal escape sequences like \040 of mountinfo fields
+ */
+static std::string unescapeField(const char* s, size_t len)
+{
+    std::string result;
+    result.reserve(len);
+
+    for(size_t i = 0; i < len; i++)
+    {
+        if(s[i] == '\\' && i + 3 < len
+           && s[i+1] >= '0' && s[i+1] <= '7'
+           && s[i+2] >= '0' && s[i+2] <= '7'
+           && s[i+3] >= '0' && s[i+3] <= '7')
+        {
+            result += (char)((s[i+1]-'0') << 6 | (s[i+2]-'0') << 3 | (s[i+3]-'0'));
+            i += 3;
+        }
+        else
+            result += s[i];
+    }
+    return result;
+}
+
+/*
+ * Parse /proc/self/mountinfo. Format of a line:
+ *   36 35 98:0 /mnt1 /mnt/parent rw,noatime master:1 - ext3 /dev/root rw
+ *   (1)(2)(3)   (4)   (5)          (6)       (7)   (8)(9)  (10)     (11)
+ *
+ * The device number (3) is taken directly. No stat(2) call is needed.
+ * If a device is mounted several times, prefer the mount of its root (4).
+ */
+void MountTable::loadMountInfo()
+{
+    std::string buf;
+    char chunk[4096];
+    ssize_t len;
+
+    if(0 > lseek(fd, 0, SEEK_SET))
+        return;
+    while(0 < (len = read(fd, chunk, sizeof(chunk))))
+        buf.append(chunk, len);
+
+    std::set<dev_t> root_mounts;
+
+    const char* line = buf.c_str();
+    while(*line)
+    {
+        const char* eol = strchr(line, '\n');
+        if(eol == NULL)
+            eol = line + strlen(line);
+
+        const char* field[11];
+        size_t field_len[11];
+        int n = 0;
+        bool separator_seen = false;
+        const char* p = line;
+
+        while(p < eol && n < 11)
+        {
+            while(p < eol && *p == ' ')
+                p++;
+            const char* start = p;
+            while(p < eol && *p != ' ')
+                p++;
+            if(p == start)
+                break;
+
+            // skip optional fields (7) until separator (8)
+            if(n == 6 && !separator_seen)
+            {
+                if(p - start == 1 && *start == '-')
+                    separator_seen = true;
+                else
+                    continue;
+            }
+            field[n] = start;
+            field_len[n] = p - start;
+            n++;
+        }
+
+        unsigned int maj, min;
+        if(n >= 10 && 2 == sscanf(field[2], "%u:%u", &maj, &min))
+        {
+            MountEntry entry;
+            entry.dev = makedev(maj, min);
+            entry.mount_point = unescapeField(field[4], field_len[4]);
+            entry.fs_type = std::string(field[7], field_len[7]);
+            entry.source = unescapeField(field[8], field_len[8]);
+
+            bool is_root = field_len[3] == 1 && *field[3] == '/';
+            std::pair<mounts_t::iterator, bool> ret
+                = mounts.insert(mounts_t::value_type(entry.dev, entry));
+            if(!ret.second && is_root && !root_mounts.count(entry.dev))
+                ret.first->second = entry;
+            if(is_root)
+                root_mounts.insert(entry.dev);
+        }
+
+        line = *eol ? eol + 1 : eol;
+    }
+}
+
+/*
+ * Parse mtab-like files. Since they do not contain device numbers
+ * each mount point has to be stat'ed.
+ */
+void MountTable::loadMtab(const char* path)
+{
+    FILE* fmtab;
+    struct mntent* mnt;
+    struct stat st;
+
+    fmtab = setmntent(path, "r");
+    if(fmtab == NULL)
+        return;
+
+    while((mnt = getmntent(fmtab)) != NULL)
+    {
+        if(0 == strcmp(mnt->mnt_type, "rootfs"))
+            continue;
+        if(stat(mnt->mnt_dir, &st))
+            continue;
+
+        MountEntry entry;
+        entry.dev = st.st_dev;
+        entry.mount_point = mnt->mnt_dir;
+        entry.fs_type = mnt->mnt_type;
+        entry.source = mnt->mnt_fsname;
+
+        std::pair<mounts_t::iterator, bool> ret
+            = mounts.insert(mounts_t::value_type(entry.dev, entry));
+        // maybe /proc/mounts is not up to date cause user forget to setup
+        // rootfstype=ext4 to kernel parameters.
+        if(!ret.second && ret.first->second.fs_type == "ext2")
+            ret.first->second.fs_type = entry.fs_type;
+    }
+
+    endmntent(fmtab);
+}
+
+void MountTable::load()
+{
+    mounts.clear();
+
+    if(fd < 0)
+        fd = open(MOUNTINFO, O_RDONLY | O_CLOEXEC);
+
+    if(fd >= 0)
+    {
+        loadMountInfo();
+
+        bool has_ext2 = false;
+        for(mounts_t::iterator it = mounts.begin(); it != mounts.end(); ++it)
+            if(it->second.fs_type == "ext2")
+                has_ext2 = true;
+        if(has_ext2 && 0 == access(MOUNTED, R_OK))
+            loadMtab(MOUNTED);
+    }
+    else if(0 == access(MOUNTED, R_OK))
+        loadMtab(MOUNTED);
+    else
+        warn(_("Neither %s nor %s is readable."), MOUNTINFO, MOUNTED);
+}
+
+/*
+ * The kernel flags mountinfo with POLLPRI | POLLERR whenever the
+ * mount table changed since it was last read.
+ */
+bool MountTable::hasChanged()
+{
+    if(fd < 0)
+        return true;
+
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLPRI;
+    pfd.revents = 0;
+
+    if(0 >= poll(&pfd, 1, 0))
+        return false;
+
+    return pfd.revents & (POLLPRI | POLLERR);
+}
+
+/*
+ * Find entry of device. On cache miss check whether a filesystem
+ * has been mounted in the meantime.
+ * Lock has to be held.
+ */
+MountEntry* MountTable::lookup(dev_t dev)
+{
+    mounts_t::iterator it = mounts.find(dev);
+    if(it != mounts.end())
+        return &it->second;
+
+    if(!hasChanged())
+        return NULL;
+
+    load();
+    it = mounts.find(dev);
+    if(it != mounts.end())
+        return &it->second;
+    return NULL;
+}
+
+bool MountTable::find(dev_t dev, MountEntry& entry)
+{
+    pthread_mutex_lock(&lock);
+    MountEntry* e = lookup(dev);
+    if(e)
+        entry = *e;
+    pthread_mutex_unlock(&lock);
+
+    return e != NULL;
+}
+
+bool MountTable::isExt4(dev_t dev)
+{
+    pthread_mutex_lock(&lock);
+    MountEntry* e = lookup(dev);
+    bool ret = e && e->fs_type == "ext4";
+    pthread_mutex_unlock(&lock);
+
+    return ret;
+}
+
+/*
+ * Return filesystem magic number. See statfs(2)
+ * Return 0 on error
+ */
+long MountTable::getFsMagic(dev_t dev)
+{
+    long magic = 0;
+
+    pthread_mutex_lock(&lock);
+    MountEntry* e = lookup(dev);
+    if(e)
+    {
+        if(e->fs_magic == 0)
+        {
+            struct statfs sfs;
+            if(0 == statfs(e->mount_point.string().c_str(), &sfs))
+                e->fs_magic = sfs.f_type;
+        }
+        magic = e->fs_magic;
+    }
+    pthread_mutex_unlock(&lock);
+
+    return magic;
+}
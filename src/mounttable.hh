@@ -0,0 +1,72 @@
+/*
+ * mounttable.hh - Registry of mounted filesystems
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MOUNT_TABLE_HH
+#define MOUNT_TABLE_HH
+
+#include "common.hh"
+#include "singleton.hh"
+
+#include <string>
+#include <sys/types.h>
+#include <boost/unordered_map.hpp>
+
+/*
+ * One mounted filesystem as listed in /proc/self/mountinfo
+ */
+struct MountEntry
+{
+        MountEntry() : dev(0), fs_magic(0) {}
+        dev_t dev;
+        fs::path mount_point;
+        std::string fs_type;    // name of the filesystem. Example: "ext4"
+        std::string source;     // mount source. Example: "/dev/sda1"
+        long fs_magic;          // statfs(2) f_type. 0 until first requested
+};
+
+/*
+ * MountTable maps device numbers to their mounted filesystem.
+ *
+ * The table is loaded once from /proc/self/mountinfo. The file descriptor
+ * is kept open and polled for mount changes. The table is only reloaded if
+ * the kernel signals a change. Therefore lookups are answered without
+ * any system call as long as the mount table does not change.
+ *
+ * If /proc is not mounted yet, /etc/mtab is parsed instead.
+ */
+class MountTable
+{
+        DECLARE_SINGLETON(MountTable);
+    public:
+        bool find(dev_t dev, MountEntry& entry);
+        bool isExt4(dev_t dev);
+        long getFsMagic(dev_t dev);
+    private:
+        typedef boost::unordered_map<dev_t, MountEntry> mounts_t;
+
+        MountEntry* lookup(dev_t dev);
+        bool hasChanged();
+        void load();
+        void loadMountInfo();
+        void loadMtab(const char* path);
+
+        mounts_t mounts;
+        int fd;
+        pthread_mutex_t lock;
+};
+
+#endif
@@ -22,6 +22,7 @@
  */
 
 #include "logging.hh"
+#include "common.hh"
 #include <sstream>
 
 int peek(FILE* in)
@@ -32,8 +33,34 @@ int peek(FILE* in)
     return c;
 }
 
+/*
+ * Cut off optional details following the path. They are introduced by
+ * a tab character followed by a key=value pair like "\tt=".
+ * Return pointer to the details or NULL if there are none.
+ */
+char* stripExtraColumns(char* line)
+{
+    for(char* tab = strchr(line, '\t'); tab; tab = strchr(tab + 1, '\t'))
+    {
+        char* p = tab + 1;
+        while(*p >= 'a' && *p <= 'z')
+            p++;
+        if(p > tab + 1 && *p == '=')
+        {
+            *tab = '\0';
+            return tab + 1;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * If extras is given, the details of each line are appended to it.
+ * Lines without details append an empty string.
+ */
 template<typename T>
-void parseInputStream(FILE* in, std::vector<T>& filelist)
+void parseInputStream(FILE* in, std::vector<T>& filelist,
+                      std::vector<std::string>* extras = NULL)
 {
     bool detailed = true;
     int ret;
@@ -41,7 +68,8 @@ void parseInputStream(FILE* in, std::vector<T>& filelist)
     int lineno = 0;
     int dev = 0;
     __u64 ino;
-    char path[PATH_MAX];
+    char path[PATH_MAX + 256];
+    char normalized[PATH_MAX + 256];
 
     int c = peek(in);
     if(c == EOF)
@@ -69,9 +97,18 @@ void parseInputStream(FILE* in, std::vector<T>& filelist)
                << _("Syntax error at line ") << lineno << _(" argument ") << ret+1;
             throw std::runtime_error(ss.str());
         }
+        char* extra = stripExtraColumns(path);
+        if(extras)
+            extras->push_back(extra ? extra : "");
+
+        // the result is never longer than an absolute input path
+        char* name = path;
+        if(path[0] == '/' && normalizePath(normalized, sizeof(normalized), path))
+            name = normalized;
+
         if(!detailed)
-            filelist.push_back(T(path));
+            filelist.push_back(T(name));
         else
-            filelist.push_back(T(dev,ino,path));
+            filelist.push_back(T(dev,ino,name));
     }
 }
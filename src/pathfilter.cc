@@ -0,0 +1,149 @@
+/*
+ * pathfilter.cc - Match paths against a set of wildcard patterns
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "pathfilter.hh"
+
+/*
+ * Test whether wildcard pattern matches the beginning of the string s.
+ * The match has to end either at the end of s or in front of a '/'.
+ *   '?' matches any single character
+ *   '*' matches any sequence of characters including '/'
+ *
+ * Backtracking is only done for the last seen '*'. Any earlier star
+ * could always be replaced by extending the last one.
+ */
+static bool matchWildcard(const char* p, const char* s, const char* end)
+{
+    const char* star_p = NULL;
+    const char* star_s = NULL;
+
+    while(1)
+    {
+        if(*p == '*')
+        {
+            star_p = ++p;
+            star_s = s;
+            continue;
+        }
+
+        if(*p == '\0')
+        {
+            if(s == end || *s == '/')
+                return true;
+        }
+        else if(s != end && (*p == '?' || *p == *s))
+        {
+            ++p;
+            ++s;
+            continue;
+        }
+
+        // mismatch: let the last star swallow one more character
+        if(star_p == NULL || star_s == end)
+            return false;
+        p = star_p;
+        s = ++star_s;
+    }
+}
+
+PathFilter::PathFilter()
+    : nodes(1), count(0)
+{}
+
+unsigned int PathFilter::findChild(unsigned int node, char c) const
+{
+    const std::vector<std::pair<char, unsigned int> >& children = nodes[node].children;
+    for(size_t i = 0; i < children.size(); i++)
+        if(children[i].first == c)
+            return children[i].second;
+
+    // node 0 is the root and never a child
+    return 0;
+}
+
+unsigned int PathFilter::addChild(unsigned int node, char c)
+{
+    unsigned int child = findChild(node, c);
+    if(child)
+        return child;
+
+    child = nodes.size();
+    nodes.push_back(Node());
+    nodes[node].children.push_back(std::pair<char, unsigned int>(c, child));
+    return child;
+}
+
+void PathFilter::insert(const std::string& pattern)
+{
+    size_t literal_len = pattern.find_first_of("*?");
+    if(literal_len == std::string::npos)
+        literal_len = pattern.size();
+
+    unsigned int node = 0;
+    for(size_t i = 0; i < literal_len; i++)
+        node = addChild(node, pattern[i]);
+
+    if(literal_len == pattern.size())
+        nodes[node].terminal = true;
+    else
+    {
+        nodes[node].wildcards.push_back(wildcards.size());
+        wildcards.push_back(pattern.substr(literal_len));
+    }
+    count++;
+}
+
+bool PathFilter::empty() const
+{
+    return count == 0;
+}
+
+size_t PathFilter::size() const
+{
+    return count;
+}
+
+bool PathFilter::match(const std::string& path) const
+{
+    return match(path.c_str(), path.size());
+}
+
+bool PathFilter::match(const char* path, size_t len) const
+{
+    const char* end = path + len;
+    unsigned int node = 0;
+    size_t pos = 0;
+
+    while(1)
+    {
+        const Node& n = nodes[node];
+
+        if(n.terminal && (pos == len || path[pos] == '/'))
+            return true;
+
+        for(size_t i = 0; i < n.wildcards.size(); i++)
+            if(matchWildcard(wildcards[n.wildcards[i]].c_str(), path + pos, end))
+                return true;
+
+        if(pos == len)
+            return false;
+
+        node = findChild(node, path[pos++]);
+        if(node == 0)
+            return false;
+    }
+}
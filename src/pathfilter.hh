@@ -0,0 +1,63 @@
+/*
+ * pathfilter.hh - Match paths against a set of wildcard patterns
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PATH_FILTER_HH
+#define PATH_FILTER_HH
+
+#include <string>
+#include <vector>
+
+/*
+ * PathFilter compiles a set of path patterns into one prefix trie.
+ * Patterns may contain the simple wildcards '*' and '?'.
+ *
+ * The literal part of each pattern up to its first wildcard is stored
+ * in the trie. The remaining wildcard suffix is attached to the node
+ * where the literal part ends. Therefore a path is walked only once and
+ * only those wildcard suffixes are tested whose literal prefix matches.
+ *
+ * A path matches if a pattern matches the whole path or if the
+ * pattern represents one of its parent directories.
+ *
+ * match() does not allocate any memory.
+ */
+class PathFilter
+{
+    public:
+        PathFilter();
+        void insert(const std::string& pattern);
+        bool empty() const;
+        size_t size() const;
+        bool match(const std::string& path) const;
+        bool match(const char* path, size_t len) const;
+    private:
+        struct Node
+        {
+                Node() : terminal(false) {}
+                std::vector<std::pair<char, unsigned int> > children;
+                std::vector<unsigned int> wildcards;
+                bool terminal;
+        };
+        unsigned int findChild(unsigned int node, char c) const;
+        unsigned int addChild(unsigned int node, char c);
+
+        std::vector<Node> nodes;
+        std::vector<std::string> wildcards;
+        size_t count;
+};
+
+#endif
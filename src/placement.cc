@@ -0,0 +1,154 @@
+/*
+ * placement.cc - Estimate the cost of reading files in access order
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "placement.hh"
+#include "fiemap.hh"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <sys/sysmacros.h>
+
+// 7200 rpm disk
+#define HDD_TRACK_SEEK   1.0        // ms
+#define HDD_FULL_SEEK    15.0       // ms
+#define HDD_ROTATION     4.17       // ms, half a revolution
+#define HDD_TRANSFER     100000.0   // bytes per ms
+// SATA solid state disk
+#define SSD_REQUEST      0.1        // ms
+#define SSD_TRANSFER     400000.0   // bytes per ms
+
+#define DEFAULT_DEVICE_SIZE (1ULL << 40)
+
+/*
+ * Read an unsigned number of a sysfs attribute of block device dev.
+ * Partitions inherit the queue attributes of their disk.
+ */
+static bool readBlockAttribute(dev_t dev, const char* attr, unsigned long long& value)
+{
+    char path[128];
+    const char* prefix[] = { "", "../" };
+
+    for(unsigned int i = 0; i < sizeof(prefix)/sizeof(prefix[0]); i++)
+    {
+        snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/%s%s",
+                 major(dev), minor(dev), prefix[i], attr);
+        FILE* file = fopen(path, "r");
+        if(NULL == file)
+            continue;
+        int ret = fscanf(file, "%llu", &value);
+        fclose(file);
+        if(ret == 1)
+            return true;
+    }
+    return false;
+}
+
+PlacementScore::PlacementScore(dev_t dev)
+    : rotational(true),
+      device_size(DEFAULT_DEVICE_SIZE),
+      bytes(0),
+      seek_distance(0),
+      discontinuities(0),
+      position(0),
+      started(false),
+      read_time(0)
+{
+    unsigned long long value;
+
+    // assume a hard disk if unknown
+    if(readBlockAttribute(dev, "queue/rotational", value))
+        rotational = value != 0;
+    // size is given in 512 byte sectors
+    if(readBlockAttribute(dev, "size", value) && value)
+        device_size = value << 9;
+}
+
+double PlacementScore::seekTime(__u64 from, __u64 to) const
+{
+    if(!rotational)
+        return SSD_REQUEST;
+
+    __u64 distance = from < to ? to - from : from - to;
+    double seek = HDD_TRACK_SEEK
+                + (HDD_FULL_SEEK - HDD_TRACK_SEEK)
+                  * sqrt(std::min(1.0, (double)distance / device_size))
+                + HDD_ROTATION;
+
+    // reading a short gap is faster than seeking over it
+    if(to > from)
+        seek = std::min(seek, distance / HDD_TRANSFER);
+    return seek;
+}
+
+/*
+ * Append the extents of the next file read
+ */
+void PlacementScore::add(const struct fiemap* fmap)
+{
+    if(NULL == fmap)
+        return;
+
+    for(__u32 i = 0; i < fmap->fm_mapped_extents; i++)
+    {
+        const struct fiemap_extent& e = fmap->fm_extents[i];
+        // inline data is read with the inode
+        if(e.fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DATA_INLINE))
+            continue;
+
+        if(started && e.fe_physical != position)
+        {
+            discontinuities++;
+            seek_distance += position < e.fe_physical ? e.fe_physical - position
+                                                      : position - e.fe_physical;
+            read_time += seekTime(position, e.fe_physical);
+        }
+
+        started = true;
+        position = e.fe_physical + e.fe_length;
+        bytes += e.fe_length;
+        read_time += e.fe_length / (rotational ? HDD_TRANSFER : SSD_TRANSFER);
+    }
+}
+
+bool PlacementScore::isRotational() const
+{
+    return rotational;
+}
+
+__u64 PlacementScore::getBytes() const
+{
+    return bytes;
+}
+
+__u64 PlacementScore::getSeekDistance() const
+{
+    return seek_distance;
+}
+
+__u32 PlacementScore::getDiscontinuities() const
+{
+    return discontinuities;
+}
+
+/*
+ * Return predicted read time in milliseconds
+ */
+double PlacementScore::getReadTime() const
+{
+    return read_time;
+}
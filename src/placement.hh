@@ -0,0 +1,63 @@
+/*
+ * placement.hh - Estimate the cost of reading files in access order
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PLACEMENT_HH
+#define PLACEMENT_HH
+
+#include <sys/types.h>
+#include <linux/types.h>
+
+struct fiemap;
+
+/*
+ * Score of a file placement for a cold page cache.
+ *
+ * Files are added in the order they are read. Each jump from the end of
+ * an extent to the start of the next one is a discontinuity. Its
+ * distance is summed up as seek distance. The head position before the
+ * first extent is unknown and not accounted.
+ *
+ * The read time is predicted by a simple cost model. On rotational
+ * devices a seek costs time growing with the square root of the distance
+ * plus half a rotation. Short forward gaps are read over if that is
+ * faster. On other devices every discontinuity costs a fixed request
+ * overhead only. See /sys/dev/block/<major>:<minor>/queue/rotational
+ */
+class PlacementScore
+{
+    public:
+        PlacementScore(dev_t dev);
+        void add(const struct fiemap* fmap);
+        bool isRotational() const;
+        __u64 getBytes() const;
+        __u64 getSeekDistance() const;
+        __u32 getDiscontinuities() const;
+        double getReadTime() const;
+    private:
+        double seekTime(__u64 from, __u64 to) const;
+
+        bool rotational;
+        __u64 device_size;      // in bytes
+        __u64 bytes;
+        __u64 seek_distance;    // in bytes
+        __u32 discontinuities;
+        __u64 position;         // end of the last extent read
+        bool started;
+        double read_time;       // in milliseconds
+};
+
+#endif
@@ -0,0 +1,170 @@
+/*
+ * planner.cc - Plan the physical layout of related files
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "planner.hh"
+#include "fiemap.hh"
+#include "logging.hh"
+
+#include <algorithm>
+#include <boost/foreach.hpp>
+
+struct CompareRangeStart
+{
+        bool operator()(const Extent& a, const Extent& b) const
+        {
+            return a.start < b.start;
+        }
+};
+
+LayoutPlanner::LayoutPlanner(Device _device, FreeSpaceIndex& _index)
+    : device(_device), index(_index), blocks(0), ranges_used(0)
+{
+}
+
+/*
+ * Initialize the plan of a file with the pieces that need blocks.
+ * A sparse file needs blocks for its extents only.
+ */
+void LayoutPlanner::addPieces(OrigDonorPair& odp)
+{
+    __u32 block_size = device.getBlockSize();
+    odp.plan.clear();
+
+    if(odp.isSparseFile)
+    {
+        const struct fiemap* fmap = ExtentCache::instance()->get(odp.origPath.string().c_str());
+        if(fmap)
+        {
+            for(__u32 i = 0; i < fmap->fm_mapped_extents; i++)
+                odp.plan.push_back(PlannedExtent(
+                        fmap->fm_extents[i].fe_logical / block_size, 0,
+                        (fmap->fm_extents[i].fe_length + block_size - 1) / block_size));
+            return;
+        }
+    }
+    odp.plan.push_back(PlannedExtent(0, 0, odp.blocks));
+}
+
+void LayoutPlanner::plan(std::vector<OrigDonorPair>& files)
+{
+    std::vector<OrigDonorPair*> segment;
+    __u64 hint = 0;
+
+    BOOST_FOREACH(OrigDonorPair& odp, files)
+    {
+        if(odp.blocks == 0)
+            continue;
+        addPieces(odp);
+
+        if(odp.goal && !segment.empty())
+        {
+            planSegment(segment, hint);
+            segment.clear();
+        }
+        if(segment.empty())
+            hint = odp.goal;
+        segment.push_back(&odp);
+    }
+    if(!segment.empty())
+        planSegment(segment, hint);
+
+    info(_("Planned layout: %llu block(s) in %u free range(s)"), blocks, ranges_used);
+}
+
+/*
+ * Fill the free ranges in ascending order with the files in access order.
+ * A file is split at the end of a range.
+ */
+void LayoutPlanner::planSegment(std::vector<OrigDonorPair*>& segment, __u64 hint)
+{
+    __u64 total = 0;
+    BOOST_FOREACH(OrigDonorPair* odp, segment)
+        BOOST_FOREACH(PlannedExtent& piece, odp->plan)
+            total += piece.len;
+
+    std::vector<Extent> ranges;
+    findRanges(total, hint, ranges);
+
+    size_t r = 0;
+    __u64 used = 0;     // blocks used of range r
+    BOOST_FOREACH(OrigDonorPair* odp, segment)
+    {
+        std::vector<PlannedExtent> planned;
+        BOOST_FOREACH(PlannedExtent& piece, odp->plan)
+        {
+            for(__u64 done = 0; done < piece.len;)
+            {
+                // out of free space: left to the allocator
+                if(r == ranges.size())
+                {
+                    planned.push_back(PlannedExtent(piece.logical + done, 0, piece.len - done));
+                    break;
+                }
+                __u64 len = std::min(piece.len - done, ranges[r].len - used);
+                planned.push_back(PlannedExtent(piece.logical + done, ranges[r].start + used, len));
+                done += len;
+                used += len;
+                blocks += len;
+                if(used == ranges[r].len)
+                {
+                    r++;
+                    used = 0;
+                }
+            }
+        }
+        odp->plan.swap(planned);
+    }
+}
+
+/*
+ * Select and reserve free ranges for total blocks.
+ *
+ * The first range at or behind hint which holds all blocks is taken.
+ * Otherwise ranges of the longest length are taken. They need the least
+ * number of ranges and therefore seeks. Each one is searched for behind
+ * the last one taken, the first one behind hint. Ranges are ordered by
+ * start to be read in one sweep.
+ */
+void LayoutPlanner::findRanges(__u64 total, __u64 hint, std::vector<Extent>& ranges)
+{
+    Extent range = index.findFirst(total, hint);
+    if(range.len == 0 && hint)
+        range = index.findFirst(total, 0);
+
+    for(__u64 remaining = total; remaining;)
+    {
+        if(range.len == 0)
+        {
+            range = index.largest();
+            if(range.len == 0)
+                break;
+            // the first range this long behind the last one taken
+            __u64 len = std::min(remaining, (__u64)range.len);
+            range = index.findFirst(len, ranges.empty() ? hint : ranges.back().start);
+            if(range.len == 0)
+                range = index.findFirst(len, 0);
+        }
+        Extent taken(range.start, std::min(remaining, (__u64)range.len));
+        index.reserve(taken);
+        ranges.push_back(taken);
+        remaining -= taken.len;
+        range = Extent();
+    }
+
+    std::sort(ranges.begin(), ranges.end(), CompareRangeStart());
+    ranges_used += ranges.size();
+}
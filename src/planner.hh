@@ -0,0 +1,55 @@
+/*
+ * planner.hh - Plan the physical layout of related files
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PLANNER_HH
+#define PLANNER_HH
+
+#include "defrag.hh"
+#include "freespace.hh"
+
+/*
+ * LayoutPlanner assigns physical blocks to all files of a device before
+ * any donor file is created. The result is stored in OrigDonorPair::plan.
+ *
+ * Files are laid out in access order. A set of files which fits into one
+ * free range is placed there as a whole. Otherwise the longest free
+ * ranges are taken, which keeps the number of seeks as low as possible,
+ * and are filled in ascending order. Holes of sparse files are kept.
+ *
+ * Files following a file kept in place (OrigDonorPair::goal) are planned
+ * separately, close behind that file.
+ *
+ * Planned ranges are reserved in the free space index. Blocks which do
+ * not fit into free space are left unplanned (physical 0).
+ */
+class LayoutPlanner
+{
+    public:
+        LayoutPlanner(Device, FreeSpaceIndex&);
+        void plan(std::vector<OrigDonorPair>& files);
+    private:
+        void addPieces(OrigDonorPair&);
+        void planSegment(std::vector<OrigDonorPair*>& segment, __u64 hint);
+        void findRanges(__u64 total, __u64 hint, std::vector<Extent>& ranges);
+
+        Device device;
+        FreeSpaceIndex& index;
+        __u64 blocks;
+        __u32 ranges_used;
+};
+
+#endif
@@ -0,0 +1,264 @@
+/*
+ * procscan.cc - Find files used by running processes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "procscan.hh"
+#include "logging.hh"
+
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <linux/limits.h>
+
+#include <boost/unordered_map.hpp>
+
+#define MAX_SCAN_THREADS 8
+#define DELETED_SUFFIX " (deleted)"
+
+typedef std::pair<dev_t, ino_t> file_key_t;
+typedef boost::unordered_map<file_key_t, std::string> files_t;
+
+/*
+ * Each thread scans every step-th process starting at first.
+ * Results are merged after all threads have finished.
+ */
+struct ScanJob
+{
+        const std::vector<pid_t>* pids;
+        size_t first;
+        size_t step;
+        files_t files;
+};
+
+static bool isDeleted(const char* path, size_t len)
+{
+    size_t suffix_len = sizeof(DELETED_SUFFIX) - 1;
+    return len >= suffix_len
+        && 0 == strcmp(path + len - suffix_len, DELETED_SUFFIX);
+}
+
+/*
+ * Walk /proc/<pid>/fd. Each entry is a symbolic link to the opened file.
+ */
+static void scanFds(pid_t pid, files_t& files)
+{
+    char dir_name[64];
+    char link[PATH_MAX];
+    struct dirent* ent;
+    struct stat st;
+
+    sprintf(dir_name, "/proc/%d/fd", pid);
+    DIR* dir = opendir(dir_name);
+    if(dir == NULL)
+        return;
+
+    while(NULL != (ent = readdir(dir)))
+    {
+        if(ent->d_name[0] == '.')
+            continue;
+
+        ssize_t len = readlinkat(dirfd(dir), ent->d_name, link, sizeof(link) - 1);
+        // skip sockets, pipes and anonymous inodes
+        if(len <= 0 || link[0] != '/')
+            continue;
+        link[len] = '\0';
+        if(isDeleted(link, len))
+            continue;
+
+        if(0 != fstatat(dirfd(dir), ent->d_name, &st, 0) || !S_ISREG(st.st_mode))
+            continue;
+
+        files.insert(files_t::value_type(file_key_t(st.st_dev, st.st_ino), link));
+    }
+    closedir(dir);
+}
+
+/*
+ * Parse /proc/<pid>/maps. Format of a line:
+ *   7f1c2a000000-7f1c2a022000 r--p 00000000 fd:01 1837421   /usr/lib/libc.so.6
+ *
+ * Device and inode number are listed. No stat(2) call is needed.
+ */
+static void scanMaps(pid_t pid, files_t& files)
+{
+    char file_name[64];
+    char line[PATH_MAX + 128];
+    unsigned int maj, min;
+    unsigned long long ino;
+    int pos;
+
+    sprintf(file_name, "/proc/%d/maps", pid);
+    FILE* maps = fopen(file_name, "r");
+    if(maps == NULL)
+        return;
+
+    while(fgets(line, sizeof(line), maps))
+    {
+        pos = 0;
+        if(3 != sscanf(line, "%*s %*s %*s %x:%x %llu %n", &maj, &min, &ino, &pos)
+           || ino == 0 || pos == 0 || line[pos] != '/')
+            continue;
+
+        char* path = line + pos;
+        size_t len = strlen(path);
+        if(len && path[len-1] == '\n')
+            path[--len] = '\0';
+        if(isDeleted(path, len))
+            continue;
+
+        files.insert(files_t::value_type(file_key_t(makedev(maj, min), ino), path));
+    }
+    fclose(maps);
+}
+
+static void* scanThread(void* arg)
+{
+    ScanJob* job = (ScanJob*)arg;
+    const std::vector<pid_t>& pids = *job->pids;
+
+    for(size_t i = job->first; i < pids.size(); i += job->step)
+    {
+        scanFds(pids[i], job->files);
+        scanMaps(pids[i], job->files);
+    }
+    return NULL;
+}
+
+static void listProcesses(std::vector<pid_t>& pids)
+{
+    struct dirent* ent;
+    pid_t self = getpid();
+
+    DIR* dir = opendir("/proc");
+    if(dir == NULL)
+    {
+        error(_("Cannot open /proc: %s"), strerror(errno));
+        return;
+    }
+
+    while(NULL != (ent = readdir(dir)))
+    {
+        char* end;
+        pid_t pid = strtol(ent->d_name, &end, 10);
+        if(*end != '\0' || pid <= 0 || pid == self)
+            continue;
+        pids.push_back(pid);
+    }
+    closedir(dir);
+}
+
+void scanProcFiles(std::vector<OpenFile>& result, unsigned int threads)
+{
+    std::vector<pid_t> pids;
+    listProcesses(pids);
+
+    if(threads == 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? cpus : 1;
+        if(threads > MAX_SCAN_THREADS)
+            threads = MAX_SCAN_THREADS;
+    }
+    if(threads > pids.size())
+        threads = pids.size() ? pids.size() : 1;
+
+    std::vector<ScanJob> jobs(threads);
+    std::vector<pthread_t> tids(threads);
+    std::vector<bool> started(threads, false);
+
+    for(unsigned int i = 0; i < threads; i++)
+    {
+        jobs[i].pids = &pids;
+        jobs[i].first = i;
+        jobs[i].step = threads;
+        // the calling thread takes the first job
+        if(i > 0)
+            started[i] = 0 == pthread_create(&tids[i], NULL, scanThread, &jobs[i]);
+    }
+    scanThread(&jobs[0]);
+
+    for(unsigned int i = 1; i < threads; i++)
+    {
+        if(started[i])
+            pthread_join(tids[i], NULL);
+        else
+            scanThread(&jobs[i]);
+    }
+
+    // merge results of all threads
+    files_t& files = jobs[0].files;
+    for(unsigned int i = 1; i < threads; i++)
+        files.insert(jobs[i].files.begin(), jobs[i].files.end());
+
+    debug("Scanned %u processes with %u thread(s)", (unsigned int)pids.size(), threads);
+
+    result.reserve(result.size() + files.size());
+    for(files_t::iterator it = files.begin(); it != files.end(); ++it)
+    {
+        OpenFile f;
+        f.dev = it->first.first;
+        f.ino = it->first.second;
+        f.path = it->second;
+        result.push_back(f);
+    }
+}
+
+bool isFileResident(const char* path)
+{
+    struct stat st;
+    bool resident = false;
+
+    int fd = open(path, O_RDONLY | O_NOATIME);
+    if(fd < 0 && errno == EPERM)
+        fd = open(path, O_RDONLY);
+    if(fd < 0)
+        return false;
+
+    if(0 == fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+        size_t page_size = sysconf(_SC_PAGESIZE);
+        size_t pages = (st.st_size + page_size - 1) / page_size;
+
+        // mapping the file does not read it
+        void* addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if(addr != MAP_FAILED)
+        {
+            std::vector<unsigned char> vec(pages);
+            if(0 == mincore(addr, st.st_size, &vec[0]))
+            {
+                resident = true;
+                for(size_t i = 0; i < pages; i++)
+                    if(!(vec[i] & 1))
+                    {
+                        resident = false;
+                        break;
+                    }
+            }
+            munmap(addr, st.st_size);
+        }
+    }
+    close(fd);
+
+    return resident;
+}
@@ -0,0 +1,49 @@
+/*
+ * procscan.hh - Find files used by running processes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PROC_SCAN_HH
+#define PROC_SCAN_HH
+
+#include <string>
+#include <vector>
+#include <sys/types.h>
+
+struct OpenFile
+{
+        dev_t dev;
+        ino_t ino;
+        std::string path;
+};
+
+/*
+ * Collect all regular files opened or mapped by any running process.
+ *
+ * /proc/<pid>/fd and /proc/<pid>/maps of all processes are walked by
+ * several threads. Each file is reported once regardless of how many
+ * processes use it. Deleted files are skipped.
+ *
+ * If threads is 0 one thread per online cpu is used, at most 8.
+ */
+void scanProcFiles(std::vector<OpenFile>& files, unsigned int threads = 0);
+
+/*
+ * Test whether all pages of a file are in the page cache.
+ * The file content is not read. See mincore(2)
+ */
+bool isFileResident(const char* path);
+
+#endif
@@ -0,0 +1,239 @@
+/*
+ * profile.cc - Persistent file access profile over several boots
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "profile.hh"
+#include "common.hh"
+#include "logging.hh"
+#include "parsefilelist.hh"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <errno.h>
+#include <algorithm>
+#include <sys/stat.h>
+
+#include <boost/foreach.hpp>
+
+// files below this score are removed from the profile
+#define MIN_SCORE 0.05
+
+/*
+ * Line of a profile file.
+ * Constructors are necessary to use common file list parser
+ */
+class ProfileLine
+{
+    public:
+        ProfileLine(dev_t d, ino_t i, fs::path p)
+            : dev(d), ino(i), path(p.string()) {}
+        ProfileLine(fs::path p)
+            : dev(0), ino(0), path(p.string())
+        {
+            struct stat st;
+            if(0 == stat(path.c_str(), &st))
+            {
+                dev = st.st_dev;
+                ino = st.st_ino;
+            }
+        }
+        dev_t dev;
+        ino_t ino;
+        std::string path;
+};
+
+static double parseDetail(const std::string& details, const char* key, double def)
+{
+    size_t len = strlen(key);
+    for(size_t pos = 0; pos < details.size(); pos = details.find(' ', pos))
+    {
+        if(details[pos] == ' ')
+            pos++;
+        if(0 == details.compare(pos, len, key) && details[pos + len] == '=')
+            return strtod(details.c_str() + pos + len + 1, NULL);
+    }
+    return def;
+}
+
+Profile::Profile(double d)
+    : decay(d)
+{}
+
+/*
+ * Load profile from file. A missing file is an empty profile.
+ */
+bool Profile::load(const char* path)
+{
+    std::vector<ProfileLine> lines;
+    std::vector<std::string> details;
+
+    entries.clear();
+    index.clear();
+
+    FILE* file = fopen(path, "r");
+    if(NULL == file)
+        return errno == ENOENT;
+
+    try {
+        parseInputStream(file, lines, &details);
+    } catch(std::exception& e) {
+        error("%s", e.what());
+        fclose(file);
+        return false;
+    }
+    fclose(file);
+
+    entries.reserve(lines.size());
+    for(size_t i = 0; i < lines.size(); i++)
+    {
+        if(lines[i].dev == 0 && lines[i].ino == 0)
+            continue;
+        Entry e;
+        e.dev = lines[i].dev;
+        e.ino = lines[i].ino;
+        e.path = lines[i].path;
+        e.score = parseDetail(details[i], "s", 1.0);
+        e.time = parseDetail(details[i], "t", 0);
+        e.seen = false;
+        if(index.insert(index_t::value_type(key_t(e.dev, e.ino), entries.size())).second)
+            entries.push_back(e);
+    }
+    return true;
+}
+
+/*
+ * Merge the result of one collection into the profile.
+ * A file seen for the first time starts with a score of 1.
+ */
+void Profile::update(const std::deque<FilePtr>& files)
+{
+    BOOST_FOREACH(Entry& e, entries)
+        e.seen = false;
+
+    BOOST_FOREACH(const FilePtr& f, files)
+    {
+        std::pair<index_t::iterator, bool> ret = index.insert(
+            index_t::value_type(key_t(f.getDevice(), f.getInode()), entries.size()));
+        if(ret.second)
+        {
+            Entry e;
+            e.dev = f.getDevice();
+            e.ino = f.getInode();
+            e.path = f.getPathName();
+            e.score = 1.0;
+            e.time = f.getFirstAccess();
+            e.seen = true;
+            entries.push_back(e);
+            continue;
+        }
+
+        Entry& e = entries[ret.first->second];
+        if(e.seen)
+            continue;
+        e.seen = true;
+        e.path = f.getPathName();
+        e.score = decay * e.score + (1 - decay);
+        e.time = decay * e.time + (1 - decay) * f.getFirstAccess();
+    }
+
+    // decay files not seen and forget those nobody uses anymore
+    std::vector<Entry> kept;
+    kept.reserve(entries.size());
+    index.clear();
+    BOOST_FOREACH(Entry& e, entries)
+    {
+        if(!e.seen)
+            e.score *= decay;
+        if(e.score < MIN_SCORE)
+            continue;
+        index.insert(index_t::value_type(key_t(e.dev, e.ino), kept.size()));
+        kept.push_back(e);
+    }
+    entries.swap(kept);
+}
+
+bool Profile::save(const char* path)
+{
+    std::string content;
+    char buf[128];
+
+    content.reserve(entries.size() * 80);
+    BOOST_FOREACH(const Entry& e, entries)
+    {
+        sprintf(buf, "%u %u ", (__u32)e.dev, (__u32)e.ino);
+        content += buf;
+        content += e.path;
+        sprintf(buf, "\ts=%.3f t=%.0f\n", e.score, e.time);
+        content += buf;
+    }
+    return writeFileAtomic(path, content);
+}
+
+struct CompareTime
+{
+        bool operator()(const std::pair<double, size_t>& a,
+                        const std::pair<double, size_t>& b) const
+        {
+            return a.first < b.first;
+        }
+};
+
+/*
+ * Files of score threshold or above ordered by time of first access.
+ * The list holds no details. Only a changed file set or order changes it.
+ */
+std::string Profile::formatList(double threshold) const
+{
+    std::vector<std::pair<double, size_t> > order;
+    for(size_t i = 0; i < entries.size(); i++)
+        if(entries[i].score >= threshold)
+            order.push_back(std::make_pair(entries[i].time, i));
+    std::stable_sort(order.begin(), order.end(), CompareTime());
+
+    std::string content;
+    char buf[64];
+    for(size_t i = 0; i < order.size(); i++)
+    {
+        const Entry& e = entries[order[i].second];
+        sprintf(buf, "%u %u ", (__u32)e.dev, (__u32)e.ino);
+        content += buf;
+        content += e.path;
+        content += '\n';
+    }
+    return content;
+}
+
+/*
+ * Write file list of the profile to path unless it is unchanged.
+ * Return false on error. changed tells whether the list has been written.
+ */
+bool Profile::writeList(const char* path, double threshold, bool& changed)
+{
+    std::string current;
+    std::string list = formatList(threshold);
+
+    changed = !readFile(path, current) || current != list;
+    if(!changed)
+        return true;
+
+    return writeFileAtomic(path, list);
+}
+
+size_t Profile::size() const
+{
+    return entries.size();
+}
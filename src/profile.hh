@@ -0,0 +1,73 @@
+/*
+ * profile.hh - Persistent file access profile over several boots
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PROFILE_HH
+#define PROFILE_HH
+
+#include "fileptr.hh"
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <sys/types.h>
+#include <boost/unordered_map.hpp>
+
+/*
+ * Profile keeps an exponentially weighted moving average of each file
+ * over all collections:
+ *
+ *   score  probability the file is accessed. A file seen in a collection
+ *          is moved towards 1, a file not seen decays towards 0.
+ *   time   time of first access in milliseconds after the start of the
+ *          collection.
+ *
+ * decay is the weight of the history. Files whose score dropped below
+ * a minimum are forgotten.
+ *
+ * The profile file uses the file list format. The details of each file
+ * are "s=<score> t=<time>".
+ */
+class Profile
+{
+    public:
+        Profile(double decay);
+        bool load(const char* path);
+        bool save(const char* path);
+        void update(const std::deque<FilePtr>& files);
+        bool writeList(const char* path, double threshold, bool& changed);
+        size_t size() const;
+    private:
+        struct Entry
+        {
+                dev_t dev;
+                ino_t ino;
+                std::string path;
+                double score;
+                double time;
+                bool seen;
+        };
+        typedef std::pair<dev_t, ino_t> key_t;
+        typedef boost::unordered_map<key_t, size_t> index_t;
+
+        std::string formatList(double threshold) const;
+
+        double decay;
+        std::vector<Entry> entries;
+        index_t index;
+};
+
+#endif
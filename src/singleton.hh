@@ -60,7 +60,9 @@ private:                                                        \
         static Guarder g;                                              \
         if( me == NULL )                                                \
             if(0 == pthread_mutex_lock(&lock_singleton)) {              \
-                me = new ClassName();                                   \
+                /* another thread may have been faster */               \
+                if( me == NULL )                                        \
+                    me = new ClassName();                               \
                 pthread_mutex_unlock(&lock_singleton);                  \
             }                                                           \
                                                                         \
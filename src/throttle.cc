@@ -0,0 +1,185 @@
+/*
+ * throttle.cc - Limit the I/O load caused by moving files
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "throttle.hh"
+#include "logging.hh"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+
+#define PRESSURE_FILE "/proc/pressure/io"
+#define MIN_BACKOFF 0.05    // seconds
+#define MAX_BACKOFF 1.0
+
+// see linux/ioprio.h
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_IDLE  3
+#define IOPRIO_WHO_PROCESS 1
+
+bool ThrottleConfig::enabled() const
+{
+    return rate || idle || pressure > 0 || inflight;
+}
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Return the share of time in percent some tasks stalled on I/O
+ * within the last 10 seconds. Format of the first line:
+ *   some avg10=0.12 avg60=0.05 avg300=0.01 total=1234567
+ */
+static bool readPressure(double& avg10)
+{
+    FILE* file = fopen(PRESSURE_FILE, "r");
+    if(NULL == file)
+        return false;
+    int ret = fscanf(file, "some avg10=%lf", &avg10);
+    fclose(file);
+    return ret == 1;
+}
+
+/*
+ * Return the number of requests in flight on the disk holding dev.
+ * Partitions count the requests of the whole disk.
+ */
+static bool readInflight(dev_t dev, unsigned int& requests)
+{
+    char path[128];
+    const char* prefix[] = { "../", "" };
+    unsigned int reads, writes;
+
+    for(unsigned int i = 0; i < sizeof(prefix)/sizeof(prefix[0]); i++)
+    {
+        snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/%sinflight",
+                 major(dev), minor(dev), prefix[i]);
+        FILE* file = fopen(path, "r");
+        if(NULL == file)
+            continue;
+        int ret = fscanf(file, "%u %u", &reads, &writes);
+        fclose(file);
+        if(ret == 2)
+        {
+            requests = reads + writes;
+            return true;
+        }
+    }
+    return false;
+}
+
+Throttle::Throttle(const ThrottleConfig& c, dev_t d)
+    : config(c), dev(d), bytes(0), waited(0), backed_off(0)
+{
+    double avg10;
+    unsigned int requests;
+
+    has_pressure = config.pressure > 0 && readPressure(avg10);
+    if(config.pressure > 0 && !has_pressure)
+        warn(_("Cannot read %s: I/O pressure is not watched"), PRESSURE_FILE);
+
+    has_inflight = config.inflight && readInflight(dev, requests);
+    if(config.inflight && !has_inflight)
+        warn(_("Cannot read requests in flight of device %u:%u"), major(dev), minor(dev));
+
+    start = last = now();
+    tokens = config.rate;
+}
+
+/*
+ * Set the idle I/O scheduling class for the calling thread. Its requests
+ * are only served if the disk is not used otherwise.
+ */
+void Throttle::setIdlePriority()
+{
+    if(0 > syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+                   IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT))
+        warn(_("Cannot set idle I/O priority: %s"), strerror(errno));
+}
+
+bool Throttle::isBusy()
+{
+    double avg10;
+    unsigned int requests;
+
+    if(has_pressure && readPressure(avg10) && avg10 > config.pressure)
+        return true;
+    if(has_inflight && readInflight(dev, requests) && requests > config.inflight)
+        return true;
+    return false;
+}
+
+void Throttle::sleep(double secs)
+{
+    struct timespec ts;
+    ts.tv_sec = (time_t)secs;
+    ts.tv_nsec = (long)((secs - ts.tv_sec) * 1e9);
+    while(0 > nanosleep(&ts, &ts) && errno == EINTR)
+        interruptionPoint();
+}
+
+/*
+ * Block until b bytes may be moved.
+ */
+void Throttle::wait(__u64 b)
+{
+    double backoff = MIN_BACKOFF;
+    while(isBusy())
+    {
+        interruptionPoint();
+        sleep(backoff);
+        backed_off += backoff;
+        backoff = std::min(backoff * 2, MAX_BACKOFF);
+    }
+
+    if(config.rate)
+    {
+        double t = now();
+        tokens = std::min(tokens + (t - last) * config.rate, (double)config.rate);
+        last = t;
+        tokens -= b;
+        if(tokens < 0)
+        {
+            double secs = -tokens / config.rate;
+            interruptionPoint();
+            sleep(secs);
+            waited += secs;
+        }
+    }
+    bytes += b;
+}
+
+void Throttle::report()
+{
+    double secs = now() - start;
+    double rate = secs > 0 ? bytes / secs / (1 << 20) : 0;
+
+    if(config.enabled())
+        notice(_("Moved %llu MiB in %.1f s (%.1f MiB/s), throttled %.1f s, backed off %.1f s"),
+               bytes >> 20, secs, rate, waited, backed_off);
+    else
+        info(_("Moved %llu MiB in %.1f s (%.1f MiB/s)"), bytes >> 20, secs, rate);
+}
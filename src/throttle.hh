@@ -0,0 +1,77 @@
+/*
+ * throttle.hh - Limit the I/O load caused by moving files
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef THROTTLE_HH
+#define THROTTLE_HH
+
+#include "common.hh"
+
+#include <sys/types.h>
+#include <linux/types.h>
+
+/*
+ * Settings of Throttle. A value of 0 disables the limit.
+ */
+struct ThrottleConfig
+{
+        ThrottleConfig() : rate(0), idle(false), pressure(0), inflight(0) {}
+        bool enabled() const;
+        __u64 rate;             // bytes per second
+        bool idle;              // use the idle I/O scheduling class
+        double pressure;        // percentage of time tasks stalled on I/O
+        unsigned int inflight;  // requests in flight on the disk
+};
+
+/*
+ * Throttle keeps moving files from hurting other workloads.
+ *
+ * Bytes to be moved are paid from a token bucket refilled at the
+ * configured rate. A burst of one second is allowed. If the bucket is in
+ * debt the caller sleeps until it is paid off.
+ *
+ * Apart from that the caller backs off as long as the system is busy:
+ * the share of time some tasks stalled on I/O within the last 10 seconds
+ * is read from /proc/pressure/io (Linux 4.20), the number of requests in
+ * flight from /sys/dev/block/<major>:<minor>/inflight. The wait starts at
+ * 50 ms and doubles up to 1 second.
+ *
+ * One object is used by one thread.
+ */
+class Throttle : public Interruptible
+{
+    public:
+        Throttle(const ThrottleConfig&, dev_t dev);
+        void wait(__u64 bytes);
+        void report();
+        static void setIdlePriority();
+    private:
+        bool isBusy();
+        void sleep(double secs);
+
+        ThrottleConfig config;
+        dev_t dev;
+        bool has_pressure;
+        bool has_inflight;
+        double start;
+        double last;            // time of the last refill
+        double tokens;          // in bytes, negative on debt
+        __u64 bytes;
+        double waited;          // in seconds
+        double backed_off;      // in seconds
+};
+
+#endif
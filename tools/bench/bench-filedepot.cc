@@ -0,0 +1,211 @@
+/*
+ * bench-filedepot.cc - Measure FileDepot against a std::map based depot
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "fileptr.hh"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <vector>
+#include <sys/time.h>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+
+#define DEV 2049
+
+static double now()
+{
+    struct timeval t;
+    gettimeofday(&t, NULL);
+    return t.tv_sec + t.tv_usec / 1e6;
+}
+
+/*
+ * Depot as it was before FileDepot: a std::map of weak_ptrs, each file
+ * a separately allocated shared object with its own fs::path.
+ * The stat(2) call the former FilePtr destructor made is left out.
+ */
+struct MapFile
+{
+        dev_t dev;
+        ino_t ino;
+        fs::path path;
+        bool valid;
+};
+
+class MapDepot
+{
+    public:
+        boost::shared_ptr<MapFile> get(dev_t dev, ino_t ino, const fs::path& path)
+        {
+            key_t key(dev, ino);
+            depot_t::iterator it = depot.find(key);
+            if(it != depot.end())
+            {
+                boost::shared_ptr<MapFile> f = it->second.lock();
+                if(f)
+                    return f;
+            }
+            boost::shared_ptr<MapFile> f(new MapFile);
+            f->dev = dev;
+            f->ino = ino;
+            f->path = path;
+            f->valid = true;
+            depot[key] = f;
+            return f;
+        }
+        void release(boost::shared_ptr<MapFile>& f)
+        {
+            key_t key(f->dev, f->ino);
+            f.reset();
+            depot_t::iterator it = depot.find(key);
+            if(it != depot.end() && it->second.expired())
+                depot.erase(it);
+        }
+    private:
+        typedef std::pair<dev_t, ino_t> key_t;
+        typedef std::map<key_t, boost::weak_ptr<MapFile> > depot_t;
+        depot_t depot;
+};
+
+static int failures = 0;
+
+static void expect(bool cond, const char* what)
+{
+    if(!cond)
+    {
+        fprintf(stderr, "check failed: %s\n", what);
+        failures++;
+    }
+}
+
+static ino_t inode(size_t i)
+{
+    return i * 7 + 13;
+}
+
+/*
+ * Test reference counting, lookup, removal and reuse of records
+ */
+static void check(const std::vector<fs::path>& paths)
+{
+    FileDepot* depot = FileDepot::instance();
+    size_t n = paths.size();
+    std::vector<FilePtr> files;
+
+    for(size_t i = 0; i < n; i++)
+        files.push_back(FilePtr(DEV, inode(i), paths[i]));
+    expect(depot->size() == n, "one record per file");
+
+    for(size_t i = 0; i < n; i++)
+    {
+        FilePtr f(DEV, inode(i), "/other/path");
+        if(f.unique() || 0 != strcmp(f.getPathName(), paths[i].string().c_str()))
+        {
+            expect(false, "lookup returns the existing record");
+            break;
+        }
+    }
+    expect(depot->contains(DEV, inode(0)), "contains a held file");
+    expect(!depot->contains(DEV + 1, inode(0)), "key includes the device");
+    expect(!depot->contains(DEV, inode(n)), "does not contain an unknown file");
+
+    files[0].setInvalid();
+    expect(!FilePtr(DEV, inode(0), paths[0]).isValid(), "state is shared");
+
+    // remove every other file. Backward shift must keep the others reachable
+    for(size_t i = 0; i < n; i += 2)
+        files[i] = FilePtr();
+    expect(depot->size() == n / 2, "last reference removes the record");
+    for(size_t i = 0; i < n; i++)
+        if(depot->contains(DEV, inode(i)) != (i % 2 == 1))
+        {
+            expect(false, "only released files are removed");
+            break;
+        }
+
+    FilePtr again(DEV, inode(0), paths[0]);
+    expect(again.unique() && again.isValid(), "removed file starts afresh");
+
+    files.clear();
+    again = FilePtr();
+    expect(depot->size() == 0, "depot is empty");
+}
+
+/*
+ * Usage: bench-filedepot [number of files]
+ */
+int main(int argc, char* argv[])
+{
+    size_t n = argc > 1 ? atoi(argv[1]) : 100000;
+    char buf[128];
+
+    std::vector<fs::path> paths;
+    for(size_t i = 0; i < n; i++)
+    {
+        snprintf(buf, sizeof(buf), "/usr/lib/x86_64-linux-gnu/some/dir%03u/libfoo%06u.so.1",
+                 (unsigned int)(i % 500), (unsigned int)i);
+        paths.push_back(buf);
+    }
+
+    double t0, t1, t2, t3;
+    size_t hits = 0;
+    {
+        // inserting, looking up again and removing distinct files
+        std::vector<FilePtr> files;
+        files.reserve(n);
+        t0 = now();
+        for(size_t i = 0; i < n; i++)
+            files.push_back(FilePtr(DEV, inode(i), paths[i]));
+        t1 = now();
+        for(size_t i = 0; i < n; i++)
+            hits += !FilePtr(DEV, inode(i), paths[i]).unique();
+        t2 = now();
+        files.clear();
+        t3 = now();
+    }
+    printf("FileDepot: insert %4.0f ns, lookup %4.0f ns, remove %4.0f ns per file, "
+           "%.0f bytes per file\n",
+           (t1 - t0) / n * 1e9, (t2 - t1) / n * 1e9, (t3 - t2) / n * 1e9,
+           (double)FileDepot::instance()->memoryUsage() / n);
+
+    {
+        MapDepot depot;
+        std::vector<boost::shared_ptr<MapFile> > files;
+        files.reserve(n);
+        t0 = now();
+        for(size_t i = 0; i < n; i++)
+            files.push_back(depot.get(DEV, inode(i), paths[i]));
+        t1 = now();
+        for(size_t i = 0; i < n; i++)
+            hits += depot.get(DEV, inode(i), paths[i]).use_count() > 1;
+        t2 = now();
+        for(size_t i = 0; i < n; i++)
+            depot.release(files[i]);
+        t3 = now();
+    }
+    printf("std::map:  insert %4.0f ns, lookup %4.0f ns, remove %4.0f ns per file (%lu hits)\n",
+           (t1 - t0) / n * 1e9, (t2 - t1) / n * 1e9, (t3 - t2) / n * 1e9,
+           (unsigned long)hits);
+
+    check(paths);
+    if(failures)
+        fprintf(stderr, "%d check(s) failed\n", failures);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
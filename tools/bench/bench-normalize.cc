@@ -0,0 +1,158 @@
+/*
+ * bench-normalize.cc - Compare normalizePath() with the former realpath()
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.hh"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <sys/time.h>
+#include <linux/limits.h>
+
+/*
+ * realpath() as it was before normalizePath()
+ */
+static fs::path oldRealpath(fs::path ph, fs::path base)
+{
+    fs::path mypath;
+    if(!base.has_root_directory())
+        base.clear();
+    while(ph.string().size() > 1 && !ph.string().compare(0, 2, "//"))
+        ph = ph.string().substr(1);
+    while(base.string().size() > 1 && !base.string().compare(0, 2, "//"))
+        base = base.string().substr(1);
+
+    if(base.empty())
+        mypath = fs::absolute(ph);
+    else
+        mypath = fs::absolute(ph, base);
+
+    fs::path result;
+    for(fs::path::iterator it = mypath.begin(); it != mypath.end(); it++)
+    {
+        if(*it == "..")
+            result = result.parent_path();
+        else if(*it == ".")
+            continue;
+        else
+            result /= (*it);
+    }
+    return result;
+}
+
+static double now()
+{
+    struct timeval t;
+    gettimeofday(&t, NULL);
+    return t.tv_sec + t.tv_usec / 1e6;
+}
+
+struct Case
+{
+        const char* path;
+        const char* base;
+        const char* result;     // "" means relative to the working directory
+};
+
+static const Case cases[] = {
+    { "/usr/lib/x86_64-linux-gnu/libc.so.6", "",  "/usr/lib/x86_64-linux-gnu/libc.so.6" },
+    { "../lib/./libm.so",       "/usr/bin",         "/usr/lib/libm.so" },
+    { "lib/a/../b/./c.so",      "/home/user/build", "/home/user/build/lib/b/c.so" },
+    { "//etc//ld.so.cache",     "",                 "/etc/ld.so.cache" },
+    { "/a/b/",                  "",                 "/a/b" },
+    { "x",                      "/",                "/x" },
+    { "x",                      "//base//",         "/base/x" },
+    { "/",                      "",                 "/" },
+    { "/../a",                  "",                 "/a" },
+    { "../../..",               "/usr/lib",         "/" },
+    { "/a/..",                  "",                 "/" },
+    { "x/./y",                  "relative",         "" },
+};
+
+static int failures = 0;
+
+static void fail(const char* path, const char* base, const char* got, const char* expected)
+{
+    fprintf(stderr, "normalizePath(%s, %s) = %s, expected %s\n", path, base, got, expected);
+    failures++;
+}
+
+/*
+ * Test fixed cases and behaviour on buffers which are too small
+ */
+static void check()
+{
+    char buf[PATH_MAX];
+    char cwd[PATH_MAX];
+
+    if(NULL == getcwd(cwd, sizeof(cwd)))
+        strcpy(cwd, "/");
+
+    for(size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+    {
+        const Case& c = cases[i];
+        std::string expected = c.result;
+        if(expected.empty())
+            expected = oldRealpath(c.path, c.base).string();
+
+        size_t len = normalizePath(buf, sizeof(buf), c.path, c.base);
+        if(len != expected.size() || expected != buf)
+            fail(c.path, c.base, len ? buf : "(none)", expected.c_str());
+
+        if(realpath(c.path, c.base).string() != expected)
+            fail(c.path, c.base, "realpath() differs", expected.c_str());
+    }
+
+    // the result and its null byte have to fit
+    const char* path = "/usr/lib";
+    if(strlen(path) != normalizePath(buf, strlen(path) + 1, path))
+        fail(path, "", "(none)", "fitting result");
+    if(0 != normalizePath(buf, strlen(path), path))
+        fail(path, "", buf, "0 for a short buffer");
+    if(0 != normalizePath(buf, 1, "/"))
+        fail("/", "", buf, "0 for a short buffer");
+}
+
+/*
+ * Usage: bench-normalize [number of paths]
+ */
+int main(int argc, char* argv[])
+{
+    size_t n = argc > 1 ? atoi(argv[1]) : 1000000;
+    // a mix of absolute and relative paths
+    const size_t mix = 4;
+    char buf[PATH_MAX];
+    size_t sum = 0;
+
+    check();
+
+    double t0 = now();
+    for(size_t i = 0; i < n; i++)
+        sum += oldRealpath(cases[i % mix].path, cases[i % mix].base).string().size();
+    double t1 = now();
+    for(size_t i = 0; i < n; i++)
+        sum += normalizePath(buf, sizeof(buf), cases[i % mix].path, cases[i % mix].base);
+    double t2 = now();
+
+    printf("former realpath() %5.0f ns/path, normalizePath() %4.0f ns/path (%lu)\n",
+           (t1 - t0) / n * 1e9, (t2 - t1) / n * 1e9, (unsigned long)sum);
+
+    if(failures)
+        fprintf(stderr, "%d check(s) failed\n", failures);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
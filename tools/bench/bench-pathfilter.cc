@@ -0,0 +1,207 @@
+/*
+ * bench-pathfilter.cc - Compare PathFilter with the former regex matching
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "pathfilter.hh"
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <sys/time.h>
+
+#include <boost/regex.hpp>
+
+/*
+ * Regex matching as done by AuditListener::ignorePath() before PathFilter
+ */
+static boost::regex path2regex(const std::string& path)
+{
+    return boost::regex(boost::regex_replace(path, boost::regex("(\\.)|(\\?)|(\\*)"),
+                                             "(?1\\\\.)(?2.)(?3.*)",
+                                             boost::match_default | boost::format_all));
+}
+
+static bool regexMatch(const std::string& path, const std::vector<boost::regex>& filters)
+{
+    boost::match_results<std::string::const_iterator> what;
+    for(size_t i = 0; i < filters.size(); i++)
+        if(boost::regex_search(path, what, filters[i],
+                               boost::match_default | boost::match_continuous))
+        {
+            size_t match_end = what[0].second - what[0].first;
+            if(match_end >= path.size() || '/' == path[match_end])
+                return true;
+        }
+    return false;
+}
+
+static double now()
+{
+    struct timeval t;
+    gettimeofday(&t, NULL);
+    return t.tv_sec + t.tv_usec / 1e6;
+}
+
+struct Case
+{
+        const char* pattern;
+        const char* path;
+        bool match;
+};
+
+static const Case cases[] = {
+    { "/usr/lib",           "/usr/lib",                     true  },
+    { "/usr/lib",           "/usr/lib/libc.so.6",           true  },
+    { "/usr/lib",           "/usr/lib64/libc.so.6",         false },
+    { "/usr/lib",           "/usr",                         false },
+    { "/usr/lib/",          "/usr/lib/libc.so.6",           false },
+    { "/usr/*.so",          "/usr/lib/libc.so",             true  },
+    { "/usr/*.so",          "/usr/lib/libc.so.6",           false },
+    { "/usr/*.so*",         "/usr/lib/libc.so.6",           true  },
+    { "/usr/lib/lib?.so",   "/usr/lib/libc.so",             true  },
+    { "/usr/lib/lib?.so",   "/usr/lib/libcc.so",            false },
+    { "*/fonts",            "/usr/share/fonts/a.ttf",       true  },
+    { "*/fonts",            "/usr/share/fontsx/a.ttf",      false },
+    { "/var/*/log",         "/var/a/b/log/messages",        true  },
+    { "/etc/ld.so.cache",   "/etc/ldxsoxcache",             false },
+    { "/tmp",               "/tmp/x",                       true  },
+};
+
+/*
+ * Return the number of fixed cases PathFilter gets wrong
+ */
+static int checkCases()
+{
+    int mismatches = 0;
+
+    for(size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+    {
+        PathFilter filter;
+        filter.insert(cases[i].pattern);
+        if(filter.match(cases[i].path) != cases[i].match)
+        {
+            fprintf(stderr, "pattern %s path %s: expected %d\n",
+                    cases[i].pattern, cases[i].path, cases[i].match);
+            mismatches++;
+        }
+    }
+    return mismatches;
+}
+
+/*
+ * Return the number of paths PathFilter and the regex matching disagree on
+ */
+static int check(const std::vector<std::string>& paths,
+                 const std::vector<std::string>& patterns)
+{
+    int mismatches = 0;
+    PathFilter filter;
+    std::vector<boost::regex> regex;
+    for(size_t i = 0; i < patterns.size(); i++)
+    {
+        filter.insert(patterns[i]);
+        regex.push_back(path2regex(patterns[i]));
+    }
+    for(size_t i = 0; i < paths.size(); i++)
+        if(filter.match(paths[i]) != regexMatch(paths[i], regex))
+        {
+            fprintf(stderr, "%s: PathFilter and regex differ\n", paths[i].c_str());
+            mismatches++;
+        }
+
+    return mismatches;
+}
+
+static const char* dirs[] = { "usr", "lib", "bin", "share", "etc", "var", "opt",
+                              "local", "x86_64-linux-gnu", "python3", "fonts", "icons" };
+#define DIRS (sizeof(dirs) / sizeof(dirs[0]))
+
+static std::string randomDirs(int min, int max)
+{
+    std::string p;
+    int depth = min + rand() % (max - min + 1);
+    for(int i = 0; i < depth; i++)
+    {
+        p += "/";
+        p += dirs[rand() % DIRS];
+    }
+    return p;
+}
+
+/*
+ * Usage: bench-pathfilter [number of paths]
+ */
+int main(int argc, char* argv[])
+{
+    size_t num_paths = argc > 1 ? atoi(argv[1]) : 20000;
+    const int rounds = 5;
+    int mismatches = checkCases();
+    char name[32];
+
+    srand(1);
+    std::vector<std::string> paths;
+    for(size_t i = 0; i < num_paths; i++)
+    {
+        sprintf(name, "/f%d.so.%d", rand() % 50, rand() % 3);
+        paths.push_back(randomDirs(2, 6) + name);
+    }
+
+    for(int num_patterns = 1; num_patterns <= 100; num_patterns *= 10)
+    {
+        std::vector<std::string> patterns;
+        for(int i = 0; i < num_patterns; i++)
+        {
+            std::string p = randomDirs(1, 3);
+            switch(rand() % 4)
+            {
+                case 0: p += "/*.so*"; break;
+                case 1: p = std::string("*/") + dirs[rand() % DIRS] + "/f?.so*"; break;
+                case 2: p += "*"; break;
+            }
+            patterns.push_back(p);
+        }
+
+        mismatches += check(paths, patterns);
+
+        PathFilter filter;
+        std::vector<boost::regex> regex;
+        for(int i = 0; i < num_patterns; i++)
+        {
+            filter.insert(patterns[i]);
+            regex.push_back(path2regex(patterns[i]));
+        }
+
+        size_t hits = 0;
+        double t0 = now();
+        for(int r = 0; r < rounds; r++)
+            for(size_t i = 0; i < paths.size(); i++)
+                hits += regexMatch(paths[i], regex);
+        double t1 = now();
+        for(int r = 0; r < rounds; r++)
+            for(size_t i = 0; i < paths.size(); i++)
+                hits += filter.match(paths[i]);
+        double t2 = now();
+
+        double n = (double)rounds * paths.size();
+        printf("%3d pattern(s): regex %7.0f ns/path, PathFilter %6.0f ns/path (%lu hits)\n",
+               num_patterns, (t1 - t0) / n * 1e9, (t2 - t1) / n * 1e9, (unsigned long)hits);
+    }
+
+    if(mismatches)
+        fprintf(stderr, "%d mismatch(es)\n", mismatches);
+    return mismatches ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,222 @@
+/*
+ * bench-replay.cc - Replay a synthetic audit capture through AuditListener
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "listener.hh"
+#include "eventcatcher.hh"
+#include "fileptr.hh"
+#include "logging.hh"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <linux/audit.h>
+
+// capture file format, see AuditListener::recordTo()
+#define CAPTURE_MAGIC "E4RATCAP"
+#define CAPTURE_VERSION 1
+
+// every WRITE_EVERY-th open is writable
+#define WRITE_EVERY 8
+
+static double now()
+{
+    struct timeval t;
+    gettimeofday(&t, NULL);
+    return t.tv_sec + t.tv_usec / 1e6;
+}
+
+struct TestFile
+{
+        std::string path;
+        dev_t dev;
+        ino_t ino;
+};
+
+/*
+ * Collect up to max regular files of a directory
+ */
+static void listFiles(const char* dir_name, size_t max, std::vector<TestFile>& files)
+{
+    struct dirent* ent;
+    struct stat st;
+
+    DIR* dir = opendir(dir_name);
+    if(dir == NULL)
+        return;
+    while(files.size() < max && NULL != (ent = readdir(dir)))
+    {
+        // the kernel hex encodes names with spaces and quotes
+        if(strpbrk(ent->d_name, " \"\\"))
+            continue;
+        TestFile f;
+        f.path = std::string(dir_name) + "/" + ent->d_name;
+        if(0 != lstat(f.path.c_str(), &st) || !S_ISREG(st.st_mode))
+            continue;
+        f.dev = st.st_dev;
+        f.ino = st.st_ino;
+        files.push_back(f);
+    }
+    closedir(dir);
+}
+
+static void writeRecord(FILE* out, int type, const char* data)
+{
+    __u32 header[2] = { (__u32)type, (__u32)strlen(data) };
+    fwrite(header, sizeof(header), 1, out);
+    fwrite(data, 1, header[1], out);
+}
+
+/*
+ * Write one openat(2) event per iteration as the kernel sends it:
+ * SYSCALL, CWD, PATH and EOE records sharing a serial number.
+ * The pid carries the event number so the catcher can check the flags.
+ */
+static void writeCapture(FILE* out, const std::vector<TestFile>& files, size_t events)
+{
+    char buf[1024];
+    __u32 version = CAPTURE_VERSION;
+
+    fwrite(CAPTURE_MAGIC, 1, sizeof(CAPTURE_MAGIC) - 1, out);
+    fwrite(&version, sizeof(version), 1, out);
+
+    for(size_t i = 0; i < events; i++)
+    {
+        const TestFile& f = files[i % files.size()];
+        unsigned long serial = i + 1;
+        int flags = i % WRITE_EVERY == WRITE_EVERY - 1 ? O_WRONLY : O_RDONLY;
+        const char* stamp = "audit(1700000000.%03lu:%lu): ";
+
+        int len = sprintf(buf, stamp, i % 1000, serial);
+        sprintf(buf + len, "arch=c000003e syscall=257 success=yes exit=3 a0=ffffff9c "
+                "a1=7ffd5e2a%04lx a2=%x a3=0 items=1 ppid=1 pid=%lu auid=0 uid=0 "
+                "gid=0 euid=0 suid=0 fsuid=0 egid=0 sgid=0 fsgid=0 tty=(none) "
+                "ses=1 comm=\"bench\" exe=\"/usr/bin/bench\" key=(null)",
+                i & 0xffff, flags, (unsigned long)(i + 2));
+        writeRecord(out, AUDIT_SYSCALL, buf);
+
+        sprintf(buf + len, "cwd=\"/\"");
+        writeRecord(out, AUDIT_CWD, buf);
+
+        sprintf(buf + len, "item=0 name=\"%s\" inode=%lu dev=%02x:%02x mode=0100644 "
+                "ouid=0 ogid=0 rdev=00:00 nametype=NORMAL",
+                f.path.c_str(), (unsigned long)f.ino, major(f.dev), minor(f.dev));
+        writeRecord(out, AUDIT_PATH, buf);
+
+        buf[len] = '\0';
+        writeRecord(out, AUDIT_EOE, buf);
+    }
+}
+
+/*
+ * Keep a reference to every resolved file like ScanFsAccess does, so
+ * repeated reads take the known-file path of the listener.
+ */
+class CheckingCatcher : public EventCatcher
+{
+    public:
+        CheckingCatcher() : events(0), known(0), failures(0) {}
+        virtual void handleAuditEvents(AuditEvent* const* batch, size_t count)
+        {
+            for(size_t i = 0; i < count; i++)
+            {
+                AuditEvent* e = batch[i];
+                size_t n = e->pid - 2;
+                events++;
+
+                if(e->type != OpenAt)
+                    fail(n, "openat is not reported as OpenAt");
+                if(e->readOnly != (n % WRITE_EVERY != WRITE_EVERY - 1))
+                    fail(n, "open flags not taken from a2");
+                if(e->known)
+                {
+                    known++;
+                    if(!e->path.empty())
+                        fail(n, "known file has been resolved");
+                }
+                else if(e->path.empty())
+                    fail(n, "path is missing");
+                else
+                    files.push_back(FilePtr(e->dev, e->ino, e->path));
+            }
+        }
+        void fail(size_t n, const char* what)
+        {
+            if(failures++ < 10)
+                fprintf(stderr, "event %lu: %s\n", (unsigned long)n, what);
+        }
+        size_t events;
+        size_t known;
+        size_t failures;
+    private:
+        std::vector<FilePtr> files;
+};
+
+/*
+ * Usage: bench-replay [number of events] [directory of test files]
+ */
+int main(int argc, char* argv[])
+{
+    size_t events = argc > 1 ? atoi(argv[1]) : 1000000;
+    const char* dir = argc > 2 ? argv[2] : "/usr/bin";
+    std::vector<TestFile> files;
+    char capture[] = "/tmp/bench-replay.XXXXXX";
+
+    logger.setVerboseLevel(1);
+    listFiles(dir, 1000, files);
+    if(files.empty())
+    {
+        fprintf(stderr, "No regular files in %s\n", dir);
+        return EXIT_FAILURE;
+    }
+
+    int fd = mkstemp(capture);
+    FILE* out = fd < 0 ? NULL : fdopen(fd, "w");
+    if(out == NULL)
+    {
+        perror(capture);
+        return EXIT_FAILURE;
+    }
+    writeCapture(out, files, events);
+    fclose(out);
+
+    CheckingCatcher catcher;
+    AuditListener listener;
+    listener.setEventCatcher(&catcher);
+
+    double t0 = now();
+    bool ok = listener.replay(capture);
+    double t1 = now();
+    unlink(capture);
+
+    printf("%lu events (%lu known) from %lu files: %.0f ns/event\n",
+           (unsigned long)catcher.events, (unsigned long)catcher.known,
+           (unsigned long)files.size(), (t1 - t0) / events * 1e9);
+
+    if(!ok || catcher.events != events)
+    {
+        fprintf(stderr, "%lu of %lu events reached the catcher\n",
+                (unsigned long)catcher.events, (unsigned long)events);
+        catcher.failures++;
+    }
+    return catcher.failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}